@@ -15,23 +15,51 @@
     along with this program. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <strings.h>
+#include <time.h>
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <deadbeef/deadbeef.h>
+#include "beefmote_status.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef BEEFMOTE_IO_URING
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define DEBUG 1
 #define BEEFMOTE_DEFAULT_PORT 49160
@@ -40,6 +68,62 @@
 #define BEEFMOTE_STR_MAXLENGTH 1000
 #define BEEFMOTE_VOLUME_STEP 5
 #define BEEFMOTE_SEEK_STEP 5
+#define BEEFMOTE_ADJUST_WINDOW_MS 100
+#define BEEFMOTE_MAX_CLIENTS 64
+#define BEEFMOTE_LISTENERS_MAX 4
+#define BEEFMOTE_UDP_MAGIC "BM"
+#define BEEFMOTE_UDP_VERSION 2
+#define BEEFMOTE_UDP_HEADER_LENGTH 12
+#define BEEFMOTE_UDP_TAG_LENGTH 8
+#define BEEFMOTE_UDP_MAX_LENGTH 128
+#define BEEFMOTE_UDP_SENDERS_MAX 16
+#define BEEFMOTE_MAX_EVENTS 64
+#define BEEFMOTE_NAME_MAXLENGTH 64
+#define BEEFMOTE_CHUNK_SIZE 4096
+#define BEEFMOTE_FLUSH_IOV_N 16
+#define BEEFMOTE_QUEUE_LOW_WATERMARK (64 * 1024)
+#define BEEFMOTE_QUEUE_HIGH_WATERMARK (256 * 1024)
+#define BEEFMOTE_QUEUE_LIMIT (4 * 1024 * 1024)
+#define BEEFMOTE_PENDING_MAX 32
+#define BEEFMOTE_TAG_MAXLENGTH 16
+#define BEEFMOTE_STREAM_SLICE 64
+#define BEEFMOTE_WELCOME_DELAY_MS 100
+#define BEEFMOTE_IMPORT_PROGRESS_MS 250
+#define BEEFMOTE_JSON_MAXLENGTH 5000
+#define BEEFMOTE_SYNC_CHUNK 64
+#define BEEFMOTE_SYNC_FANOUT 16
+#define BEEFMOTE_SYNC_LEVELS_MAX 8
+#define BEEFMOTE_SYNC_CHUNKS_MAX 16
+#define BEEFMOTE_SESSIONS_MAX 128
+#define BEEFMOTE_SESSION_TTL_MS (10 * 60 * 1000)
+#define BEEFMOTE_SESSION_TOKEN_LENGTH 32
+#define BEEFMOTE_REPLAY_MAX 256
+#define BEEFMOTE_WORKERS_MAX 8
+#define BEEFMOTE_FORMAT_RANGE 4096
+#define BEEFMOTE_SEARCH_FIELDS_N 4
+#define BEEFMOTE_ARENA_PADDING 64
+#define BEEFMOTE_CHANGED_TRACKS_MAX 256
+#define BEEFMOTE_BROWSE_PAGE 100
+#define BEEFMOTE_QUEUE_MAX 100
+#define BEEFMOTE_UPCOMING_DEFAULT 5
+#define BEEFMOTE_UPCOMING_MAX 32
+#define BEEFMOTE_RATE_CONTROL 100
+#define BEEFMOTE_RATE_BULK 10
+#define BEEFMOTE_RATE_BURST 2
+#define BEEFMOTE_DRR_QUANTUM (64 * 1024)
+#define BEEFMOTE_FLUSH_ROUNDS_MAX 16
+#define BEEFMOTE_TIMER_TICK_MS 10
+#define BEEFMOTE_TIMER_LEVELS 4
+#define BEEFMOTE_TIMER_SLOT_BITS 6
+#define BEEFMOTE_TIMER_SLOTS (1 << BEEFMOTE_TIMER_SLOT_BITS)
+#define BEEFMOTE_KEEPALIVE_IDLE 60
+#define BEEFMOTE_KEEPALIVE_INTERVAL 10
+#define BEEFMOTE_KEEPALIVE_PROBES 6
+#define BEEFMOTE_URING_ENTRIES 256
+#define BEEFMOTE_URING_BUFFERS 512             // a power of two
+#define BEEFMOTE_URING_BUFFER_SIZE 1024
+#define BEEFMOTE_URING_CLIENT_BUFFERS 4
+#define BEEFMOTE_URING_BUFFER_GROUP 0
 
 #define beefmote_debug_print(fmt, ...) \
         do { if (DEBUG) fprintf(stderr, "[beefmote] " fmt, ##__VA_ARGS__); } while (0)
@@ -57,6 +141,7 @@ enum BEEFMOTE_COMMANDS {
     BEEFMOTE_PLAY,
     BEEFMOTE_PLAY_SEARCH,
     BEEFMOTE_PLAY_ADDRESS,
+    BEEFMOTE_PLAY_URI,
     BEEFMOTE_RANDOM,
     BEEFMOTE_PLAY_RESUME,
     BEEFMOTE_STOP_AFTER_CURRENT,
@@ -67,43 +152,670 @@ enum BEEFMOTE_COMMANDS {
     BEEFMOTE_VOLUME_DOWN,
     BEEFMOTE_SEEK_FORWARD,
     BEEFMOTE_SEEK_BACKWARD,
+    BEEFMOTE_VOLUME_SET,
+    BEEFMOTE_SEEK_TO,
     BEEFMOTE_SEARCH,
+    BEEFMOTE_SEARCH_ALL,
     BEEFMOTE_NOTIFY_PLAYLIST_CHANGED,
     BEEFMOTE_NOTIFY_PLAYLIST_SWITCHED,
     BEEFMOTE_NOTIFY_NOW_PLAYING,
+    BEEFMOTE_NOTIFY_QUEUE,
+    BEEFMOTE_NOTIFY_UPCOMING,
+    BEEFMOTE_NOTIFY_TAGGED,
     BEEFMOTE_ADD_PLAYBACKQUEUE,
     BEEFMOTE_ADD_PLAYBACKQUEUE_ADDRESS,
     BEEFMOTE_ADD_SEARCH_PLAYBACKQUEUE,
+    BEEFMOTE_ADD_PLAYBACKQUEUE_URI,
+    BEEFMOTE_IMPORT,
+    BEEFMOTE_IMPORT_CANCEL,
+    BEEFMOTE_ABORT,
+    BEEFMOTE_SYNC,
+    BEEFMOTE_SYNC_NODES,
+    BEEFMOTE_SYNC_CHUNKS,
+    BEEFMOTE_SESSION,
+    BEEFMOTE_RESUME,
+    BEEFMOTE_ARTISTS,
+    BEEFMOTE_ALBUMS,
+    BEEFMOTE_ALBUM_TRACKS,
+    BEEFMOTE_QUEUE_LIST,
+    BEEFMOTE_QUEUE_REMOVE,
+    BEEFMOTE_QUEUE_MOVE,
+    BEEFMOTE_QUEUE_CLEAR,
+    BEEFMOTE_PONG,
     BEEFMOTE_EXIT,
     BEEFMOTE_COMMANDS_N // marks end of command list
 };
 
+// Scheduling lanes. Control commands are run as soon as they arrive, even
+// ahead of commands that were sent before them; everything else is run in
+// order, one command at a time per client.
+enum BEEFMOTE_PRIORITIES {
+    BEEFMOTE_PRIORITY_NORMAL,
+    BEEFMOTE_PRIORITY_CONTROL,  // cheap transport control commands
+    BEEFMOTE_PRIORITY_BULK,     // commands with big outputs, streamed in slices or waiting on the workers
+};
+
+// Rate limits of each client. Bulk commands have their own budget; everything
+// else draws from the control one.
+enum BEEFMOTE_BUCKETS {
+    BEEFMOTE_BUCKET_CONTROL,
+    BEEFMOTE_BUCKET_BULK,
+    BEEFMOTE_BUCKETS_N
+};
+
+// A token bucket: it fills up with rate tokens a second, up to
+// BEEFMOTE_RATE_BURST seconds worth of them, and every command takes one.
+typedef struct beefmote_bucket {
+    double tokens;
+    uint64_t refilled;          // beefmote_now_ms() when we last filled it; 0 if never, i.e. full
+} beefmote_bucket;
+
 typedef struct beefmote_command {
     char name[BEEFMOTE_STR_MAXLENGTH];
     int name_len;
     char help[BEEFMOTE_STR_MAXLENGTH];
+    int priority;
     void (*execute)(int client_socket, void* data);
 } beefmote_command;
 
+// What to do with a notification for a client whose outbound queue is over
+// the high watermark (i.e. a client which isn't reading what we send it).
+enum BEEFMOTE_OVERFLOW_POLICIES {
+    BEEFMOTE_OVERFLOW_DROP,         // forget about the notification
+    BEEFMOTE_OVERFLOW_COALESCE,     // keep only the latest notification of each kind
+    BEEFMOTE_OVERFLOW_DISCONNECT,   // kick the client
+};
+
+enum BEEFMOTE_NOTIFICATIONS {
+    BEEFMOTE_NOTIFICATION_PLAYLIST_CHANGED,
+    BEEFMOTE_NOTIFICATION_PLAYLIST_SWITCHED,
+    BEEFMOTE_NOTIFICATION_NOW_PLAYING,
+    BEEFMOTE_NOTIFICATION_QUEUE,
+    BEEFMOTE_NOTIFICATION_UPCOMING,
+    BEEFMOTE_NOTIFICATIONS_N
+};
+
+// A client's settings. Sessions outlive connections, so a client that
+// reconnects can pick its settings back up with a resume token, along with
+// the events it missed (see beefmote_command_resume).
+typedef struct beefmote_session {
+    char token[BEEFMOTE_SESSION_TOKEN_LENGTH + 1];
+    bool token_issued;          // only sessions whose token was handed out can be resumed
+    bool notify[BEEFMOTE_NOTIFICATIONS_N];
+    bool tagged;                // notifications are framed as "@* line", see beefmote_client_enqueue_notification
+    uint64_t seq;               // last event the client got, or skipped because it wasn't subscribed to it
+    struct beefmote_client *client;     // NULL while detached
+    uint64_t detached_at;       // see beefmote_now_ms
+    struct beefmote_session *next;
+} beefmote_session;
+
+// A notification, as kept in the replay ring.
+typedef struct beefmote_event {
+    uint64_t seq;
+    int notification;
+    char *str;
+} beefmote_event;
+
+// The tracklist of a playlist generation, as printed by tl or tla. It's
+// formatted once into a sealed memfd, and sent from there to every client
+// asking for it with sendfile. Outbound queue chunks sending it hold a
+// reference to it, so it goes away when it's stale and the last of them is sent.
+typedef struct beefmote_snapshot {
+    int fd;
+    off_t size;
+    int refs;
+    int tracks_n;
+    off_t *slices;              // offsets of every BEEFMOTE_STREAM_SLICE-th track line
+    unsigned generation;        // playlist generation it was taken from
+} beefmote_snapshot;
+
+// A batch of jobs run by the workers (see beefmote_jobs_dispatch). Batches are
+// meant to be embedded in whatever their jobs are about, which done gets back
+// to with offsetof.
+typedef struct beefmote_batch {
+    char *jobs;
+    size_t job_size;            // of each of them
+    int jobs_n;
+    int picked;                 // jobs picked up by a worker so far
+    int left;                   // jobs not done yet
+    void (*run)(void *job);
+    void (*done)(struct beefmote_batch *batch);     // called on Beefmote's thread once every job is done
+    struct beefmote_batch *next;
+} beefmote_batch;
+
+// A range of tracks to be formatted into a snapshot by a worker.
+typedef struct beefmote_format_job {
+    DB_playItem_t **tracks;     // we hold a reference to each of them
+    int first;                  // index of the first track; a multiple of BEEFMOTE_STREAM_SLICE
+    int tracks_n;
+    bool print_addr;
+    char *buf;                  // formatted track lines
+    int len;
+    off_t slices[BEEFMOTE_FORMAT_RANGE / BEEFMOTE_STREAM_SLICE];   // like beefmote_snapshot's, relative to buf
+} beefmote_format_job;
+
+// A snapshot being taken. Tracks are formatted by the workers in rounds of a
+// few ranges per worker, so memory use stays bounded no matter how big the
+// playlist is, and each round is written out by Beefmote's thread.
+typedef struct beefmote_snapshot_build {
+    beefmote_batch batch;
+    beefmote_format_job jobs[(BEEFMOTE_WORKERS_MAX + 1) * 2];   // of the round being formatted
+    beefmote_snapshot *snapshot;
+    struct beefmote_playlist_info *info;    // to keep it in once it's sealed; NULL if it's stale by then
+    ddb_playlist_t *playlist;   // we hold a reference to it
+    DB_playItem_t **tracks;     // we hold a reference to each of them
+    int tracks_n;
+    int first;                  // first track of the round being formatted
+    unsigned generation;        // playlist generation it's taken from
+    bool print_addr;
+    bool failed;
+} beefmote_snapshot_build;
+
+// A piece of data waiting to be sent to a client.
+typedef struct beefmote_chunk {
+    struct beefmote_chunk *next;
+    int len;
+    int cap;
+    int sent;
+    bool stream;        // holds stream output, which is dropped if the stream gets aborted
+    beefmote_snapshot *snapshot;    // if set, the chunk is the snapshot's bytes from offset on, not data
+    off_t offset;
+    char data[];
+} beefmote_chunk;
+
+// A tracklist being streamed to a client. The stream is paused whenever the
+// client's outbound queue goes over the high watermark, and resumed once it
+// drains under the low watermark.
+typedef struct beefmote_tracklist_stream {
+    ddb_playlist_t *playlist;   // NULL if there's no stream going on
+    DB_playItem_t *track;       // next track to send; we hold a reference to it
+    int iter;                   // PL_MAIN for tracklists, PL_SEARCH for the client's search results
+    int idx;
+    bool print_addr;
+    bool json;                  // send the tracks as a JSON array, in HTTP chunks
+    unsigned generation;        // beefmote_playlist_generation when we last sent something
+    bool etagged;               // the HTTP response has an ETag, naming etag_generation
+    unsigned etag_generation;   // the playlist info's generation the ETag was made from
+    char tag[BEEFMOTE_TAG_MAXLENGTH + 1];  // tag of the request the stream answers, "" if untagged
+} beefmote_tracklist_stream;
+
+// An HTTP request being read from a client in HTTP mode.
+typedef struct beefmote_http_request {
+    bool in_headers;            // got the request line, now reading headers
+    bool keep_alive;
+    char method[BEEFMOTE_NAME_MAXLENGTH];
+    char target[BEEFMOTE_BUFSIZE];
+    char if_none_match[BEEFMOTE_BUFSIZE];
+} beefmote_http_request;
+
+// Hashes of a playlist's tracks, so clients can find out what changed while
+// they were away without downloading the whole tracklist again. Tracks are
+// hashed in chunks of BEEFMOTE_SYNC_CHUNK (as printed by tla), and chunk
+// hashes are arranged in a tree: level 0 holds the chunk hashes, and every
+// node of the next level hashes BEEFMOTE_SYNC_FANOUT nodes of the one below,
+// up to a single root. The lines of each chunk are kept as they were hashed,
+// so syncc sends exactly what the hashes are about.
+typedef struct beefmote_sync_tree {
+    bool valid;
+    unsigned generation;        // playlist generation the hashes are for
+    uint64_t changed_seq;       // last beefmote_changed_seq we went through
+    int tracks_n;
+    DB_playItem_t **tracks;     // the tracks hashed; we hold a reference to each of them
+    char **lines;               // track lines of each chunk, as hashed
+    int levels_n;               // 0 for empty playlists
+    int level_n[BEEFMOTE_SYNC_LEVELS_MAX];
+    uint64_t *level[BEEFMOTE_SYNC_LEVELS_MAX];
+    uint64_t root;
+    struct beefmote_sync_build *build;  // bringing the hashes up to date, NULL if none
+} beefmote_sync_tree;
+
+// A chunk of tracks to be formatted and hashed by a worker, for sync hashes.
+typedef struct beefmote_sync_job {
+    beefmote_format_job format;
+    int chunk;
+    uint64_t hash;
+} beefmote_sync_job;
+
+// Sync hashes being brought up to date. Chunks with the same tracks as
+// before, none of which had its metadata changed, keep their hashes; the
+// others are formatted and hashed again by the workers.
+typedef struct beefmote_sync_build {
+    beefmote_batch batch;
+    beefmote_sync_job *jobs;    // one for each chunk hashed again
+    struct beefmote_playlist_info *info;
+    int tracks_n;
+    DB_playItem_t **tracks;     // we hold a reference to each of them
+    char **lines;               // like beefmote_sync_tree's; the kept ones are already there
+    uint64_t *chunks;           // likewise, for the hashes
+    unsigned generation;
+    uint64_t changed_seq;
+} beefmote_sync_build;
+
+// An artist of a playlist, as listed by the ar command.
+typedef struct beefmote_artist {
+    char *key;                  // case folded name, which artists are told apart by
+    char *name;                 // as we first saw it
+    int tracks_n;
+    int *albums;                // ids of its albums with tracks, albums_n of them, in no particular order
+    int albums_n;
+    int albums_cap;
+} beefmote_artist;
+
+// An artist's album, as listed by the al command.
+typedef struct beefmote_album {
+    int artist;
+    int artist_pos;             // where it is in its artist's albums, while it has tracks
+    char *key;
+    char *name;
+    int *tracks;                // mirror indexes of its tracks, tracks_n of them, in no particular order
+    int tracks_n;
+    int tracks_cap;
+    double duration;            // in seconds
+} beefmote_album;
+
+// Artists and albums of a playlist, with their albums, tracks and durations.
+// They're kept up to date along with the search mirror, counting in the
+// tracks that come and counting out the ones that go, so browsing never has
+// to go through the whole playlist. Ids are indexes in the arrays and never
+// change: artists and albums left without tracks stay around, hidden.
+typedef struct beefmote_browse {
+    beefmote_artist *artists;
+    int artists_n;
+    int artists_cap;
+    beefmote_album *albums;
+    int albums_n;
+    int albums_cap;
+    int *artist_slots;          // open addressing tables of ids, by hash of the key; -1 if free
+    int artist_slots_n;         // a power of two
+    int *album_slots;
+    int album_slots_n;
+    int *sorted;                // ids of the artists with tracks, sorted by key
+    int sorted_n;
+    bool sorted_valid;          // false when an artist got its first track or lost its last one
+} beefmote_browse;
+
+// Case folded copies of the fields we search (see beefmote_search_fields),
+// so that searching scans contiguous memory instead of going through every
+// track's metadata list. Each field has an arena holding every track's value
+// followed by a 0, in playlist order, and the offsets where each of them
+// starts. Arenas are followed by BEEFMOTE_ARENA_PADDING zeros, so scanning
+// can read a whole vector past the last value.
+typedef struct beefmote_search_mirror {
+    bool valid;
+    uint64_t fingerprint;       // of the tracks it was built from, like beefmote_playlist_info's
+    uint64_t changed_seq;       // last beefmote_changed_seq we went through
+    int tracks_n;
+    DB_playItem_t **tracks;     // we hold a reference to each of them
+    int *slots;                 // open addressing table of track indexes, by track address; -1 if free
+    int slots_n;                // a power of two
+    char *arena[BEEFMOTE_SEARCH_FIELDS_N];
+    size_t arena_len[BEEFMOTE_SEARCH_FIELDS_N];
+    size_t arena_cap[BEEFMOTE_SEARCH_FIELDS_N];
+    size_t *offsets[BEEFMOTE_SEARCH_FIELDS_N];  // tracks_n + 1 of them, the last one is arena_len
+    int *album_of;              // album id of each track, see beefmote_browse
+    int *album_pos;             // where each track is in its album's tracks
+    float *durations;           // duration of each track, as counted in its album
+    beefmote_browse browse;
+    int scans;                  // search jobs in flight going through it, see beefmote_search_all
+    struct beefmote_search_mirror *retired;     // what it was before being built again while they were
+} beefmote_search_mirror;
+
+// A playlist to be searched by a worker, for a search of all playlists. Its
+// mirror is brought up to date beforehand, and the job goes through a copy of
+// it, so that Beefmote's thread can build it again in the meantime.
+typedef struct beefmote_search_job {
+    ddb_playlist_t *playlist;   // we hold a reference to it
+    int plt_idx;
+    beefmote_search_mirror *mirror;
+    beefmote_search_mirror view;
+    const char *needle;         // case folded
+    size_t k;
+    int *hits;                  // mirror indexes of the tracks found, in playlist order
+    int hits_n;                 // -1 if we ran out of memory
+} beefmote_search_job;
+
+// A search of all playlists, for a client waiting for its results.
+typedef struct beefmote_search_batch {
+    beefmote_batch batch;
+    beefmote_search_job *jobs;  // one for each playlist we could search
+    int jobs_n;
+    char *needle;
+    ddb_playlist_t *playlist;   // the one results are streamed from; we hold a reference to it
+    char tag[BEEFMOTE_TAG_MAXLENGTH + 1];   // of the request it replies to
+} beefmote_search_batch;
+
+// Where the tracks of a playlist are by file path (their :URI metadata), for
+// pu and apu. Built again only when the playlist's content changes.
+typedef struct beefmote_uri_index {
+    bool valid;
+    uint64_t fingerprint;       // of the tracks it was built from, like beefmote_playlist_info's
+    int tracks_n;
+    DB_playItem_t **tracks;     // we hold a reference to each of them
+    uint64_t *hashes;           // of each track's path
+    int *slots;                 // open addressing table of track indexes, by path hash; -1 if free
+    int slots_n;                // a power of two
+} beefmote_uri_index;
+
+// Finds the first occurrence of a k bytes long needle (k > 0) in hay, starting
+// at from and ending by end. Returns its position, or end if there's none.
+typedef size_t (*beefmote_scan_function)(const char *hay, size_t from, size_t end, const char *needle, size_t k);
+
+// What we know about the content of a playlist. Deadbeef doesn't tell which
+// playlist changed, so whenever something changes we compare the playlist's
+// tracks with the ones we took last time. We hold on to those, so a track
+// added since can't have been given the address of one removed since. Only
+// used by Beefmote's thread.
+typedef struct beefmote_playlist_info {
+    ddb_playlist_t *playlist;   // we hold a reference to it
+    unsigned generation;        // bumped every time we find its content changed
+    unsigned content_checked;   // beefmote_playlist_generation when we last checked it
+    unsigned metadata_checked;  // beefmote_metadata_generation when we last checked it
+    int tracks_n;
+    DB_playItem_t **tracks;     // when we last checked; we hold a reference to each of them
+    uint64_t fingerprint;       // FNV-1a over the addresses of the tracks, in order
+    beefmote_sync_tree sync;
+    beefmote_snapshot *snapshots[2];    // without and with track addresses
+    beefmote_snapshot_build *builds[2]; // being taken, likewise
+    beefmote_search_mirror mirror;
+    beefmote_uri_index uris;
+    struct beefmote_playlist_info *next;
+} beefmote_playlist_info;
+
+// A timer of the timer wheel (see beefmote_timer_set). Timers are meant to be
+// embedded in whatever they're about, which fire gets back to with offsetof.
+typedef struct beefmote_timer {
+    uint64_t expires;           // in ticks of BEEFMOTE_TIMER_TICK_MS
+    void (*fire)(struct beefmote_timer *timer);
+    bool armed;
+    int level;                  // where it sits in the wheel while armed
+    int slot;
+    struct beefmote_timer *prev;
+    struct beefmote_timer *next;
+} beefmote_timer;
+
+#ifdef BEEFMOTE_IO_URING
+// Kinds of io_uring requests, kept in the top byte of their user_data. The
+// rest holds the socket and, for client requests, the client's serial number,
+// so completions that show up after a client is gone are told apart from those
+// of a new client on the same socket.
+enum BEEFMOTE_URING_OPS {
+    BEEFMOTE_URING_PROBE,
+    BEEFMOTE_URING_ACCEPT,      // multishot, on TCP and Unix listeners
+    BEEFMOTE_URING_POLL,        // multishot, on the wakeup eventfd and UDP listeners
+    BEEFMOTE_URING_RECV,        // multishot, into provided buffers
+    BEEFMOTE_URING_POLLOUT,     // on clients whose socket is full
+    BEEFMOTE_URING_SEND,
+    BEEFMOTE_URING_CANCEL,
+};
+
+// An io_uring instance, set up with raw syscalls. Received data lands in a
+// ring of BEEFMOTE_URING_BUFFERS provided buffers registered with the kernel,
+// which are handed back once the data has been taken. Only used by Beefmote's
+// thread.
+typedef struct beefmote_uring {
+    int fd;
+    void *rings;
+    size_t rings_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    unsigned sq_local_tail;     // includes the requests we prepared but haven't submitted yet
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned short buf_tail;
+    char *buffers;
+    int buf_len[BEEFMOTE_URING_BUFFERS];    // received bytes in each buffer
+    int buf_next[BEEFMOTE_URING_BUFFERS];   // next buffer held by the same client
+    struct io_uring_cqe *deferred;          // completions reaped while sending, handled later
+    int deferred_n;
+    int deferred_cap;
+    uint32_t serial;            // last client serial number handed out
+} beefmote_uring;
+#endif
+
+// A socket we accept connections (or datagrams) on.
+typedef struct beefmote_listener {
+    int socket;
+    int family;
+    int type;
+    char path[sizeof(((struct sockaddr_un*) NULL)->sun_path)];  // AF_UNIX only
+} beefmote_listener;
+
+// Control datagrams look like this (integers are big endian):
+//
+//   offset  size  field
+//   0       2     magic, "BM"
+//   2       1     version, BEEFMOTE_UDP_VERSION
+//   3       1     reserved, 0
+//   4       4     sender id, picked at random by the sender every time it starts
+//   8       4     sequence number, incremented by the sender for every datagram
+//   12      n     command, e.g. "vu 3"; only control commands are accepted
+//   12 + n  8     SipHash-2-4 of all of the above, keyed with the shared secret
+//                 (see beefmote_udp_derive_key), as a little endian integer
+//
+// We remember the last sequence number of the last BEEFMOTE_UDP_SENDERS_MAX
+// senders, and drop datagrams which don't come after it. That is only kept
+// while Deadbeef runs, so a datagram captured on the network can be replayed
+// once after Deadbeef restarts, or once we've heard from that many other
+// senders. Only control commands are accepted anyway; changing the secret
+// makes every datagram sent before useless.
+typedef struct beefmote_udp_sender {
+    uint32_t id;
+    uint32_t seq;
+    uint64_t last_seen;     // beefmote_udp_clock when we last heard from it; 0 if unused
+} beefmote_udp_sender;
+
+// What a client searched last, so that when it searches for a text containing
+// that one (as it does while the user types) we only look among the tracks
+// found last time: whatever contains the longer text contains the shorter one.
+typedef struct beefmote_search_session {
+    ddb_playlist_t *playlist;   // we hold a reference to it; NULL if there's nothing to go on
+    uint64_t fingerprint;       // of the search mirror searched
+    uint64_t changed_seq;       // the mirror's, so we know no metadata changed since
+    char *text;                 // case folded
+    size_t text_len;
+    int *hits;                  // mirror indexes of the tracks found, in playlist order
+    int hits_n;
+} beefmote_search_session;
+
+typedef struct beefmote_client {
+    int socket;
+    uint32_t events;                        // epoll events we're currently waiting for
+    char name[BEEFMOTE_NAME_MAXLENGTH];     // peer address, for debug prints
+    char in[BEEFMOTE_BUFSIZE];              // received data not yet processed
+    int in_len;
+    char line[BEEFMOTE_STR_MAXLENGTH];      // output line being composed by a command
+    int line_len;
+    bool line_continued;                    // the last line queued didn't end, so this one doesn't get a tag
+    char tag[BEEFMOTE_TAG_MAXLENGTH + 1];   // tag of the request being run, "" if untagged
+    bool reply_deferred;                    // the request being run is replied to later on, e.g. by an import
+    beefmote_batch *awaiting;               // batch the reply to the last request run waits for, if any
+    int sync_comm_id;                       // sync command waiting for sync hashes (see awaiting)
+    char *sync_args;                        // its arguments, NULL if there's none waiting
+    char sync_tag[BEEFMOTE_TAG_MAXLENGTH + 1];  // and its tag
+    beefmote_chunk *out_head;               // outbound queue
+    beefmote_chunk *out_tail;
+    int out_bytes;
+    bool throttled;     // went over the high watermark and hasn't drained under the low one yet
+    int deficit;        // bytes it may still send in its turn, see beefmote_clients_flush
+    beefmote_bucket buckets[BEEFMOTE_BUCKETS_N];
+    bool blocked;       // the socket didn't take everything we had to send
+    bool closing;       // will be closed as soon as the network thread gets to it
+    bool close_when_done;   // will be closed once everything has been sent
+    bool welcome_pending;   // welcome message held back until we know it isn't an HTTP client
+    beefmote_timer welcome_timer;   // sends the welcome message anyway
+    beefmote_timer ping_timer;      // pings the client when it's been quiet for a while
+    beefmote_timer idle_timer;      // closes the connection when it's been quiet for too long
+    bool http;              // speaks HTTP instead of Beefmote's protocol
+    beefmote_session *session;  // NULL until the client needs one
+    beefmote_http_request request;
+    char *coalesced[BEEFMOTE_NOTIFICATIONS_N];  // notifications held back by the coalesce policy
+    beefmote_tracklist_stream stream;
+    DB_playItem_t **results;    // last search results, so ps and aps pick what the client was shown
+    int results_n;
+    int *results_plt;           // index of the playlist each result is in, if they're from all playlists
+    beefmote_search_session search;
+    char *pending[BEEFMOTE_PENDING_MAX];    // non-control commands waiting for their turn, oldest first
+    int pending_first;
+    int pending_n;
+#ifdef BEEFMOTE_IO_URING
+    uint32_t serial;            // see BEEFMOTE_URING_OPS
+    bool recv_armed;            // a multishot recv is in flight
+    bool recv_paused;           // it's being cancelled, because we're holding too many of its buffers
+    bool pollout_armed;
+    bool sending;               // still sending in the current beefmote_uring_flush
+    int held_first;             // provided buffers with data we haven't taken yet, oldest first
+    int held_last;
+    int held_n;
+    int held_offset;            // bytes of the first one already taken
+    struct iovec send_iov[BEEFMOTE_FLUSH_IOV_N];
+    struct msghdr send_msg;
+#endif
+    struct beefmote_client *prev;
+    struct beefmote_client *next;
+} beefmote_client;
+
+// A background import of files and folders into a playlist (see
+// beefmote_command_import). There's one at most, as Deadbeef only takes one
+// batch of adds at a time anyway. The counters and flags are shared with the
+// import thread; the rest is only used by Beefmote's thread.
+typedef struct beefmote_import_job {
+    intptr_t tid;               // 0 if there's no import going on
+    ddb_playlist_t *playlist;   // we hold a reference to it
+    char *paths;                // tab separated
+    int paths_n;
+    beefmote_client *client;    // who asked for it, NULL if it's gone
+    char tag[BEEFMOTE_TAG_MAXLENGTH + 1];
+    beefmote_timer timer;       // reports progress every BEEFMOTE_IMPORT_PROGRESS_MS
+    int reported;               // scanned + errors when we last reported progress
+    int scanned;                // files tried, and tracks Deadbeef found in folders
+    int added;                  // tracks added
+    int errors;                 // files that couldn't be added and folders that couldn't be read
+    bool running;               // playlist change notifications are held back while it's true
+    bool cancel;                // tells the import thread to stop
+    bool done;                  // the import thread is finished
+} beefmote_import_job;
+
+// Things clients change in steps, which beefmote_adjust applies no more than
+// once every BEEFMOTE_ADJUST_WINDOW_MS.
+enum BEEFMOTE_ADJUSTERS {
+    BEEFMOTE_ADJUSTER_VOLUME,
+    BEEFMOTE_ADJUSTER_POSITION,
+    BEEFMOTE_ADJUSTERS_N
+};
+
+// Folds the volume changes or seeks of a burst (a volume knob being turned,
+// a seek button being held) into one per window, so Deadbeef doesn't seek
+// the decoder dozens of times a second. Only used by Beefmote's thread.
+typedef struct beefmote_adjuster {
+    float (*get)(float *min, float *max);   // current value, and the range it can be set to
+    void (*set)(float value);
+    float target;               // last value set or to be set, while the window is open
+    bool pending;               // target has to be set yet
+    beefmote_timer timer;       // armed while a window is open
+} beefmote_adjuster;
+
 // Globals.
 static DB_functions_t *deadbeef;        // deadbeef's plugin API
 static DB_beefmote_plugin_t beefmote_plugin;    // beefmote's plugin description
 static uintptr_t beefmote_stopthread_mutex;
 static intptr_t beefmote_tid;
 static int beefmote_stopthread;
-static int beefmote_socket;
-static int beefmote_client_socket;
+static beefmote_listener beefmote_listeners[BEEFMOTE_LISTENERS_MAX];
+static int beefmote_listeners_n;
+static uint8_t beefmote_udp_key[16];
+static beefmote_udp_sender beefmote_udp_senders[BEEFMOTE_UDP_SENDERS_MAX];
+static uint64_t beefmote_udp_clock;
+static int beefmote_epoll;
+static int beefmote_wakeup;             // eventfd used to wake up Beefmote's thread
+static uintptr_t beefmote_clients_mutex;        // protects the client list and outbound queues
+static beefmote_client *beefmote_clients;
+static beefmote_client **beefmote_clients_by_socket;
+static int beefmote_clients_by_socket_n;
+static int beefmote_clients_n;
+static int beefmote_queue_low;
+static int beefmote_queue_high;
+static int beefmote_queue_limit;
+static int beefmote_overflow_policy;
+static unsigned beefmote_playlist_generation;   // bumped every time the content of a playlist changes
+static unsigned beefmote_metadata_generation;   // bumped every time the metadata of a track changes
+static beefmote_playlist_info *beefmote_playlist_infos;
+static unsigned long beefmote_boot_id;  // tells apart ETags from different runs
+static unsigned beefmote_snapshots_checked[2];  // content and metadata generations when we last swept snapshots
+static intptr_t beefmote_workers[BEEFMOTE_WORKERS_MAX];
+static int beefmote_workers_n;
+static bool beefmote_workers_stop;
+static uintptr_t beefmote_jobs_mutex;           // protects the batches below
+static uintptr_t beefmote_jobs_cond;            // signaled when there are jobs to run, or workers must stop
+static uintptr_t beefmote_jobs_done_cond;       // signaled when a batch is done
+static beefmote_batch *beefmote_batches;        // with jobs left to pick up, oldest first
+static beefmote_batch **beefmote_batches_tail;
+static beefmote_batch *beefmote_batches_done;   // waiting for beefmote_jobs_collect
+static int beefmote_batches_n;                  // dispatched and not collected yet, only used by Beefmote's thread
+static beefmote_import_job beefmote_import;
+static beefmote_adjuster beefmote_adjusters[BEEFMOTE_ADJUSTERS_N];
+static const char *beefmote_search_fields[BEEFMOTE_SEARCH_FIELDS_N] = { "artist", "album", "title", ":URI" };
+static beefmote_scan_function beefmote_scan;    // the fastest one this CPU can run
+static DB_playItem_t *beefmote_changed_tracks[BEEFMOTE_CHANGED_TRACKS_MAX];    // ring of tracks whose metadata changed, protected by beefmote_clients_mutex
+static uint64_t beefmote_changed_seq;   // tracks ever put in the ring
+static const uint8_t beefmote_sync_key[16];     // sync hashes only have to be the same from one sync to the next
+static uintptr_t beefmote_queue_mutex;  // protects the playback queue as we last saw it
+static DB_playItem_t *beefmote_queue[BEEFMOTE_QUEUE_MAX];     // we hold a reference to each of them
+static int beefmote_queue_n;
 static beefmote_command beefmote_commands[BEEFMOTE_COMMANDS_N];
 static DB_playItem_t* beefmote_currtrack;
-static bool beefmote_notify_playlist_changed;
-static bool beefmote_notify_playlist_switched;
-static bool beefmote_notify_now_playing;
+static beefmote_session *beefmote_sessions;     // protected by beefmote_clients_mutex
+static int beefmote_sessions_n;
+static beefmote_event beefmote_events[BEEFMOTE_REPLAY_MAX];     // replay ring, protected by beefmote_clients_mutex
+static uint64_t beefmote_event_seq;     // last event recorded
+static beefmote_timer *beefmote_wheel[BEEFMOTE_TIMER_LEVELS][BEEFMOTE_TIMER_SLOTS];    // only used by Beefmote's thread
+static uint64_t beefmote_wheel_occupied[BEEFMOTE_TIMER_LEVELS];    // bit i set if slot i of the level has timers
+static uint64_t beefmote_wheel_tick;    // last tick we went through
+static int beefmote_idle_timeout;       // in seconds, 0 if disabled
+static int beefmote_ping_interval;      // in seconds, 0 if disabled
+static int beefmote_keepalive;          // TCP keepalive idle time, in seconds, 0 if disabled
+static int beefmote_upcoming_n;         // tracks listed after the current one by [BEEFMOTE_UPCOMING_BEGIN]
+static int beefmote_rates[BEEFMOTE_BUCKETS_N];  // commands a second each client may send, 0 if unlimited
+static uintptr_t beefmote_status_mutex;         // serializes writing the status page, the seqlock's writer side
+static beefmote_status *beefmote_status_page;   // NULL if it's turned off
+static char beefmote_status_name[BEEFMOTE_NAME_MAXLENGTH];
+#ifdef BEEFMOTE_IO_URING
+static beefmote_uring beefmote_ring;
+static bool beefmote_uring_enabled;     // whether we're using io_uring instead of epoll
+#endif
 
 // Beefmote's settings dialog widget description.
 static const char beefmote_settings_dialog[] = {
     "property \"Disable\" checkbox beefmote.disable 0;" \
     "property \"IP\" entry beefmote.ip \"\";\n" \
-    "property \"Port\" entry beefmote.port \"\";\n"
+    "property \"Port\" entry beefmote.port \"\";\n" \
+    "property \"Listen on IPv6 too (dual-stack)\" checkbox beefmote.ipv6 0;\n" \
+    "property \"Unix socket path (empty to disable)\" entry beefmote.unix_socket \"\";\n" \
+    "property \"Unix socket permissions (octal)\" entry beefmote.unix_socket_mode \"0600\";\n" \
+    "property \"UDP control port (0 to disable)\" entry beefmote.udp_port \"0\";\n" \
+    "property \"UDP control secret\" password beefmote.udp_secret \"\";\n" \
+    "property \"Outbound queue low watermark (bytes)\" entry beefmote.queue_low \"65536\";\n" \
+    "property \"Outbound queue high watermark (bytes)\" entry beefmote.queue_high \"262144\";\n" \
+    "property \"Outbound queue limit (bytes)\" entry beefmote.queue_limit \"4194304\";\n" \
+    "property \"Slow client policy\" select[3] beefmote.overflow_policy 1 drop coalesce disconnect;\n" \
+    "property \"Idle timeout (seconds, 0 to disable)\" entry beefmote.idle_timeout \"0\";\n" \
+    "property \"Ping interval (seconds, 0 to disable)\" entry beefmote.ping_interval \"0\";\n" \
+    "property \"TCP keepalive idle time (seconds, 0 to disable)\" entry beefmote.keepalive \"60\";\n" \
+    "property \"Upcoming tracks sent on song change (up to 32)\" entry beefmote.upcoming \"5\";\n" \
+    "property \"Commands a second per connection (0 to disable)\" entry beefmote.rate_control \"100\";\n" \
+    "property \"Tracklists and searches a second per connection (0 to disable)\" entry beefmote.rate_bulk \"10\";\n" \
+    "property \"Publish a status page in shared memory (see beefmote_status.h)\" checkbox beefmote.status_page 0;\n"
+#ifdef BEEFMOTE_IO_URING
+    "property \"Use io_uring (falls back to epoll if the kernel can't)\" checkbox beefmote.io_uring 0;\n"
+#endif
 };
 
 
@@ -114,19 +826,259 @@ static const char beefmote_settings_dialog[] = {
 // Beefmote's thread function. This is where the magic happens.
 static void beefmote_thread(void *data);
 
-// Prepares Beefmote's socket for listening.
+// Worker thread function. Workers help format snapshots of big playlists.
+static void beefmote_worker(void *data);
+
+// Starts one worker per core, except for the one Beefmote's thread runs on.
+static void beefmote_workers_start();
+
+// Stops all workers.
+static void beefmote_workers_stop_all();
+
+// Import thread function. Adds the files and folders of an import to its
+// playlist, so the disk is never touched by Beefmote's thread.
+static void beefmote_import_thread(void *data);
+
+// Adds a folder and its subfolders to an import's playlist with plt_add_dir2,
+// so that Deadbeef handles cue sheets, archives and its own folder settings.
+// Its callback only hears about the tracks added, so those are all we count
+// as scanned; files Deadbeef skips aren't counted at all.
+static void beefmote_import_dir(beefmote_import_job *job, const char *path);
+
+// Adds a file to an import's playlist, counting it.
+static void beefmote_import_file(beefmote_import_job *job, const char *path);
+
+// Counts a track added by an import, and tells Deadbeef to stop adding if the
+// import was cancelled. See plt_add_file2.
+static int beefmote_import_added(DB_playItem_t *track, void *data);
+
+// Counts a track found in a folder by an import, like beefmote_import_added.
+// See plt_add_dir2.
+static int beefmote_import_found(DB_playItem_t *track, void *data);
+
+// Timer callback (see beefmote_timer_set) which reports the progress of an
+// import to whoever asked for it, and cleans up once it's finished.
+static void beefmote_import_progress(beefmote_timer *timer);
+
+// Waits for the import thread to finish, and frees the import.
+static void beefmote_import_free();
+
+// Moves an adjuster's value by value if relative, or to value otherwise,
+// within its range. The first change of a burst is made right away, and then a
+// window opens in which changes only move the target, which is set when the
+// window ends. Returns the new target.
+static float beefmote_adjust(beefmote_adjuster *adjuster, float value, bool relative);
+
+// Timer callback (see beefmote_timer_set) which ends an adjuster's window,
+// setting its target if it moved, in which case another window opens.
+static void beefmote_adjust_window_end(beefmote_timer *timer);
+
+// get and set functions of the adjusters, see beefmote_adjuster. The position
+// is in seconds into the playing track; it can't be set if there's none, or
+// its duration is unknown.
+static float beefmote_adjust_volume_get(float *min, float *max);
+static void beefmote_adjust_volume_set(float value);
+static float beefmote_adjust_position_get(float *min, float *max);
+static void beefmote_adjust_position_set(float value);
+
+// Parses a number taking up all of str, but for trailing spaces. Returns
+// whether it's one and finite.
+static bool beefmote_parse_float(const char *str, float *value);
+
+// Prints "[BEEFMOTE_VOLUME] dB" to a client.
+static void beefmote_print_volume(int client_socket, float volume);
+
+// Seeks the playing track by value percent of its duration if relative, or to
+// value seconds otherwise, and prints the position it leads to to a client.
+static void beefmote_seek(int client_socket, float value, bool relative);
+
+// Hands a batch of jobs over to the workers and returns right away. done is
+// called by beefmote_jobs_collect once all of them are done.
+static void beefmote_jobs_dispatch(beefmote_batch *batch, void *jobs, size_t job_size, int jobs_n,
+                                   void (*run)(void *job), void (*done)(beefmote_batch *batch));
+
+// Calls done for the batches whose jobs are all done. Beefmote's thread is
+// woken up when there are some.
+static void beefmote_jobs_collect();
+
+// Waits for every batch dispatched to be done and collects them.
+static void beefmote_jobs_drain();
+
+// Formats the tracks of a beefmote_format_job.
+static void beefmote_job_format(void *data);
+
+// Searches the playlist of a beefmote_search_job.
+static void beefmote_job_search(void *data);
+
+// Formats and hashes the chunk of a beefmote_sync_job.
+static void beefmote_job_sync(void *data);
+
+// Waits up to timeout milliseconds for something to happen on our sockets,
+// and takes care of it: accepts connections, reads what clients sent us, and
+// runs control datagrams.
+static void beefmote_wait(int timeout);
+
+// Sends as much of every client's outbound queue as their sockets take without
+// blocking. beefmote_clients_mutex must be held.
+static void beefmote_clients_flush();
+
+#ifdef BEEFMOTE_IO_URING
+// Sets up io_uring, and checks that the kernel supports everything we use of
+// it (multishot recv came last, in Linux 6.0). Returns false if it doesn't, so
+// we use epoll instead. The wakeup eventfd must be open.
+static bool beefmote_uring_init();
+
+// Tears io_uring down, cancelling everything in flight.
+static void beefmote_uring_free();
+
+// Returns a zeroed submission queue entry for a request, submitting the queue
+// first if it's full.
+static struct io_uring_sqe *beefmote_uring_sqe(int op, int fd, uint32_t serial);
+
+// Submits the requests we prepared and, if wait_n > 0, waits until there are
+// that many completions, or for timeout milliseconds.
+static void beefmote_uring_enter(unsigned wait_n, int timeout);
+
+// Takes the next completion, if any.
+static bool beefmote_uring_reap(struct io_uring_cqe *cqe);
+
+// Handles a completion, other than a send's.
+static void beefmote_uring_handle(struct io_uring_cqe *cqe);
+
+// Waits for completions like beefmote_wait.
+static void beefmote_uring_wait(int timeout);
+
+// Flushes all clients like beefmote_clients_flush, sending them all in a
+// single io_uring_enter, as many times as it takes.
+static void beefmote_uring_flush();
+
+// Starts accepting connections, or polling for datagrams, on a listener.
+static void beefmote_uring_listen(int socket, int type);
+
+// Starts receiving from a client.
+static void beefmote_uring_recv(beefmote_client *client);
+
+// Hands a provided buffer back to the kernel.
+static void beefmote_uring_recycle(int bid);
+#endif
+
+// Prepares Beefmote's sockets for listening.
 static void beefmote_listen();
 
+// Listens on TCP, on the port set in the settings.
+static void beefmote_listen_tcp();
+
+// Listens for control datagrams on UDP, if a UDP port and secret are set in the settings.
+static void beefmote_listen_udp();
+
+// Listens on a port of the IP set in the settings; IPv4 or dual-stack IPv6
+// if no IP is set. type is SOCK_STREAM or SOCK_DGRAM.
+static void beefmote_listen_inet(int type, int port);
+
+// Listens on a Unix domain socket, if one is set in the settings.
+static void beefmote_listen_unix();
+
+// Creates a socket bound to addr and adds it to the listeners. mode sets the
+// permissions of AF_UNIX sockets. Returns the socket, or -1 on failure.
+static int beefmote_listener_add(int family, int type, struct sockaddr *addr, socklen_t addr_len, mode_t mode);
+
+// Returns the listener for a socket, or NULL if it isn't one.
+static beefmote_listener *beefmote_listener_get(int socket);
+
+// Closes all listeners.
+static void beefmote_listeners_close();
+
+// Receives and runs all pending control datagrams on a UDP listener.
+static void beefmote_udp_receive(beefmote_listener *listener);
+
+// Returns whether a datagram's sequence number comes after the last one we got
+// from its sender, and remembers it if so.
+static bool beefmote_udp_check_sequence(uint32_t sender, uint32_t seq);
+
+// Makes the SipHash key for control datagrams out of the shared secret: its
+// two halves are the SipHash-2-4 of the whole secret keyed with
+// "BeefmoteUdpKey-0" and "BeefmoteUdpKey-1", as little endian integers.
+static void beefmote_udp_derive_key(const char *secret, uint8_t key[16]);
+
+// SipHash-2-4 of data with a 128 bit key.
+static uint64_t beefmote_siphash(const uint8_t key[16], const void *data, size_t len);
+
+// Reads the outbound queue and connection timeout settings.
+static void beefmote_load_settings();
+
+// Arms a timer to call fire in ms milliseconds, rearming it if it was already
+// armed. Timers are kept in a hierarchical timing wheel: BEEFMOTE_TIMER_LEVELS
+// levels of BEEFMOTE_TIMER_SLOTS slots, each slot of a level spanning a whole
+// turn of the level below. Arming and cancelling take constant time, whatever
+// the number of timers. Only to be used by Beefmote's thread.
+static void beefmote_timer_set(beefmote_timer *timer, uint64_t ms, void (*fire)(beefmote_timer *timer));
+
+// Disarms a timer, if it's armed.
+static void beefmote_timer_cancel(beefmote_timer *timer);
+
+// Puts an armed timer in the slot where it belongs. Timers due by the current
+// tick go in the next one, unless cascading, where they go in the current one.
+static void beefmote_timer_link(beefmote_timer *timer, bool cascading);
+
+// Goes through the ticks that went by, firing the timers that are due. Returns
+// how long we can sleep until the next timer might be due, at most limit
+// milliseconds, or 0 if any timer fired, so what they did gets done first.
+static int beefmote_timers_run(int limit);
+
 // Initializes Beefmote's commands.
 static void beefmote_initialize_commands();
 
 // Processes a Beefmote command.
 static void beefmote_process_command(int client_socket, char *command);
 
+// Returns the id of the command a command line starts with, or -1.
+static int beefmote_command_lookup(const char *line);
+
 // Beefmote's event manager. This is where we process the events
 // emmited by Deadbeef.
 static int beefmote_message(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2);
 
+// Records a notification in the replay ring, and sends it to all clients
+// subscribed to it.
+static void beefmote_notify_clients(int notification, const char *str);
+
+// Creates the status page, if it's turned on (see beefmote_status.h).
+static void beefmote_status_open();
+
+// Removes the status page, if there's one.
+static void beefmote_status_close();
+
+// Brings the status page up to date with Deadbeef's state. Updates are
+// serialized by beefmote_status_mutex, since the seqlock only has one writer.
+static void beefmote_status_update();
+
+// Formats the [BEEFMOTE_UPCOMING_BEGIN] notification for a track that just
+// started to play. Returns NULL if we're out of memory; the caller must free
+// the string.
+static char *beefmote_format_upcoming(DB_playItem_t *track);
+
+// Returns a client's session, starting a new one if it doesn't have one yet.
+// Returns NULL if we're out of memory.
+static beefmote_session *beefmote_client_session(beefmote_client *client);
+
+// Detaches a client's session from it, if any. Sessions whose token nobody
+// knows are freed right away.
+static void beefmote_session_detach(beefmote_client *client);
+
+// Returns the session with a token, or NULL.
+static beefmote_session *beefmote_session_find(const char *token);
+
+// Frees a session. beefmote_clients_mutex must be held.
+static void beefmote_session_free(beefmote_session *session);
+
+// Frees detached sessions older than BEEFMOTE_SESSION_TTL_MS and, while there
+// are too many sessions, the ones that were detached the longest time ago.
+// beefmote_clients_mutex must be held.
+static void beefmote_sessions_expire();
+
+// Frees all sessions and the replay ring.
+static void beefmote_sessions_free();
+
 // Helper function for creating Beefmote's commands.
 static void beefmote_command_new(int comm_id, const char *comm_name, const char *comm_help,
                                  void (*execute)(int client_socket, void* data));
@@ -144,6 +1096,7 @@ static void beefmote_command_trackcurr(int client_socket, void *data);
 static void beefmote_command_play(int client_socket, void *data);
 static void beefmote_command_play_search(int client_socket, void *data);
 static void beefmote_command_play_address(int client_socket, void *data);
+static void beefmote_command_play_uri(int client_socket, void *data);
 static void beefmote_command_random(int client_socket, void *data);
 static void beefmote_command_play_resume(int client_socket, void *data);
 static void beefmote_command_stop(int client_socket, void *data);
@@ -154,13 +1107,36 @@ static void beefmote_command_volume_up(int client_socket, void *data);
 static void beefmote_command_volume_down(int client_socket, void *data);
 static void beefmote_command_seek_forward(int client_socket, void *data);
 static void beefmote_command_seek_backward(int client_socket, void *data);
+static void beefmote_command_volume_set(int client_socket, void *data);
+static void beefmote_command_seek_to(int client_socket, void *data);
 static void beefmote_command_search(int client_socket, void *data);
+static void beefmote_command_search_all(int client_socket, void *data);
 static void beefmote_command_notify_playlist_changed(int client_socket, void *data);
 static void beefmote_command_notify_playlist_switched(int client_socket, void *data);
 static void beefmote_command_notify_now_playing(int client_socket, void *data);
+static void beefmote_command_notify_queue(int client_socket, void *data);
+static void beefmote_command_notify_upcoming(int client_socket, void *data);
+static void beefmote_command_notify_tagged(int client_socket, void *data);
 static void beefmote_command_add_playbackqueue(int client_socket, void *data);
 static void beefmote_command_add_playbackqueue_address(int client_socket, void *data);
 static void beefmote_command_add_search_playbackqueue(int client_socket, void *data);
+static void beefmote_command_add_playbackqueue_uri(int client_socket, void *data);
+static void beefmote_command_import(int client_socket, void *data);
+static void beefmote_command_import_cancel(int client_socket, void *data);
+static void beefmote_command_abort(int client_socket, void *data);
+static void beefmote_command_sync(int client_socket, void *data);
+static void beefmote_command_sync_nodes(int client_socket, void *data);
+static void beefmote_command_sync_chunks(int client_socket, void *data);
+static void beefmote_command_session(int client_socket, void *data);
+static void beefmote_command_resume(int client_socket, void *data);
+static void beefmote_command_artists(int client_socket, void *data);
+static void beefmote_command_albums(int client_socket, void *data);
+static void beefmote_command_album_tracks(int client_socket, void *data);
+static void beefmote_command_queue_list(int client_socket, void *data);
+static void beefmote_command_queue_remove(int client_socket, void *data);
+static void beefmote_command_queue_move(int client_socket, void *data);
+static void beefmote_command_queue_clear(int client_socket, void *data);
+static void beefmote_command_pong(int client_socket, void *data);
 static void beefmote_command_exit(int client_socket, void* data);
 
 
@@ -171,15 +1147,417 @@ static void beefmote_command_exit(int client_socket, void* data);
 // Sends a newline to a client.
 static inline void client_print_newline(int client_socket);
 
-// Prints a string to a client.
+// Prints a string to a client. Output is queued a whole line at a time, so
+// notifications never end up in the middle of a line.
 static void client_print_string(int client_socket, const char* string);
 
 // Prints a track in the format "[Tool - Lateralus] 05 - Schism (6:48)" to a client.
 // print_addr indicates whether the track's memory address should be prepended.
 static void client_print_track(int client_socket, DB_playItem_t *track, bool print_addr);
 
-// Prints to a client all tracks of a playlist using client_print_track. Returns number of tracks printed.
-static int client_print_playlist(int client_socket, ddb_playlist_t *playlist, bool print_addr);
+// Starts streaming to a client all tracks of a playlist. The stream goes on in
+// the background (see beefmote_client_stream), so slow clients don't hold up anybody.
+static void client_print_playlist(int client_socket, ddb_playlist_t *playlist, bool print_addr);
+
+// Sends a client the tracklist of a playlist from a snapshot, or streams it if
+// snapshot is NULL.
+static void beefmote_client_send_tracklist(beefmote_client *client, ddb_playlist_t *playlist,
+                                           beefmote_snapshot *snapshot, bool print_addr);
+
+// Formats a track like client_print_track does. Returns the formatted length.
+static int beefmote_format_track(char *buf, int size, DB_playItem_t *track, bool print_addr);
+
+// Copies a track's metadata field, or "?" if it doesn't have it. Must be
+// called with the playlist lock held.
+static void beefmote_copy_meta(char *buf, int size, DB_playItem_t *track, const char *key);
+
+// Returns a monotonic timestamp, in milliseconds.
+static uint64_t beefmote_now_ms();
+
+// Formats a track as a JSON object. Returns the formatted length.
+static int beefmote_format_track_json(char *buf, int size, DB_playItem_t *track, int idx);
+
+// Writes a string as a JSON string literal (null if str is NULL), truncating
+// it if it doesn't fit. size must be at least 8. Returns the written length.
+static int beefmote_json_string(char *buf, int size, const char *str);
+
+// Returns what we know about a playlist, bringing its generation up to date,
+// or NULL if we're out of memory.
+static beefmote_playlist_info *beefmote_playlist_info_get(ddb_playlist_t *playlist);
+
+// Forgets about a playlist.
+static void beefmote_playlist_info_free(beefmote_playlist_info *info);
+
+// Lets go of the tracks a playlist info holds on to.
+static void beefmote_playlist_info_release(beefmote_playlist_info *info);
+
+// Forgets about all playlists.
+static void beefmote_playlist_infos_free();
+
+// Returns the up to date snapshot of a playlist's tracklist, taking a
+// reference to it. If there's none, returns NULL, and sets *building to the
+// batch of the snapshot being taken, or to NULL if it can't be taken.
+static beefmote_snapshot *beefmote_snapshot_get(ddb_playlist_t *playlist, bool print_addr,
+                                                beefmote_batch **building);
+
+// Starts taking a snapshot of the tracklist of a playlist. Returns NULL if
+// we're out of memory.
+static beefmote_snapshot_build *beefmote_snapshot_start(beefmote_playlist_info *info, bool print_addr);
+
+// Hands the next round of tracks of a snapshot being taken over to the workers.
+static void beefmote_snapshot_round(beefmote_snapshot_build *build);
+
+// Writes out a round of tracks of a snapshot being taken, and once they're
+// all there, seals it and sends it to the clients waiting for it.
+static void beefmote_snapshot_round_done(beefmote_batch *batch);
+
+// Drops a reference to a snapshot.
+static void beefmote_snapshot_unref(beefmote_snapshot *snapshot);
+
+// Lets go of the snapshots of playlists that changed since they were taken.
+static void beefmote_snapshots_sweep();
+
+// Returns the search mirror of a playlist, bringing it up to date, or NULL if
+// we're out of memory.
+static beefmote_search_mirror *beefmote_search_mirror_get(ddb_playlist_t *playlist);
+
+// (Re)builds a search mirror from a playlist. Values of tracks that were
+// already in it are copied rather than folded again, unless reuse is false.
+// Returns false if we're out of memory.
+static bool beefmote_search_mirror_build(beefmote_search_mirror *mirror, ddb_playlist_t *playlist, bool reuse);
+
+// Folds again the values of a mirror's track. Must be called with the playlist
+// lock held. Returns false if we're out of memory.
+static bool beefmote_search_mirror_refold(beefmote_search_mirror *mirror, int idx);
+
+// Returns the index of a track in a search mirror, or -1 if it isn't there.
+static int beefmote_search_mirror_find(beefmote_search_mirror *mirror, DB_playItem_t *track);
+
+// Frees everything in a search mirror.
+static void beefmote_search_mirror_free(beefmote_search_mirror *mirror);
+
+// Returns the path index of a playlist, bringing it up to date, or NULL if
+// we're out of memory.
+static beefmote_uri_index *beefmote_uri_index_get(ddb_playlist_t *playlist);
+
+// Frees everything in a path index.
+static void beefmote_uri_index_free(beefmote_uri_index *index);
+
+// Finds a track by file path, in the current playlist first and then in the
+// others. Returns it with a reference taken, and the index of its playlist in
+// plt_idx, or NULL if no playlist has it.
+static DB_playItem_t *beefmote_uri_find(const char *uri, int *plt_idx);
+
+// Counts a mirror's track in its artist and album. Must be called with the
+// playlist lock held. Returns false if we're out of memory.
+static bool beefmote_browse_add(beefmote_search_mirror *mirror, int idx);
+
+// Counts a mirror's track in an album, with the duration already in
+// mirror->durations. Returns false if we're out of memory.
+static bool beefmote_browse_count(beefmote_search_mirror *mirror, int idx, int album);
+
+// Counts a mirror's track out of its album.
+static void beefmote_browse_remove(beefmote_search_mirror *mirror, int idx);
+
+// Counts every track out, keeping the artists and albums and their ids.
+static void beefmote_browse_clear(beefmote_browse *browse);
+
+// Returns the id of an artist, adding it if it isn't there, or -1 if we're
+// out of memory.
+static int beefmote_browse_artist(beefmote_browse *browse, const char *key, const char *name);
+
+// Returns the id of an artist's album, adding it if it isn't there, or -1 if
+// we're out of memory.
+static int beefmote_browse_album(beefmote_browse *browse, int artist, const char *key, const char *name);
+
+// Sorts the artists with tracks, if they changed. Returns false if we're out
+// of memory.
+static bool beefmote_browse_sort(beefmote_browse *browse);
+
+// Frees everything in a beefmote_browse.
+static void beefmote_browse_free(beefmote_browse *browse);
+
+// Hashes a string, FNV-1a style.
+static uint64_t beefmote_hash_string(uint64_t hash, const char *str);
+
+// Copies len bytes of a UTF-8 string, case folding its letters (see
+// beefmote_fold_code_point), which keeps its length in bytes. Invalid
+// sequences are copied as they are.
+static void beefmote_fold(char *dst, const char *src, size_t len);
+
+// Returns the lowercase version of a code point if it's an uppercase or
+// titlecase letter, or c itself. The few letters whose lowercase version
+// takes a different number of bytes in UTF-8 (e.g. U+0130, U+212A) are left
+// alone, as are letters outside of the Basic Multilingual Plane.
+static uint32_t beefmote_fold_code_point(uint32_t c);
+
+// Scan functions, see beefmote_scan_function.
+static size_t beefmote_scan_generic(const char *hay, size_t from, size_t end, const char *needle, size_t k);
+#if defined(__x86_64__) || defined(__i386__)
+static size_t beefmote_scan_sse2(const char *hay, size_t from, size_t end, const char *needle, size_t k);
+static size_t beefmote_scan_avx2(const char *hay, size_t from, size_t end, const char *needle, size_t k);
+#endif
+
+// Searches a playlist for the tracks whose artist, album, title or path
+// contain text, ignoring case. Stores them in playlist order in *results,
+// holding a reference to each of them, and returns how many there are, or -1
+// if we're out of memory. With a session, the search narrows down the previous
+// one whenever it can, and the session remembers it for the next one.
+static int beefmote_search(ddb_playlist_t *playlist, const char *text, DB_playItem_t ***results,
+                           beefmote_search_session *session);
+
+// Scans a whole search mirror for a folded text, storing the mirror indexes of
+// the tracks found in hits, which must have room for all of them. Returns how
+// many there are, or -1 if we're out of memory.
+static int beefmote_search_scan(beefmote_search_mirror *mirror, const char *needle, size_t k, int *hits);
+
+// Searches all playlists for a client like beefmote_search does, each on a
+// worker, so it takes about as long as searching the biggest one. The reply
+// to the request being run is ended by beefmote_search_all_done, streaming
+// the results from playlist. Playlists we run out of memory for are left out.
+// Returns false if that's all of them.
+static bool beefmote_search_all(beefmote_client *client, const char *text, ddb_playlist_t *playlist);
+
+// Sends the results of a search of all playlists to the client waiting for
+// them, in playlist order, with the index of the playlist each of them is in.
+static void beefmote_search_all_done(beefmote_batch *batch);
+
+// Frees a search of all playlists, letting go of the mirrors it went through.
+static void beefmote_search_all_free(beefmote_search_batch *search);
+
+// Lets go of a mirror a search job went through. Once no job goes through it
+// anymore, what it was before being built again is freed.
+static void beefmote_search_mirror_unpin(beefmote_search_mirror *mirror);
+
+// Returns whether a search of a folded text can narrow down the last search of
+// a session, which was made in the same mirror, unchanged since.
+static bool beefmote_search_session_narrows(beefmote_search_session *session, ddb_playlist_t *playlist,
+                                            beefmote_search_mirror *mirror, const char *text, size_t len);
+
+// Forgets a session's last search.
+static void beefmote_search_session_reset(beefmote_search_session *session);
+
+// Replaces a client's search results.
+static void beefmote_client_set_results(beefmote_client *client, DB_playItem_t **results, int results_n);
+
+// Brings our copy of the playback queue up to date with Deadbeef's, sending
+// what changed to the clients subscribed to queue notifications.
+static void beefmote_queue_sync();
+
+// Forgets about our copy of the playback queue.
+static void beefmote_queue_free();
+
+// Returns one of a client's search results, taking a reference to it, or NULL
+// if there's no such result. Commands that don't come from a connection (e.g.
+// over UDP) get Deadbeef's own search results.
+static DB_playItem_t *beefmote_client_search_result(int client_socket, int idx);
+
+// Returns the sync hashes of a playlist if they're up to date. If they aren't,
+// returns NULL, and sets *building to the batch bringing them up to date, or
+// to NULL if we're out of memory. Requests coming while they're being brought
+// up to date wait for that, even if the playlist changed again since.
+static beefmote_sync_tree *beefmote_sync_tree_get(ddb_playlist_t *playlist, beefmote_batch **building);
+
+// Starts bringing the sync hashes of a playlist up to date, handing the
+// chunks that changed over to the workers. Returns NULL if we're out of memory.
+static beefmote_sync_build *beefmote_sync_start(beefmote_playlist_info *info);
+
+// Puts together the sync hashes brought up to date, and replies to the
+// clients waiting for them.
+static void beefmote_sync_done(beefmote_batch *batch);
+
+// Hashes the levels of sync hashes above level 0, up to the root. Returns
+// false if we're out of memory.
+static bool beefmote_sync_tree_grow(beefmote_sync_tree *tree);
+
+// Frees sync hashes, and lets go of the tracks they hold on to.
+static void beefmote_sync_tree_clear(beefmote_sync_tree *tree);
+
+// Runs a sync command (BEEFMOTE_SYNC, BEEFMOTE_SYNC_NODES or
+// BEEFMOTE_SYNC_CHUNKS) for a client, right away if the sync hashes of the
+// current playlist are up to date, or once they are.
+static void beefmote_sync_request(int client_socket, int comm_id, const char *args);
+
+// Replies to a sync command with up to date sync hashes, or that we're out of
+// memory if tree is NULL.
+static void beefmote_sync_reply(beefmote_client *client, beefmote_sync_tree *tree, int comm_id,
+                                const char *args);
+
+// Returns the client connected on a socket, or NULL.
+static beefmote_client *beefmote_client_get(int client_socket);
+
+// Accepts all pending connections on a listener.
+static void beefmote_client_accept(beefmote_listener *listener);
+
+// Sets up a client for a connection we accepted on a listener.
+static void beefmote_client_add(beefmote_listener *listener, int client_socket, struct sockaddr *client_addr);
+
+// Formats a peer address for debug prints.
+static void beefmote_format_address(char *buf, int size, struct sockaddr *addr, int socket);
+
+// Sends the welcome message to a client, if it was held back.
+static void beefmote_client_welcome(beefmote_client *client);
+
+// Closes a client connection and frees everything related to it.
+static void beefmote_client_close(beefmote_client *client);
+
+// Rearms a client's ping and idle timers; called whenever we hear from it.
+static void beefmote_client_touch(beefmote_client *client);
+
+// Client timer callbacks, see beefmote_timer_set.
+static void beefmote_client_welcome_timeout(beefmote_timer *timer);
+static void beefmote_client_ping(beefmote_timer *timer);
+static void beefmote_client_idle_timeout(beefmote_timer *timer);
+
+// Queues the output line a command has been composing, if any, prefixed with
+// the tag of the request being run.
+static void beefmote_client_commit_line(beefmote_client *client);
+
+// Commits the output line being composed and sets the tag that the following
+// output lines of a client get (see beefmote_request_tag).
+static void beefmote_client_retag(beefmote_client *client, const char *tag);
+
+// Writes the prefix of the reply lines to a request with a tag to str: "@tag "
+// or nothing at all for untagged requests. Returns its length.
+static int beefmote_tag_prefix(char *str, const char *tag);
+
+// Queues data to be sent to a client; stream tells whether it's stream output.
+// beefmote_clients_mutex must be held.
+static void beefmote_client_enqueue(beefmote_client *client, const char *data, int len, bool stream);
+
+// Queues a snapshot to be sent to a client. beefmote_clients_mutex must be held.
+static void beefmote_client_enqueue_snapshot(beefmote_client *client, beefmote_snapshot *snapshot);
+
+// Frees an outbound queue chunk.
+static void beefmote_chunk_free(beefmote_chunk *chunk);
+
+// Cuts short the snapshots being sent to a client at the end of the current
+// line, dropping the ones that haven't started to be sent. Returns the number
+// of tracks sent, or -1 if no snapshot was cut short.
+static int beefmote_client_abort_snapshots(beefmote_client *client);
+
+// Queues a notification, applying the overflow policy if the client isn't
+// keeping up. beefmote_clients_mutex must be held.
+static void beefmote_client_notify(beefmote_client *client, int notification, const char *str);
+
+// Queues lines that aren't a reply to any request (notifications and pings),
+// framed as "@* line" if the client asked for it with ntfy-tagged.
+// beefmote_clients_mutex must be held.
+static void beefmote_client_enqueue_notification(beefmote_client *client, const char *str);
+
+// Sends as much of a client's outbound queue as the socket takes without
+// blocking, up to its deficit. Returns whether it used up its deficit with
+// more left to send. beefmote_clients_mutex must be held.
+static bool beefmote_client_flush(beefmote_client *client);
+
+// Fills iov with the data chunks at the head of a client's outbound queue,
+// which mustn't be a snapshot, up to limit bytes. Returns how many it filled.
+static int beefmote_client_gather(beefmote_client *client, struct iovec *iov, int limit);
+
+// Takes note of a send to a client: bytes_n bytes of its outbound queue went
+// out, or if bytes_n < 0, the send failed with err. Returns whether it's worth
+// sending more right away. beefmote_clients_mutex must be held.
+static bool beefmote_client_sent(beefmote_client *client, ssize_t bytes_n, int err);
+
+// Finishes a flush, once the socket took all it could. beefmote_clients_mutex
+// must be held.
+static void beefmote_client_flushed(beefmote_client *client);
+
+// Reads whatever a client sent us. Returns false if the client went away.
+static bool beefmote_client_read(beefmote_client *client);
+
+// Returns the length of the next command line a client sent us, or 0 if
+// there isn't a complete one yet.
+static int beefmote_client_next_line(beefmote_client *client);
+
+// Goes through the complete command lines a client sent us. Control commands
+// are run right away; everything else is queued as pending.
+static void beefmote_client_process_input(beefmote_client *client);
+
+// Splits the tag off a request line ("@tag command"), copying it to tag, which
+// is left empty if the request isn't tagged. Returns the command, or NULL if
+// the tag isn't valid.
+static char *beefmote_request_tag(char *line, char *tag);
+
+// Runs a command line, tagged or not, ending the reply to tagged requests with
+// [BEEFMOTE_DONE] (unless a stream takes over the reply, see beefmote_client_stream).
+static void beefmote_client_run(beefmote_client *client, char *line);
+
+// Takes a token from a client's bucket for a command. Returns 0, or if the
+// bucket is empty, how many milliseconds until it has a token again.
+static int beefmote_bucket_take(beefmote_bucket *bucket, int rate);
+
+// Returns the position in the pending queue of the command that should run
+// next for a client, or -1 if there's nothing to run.
+static int beefmote_client_next_pending(beefmote_client *client);
+
+// Runs the next pending command of a client: the oldest one, or while it's
+// busy streaming, the oldest tagged one that doesn't stream itself.
+static void beefmote_client_run_pending(beefmote_client *client);
+
+// Returns whether there's something we can do for a client right away.
+static bool beefmote_client_has_work(beefmote_client *client);
+
+// Starts streaming a playlist's tracks (iter is PL_MAIN or PL_SEARCH) to a client.
+static void beefmote_client_start_stream(beefmote_client *client, ddb_playlist_t *playlist, int iter,
+                                         bool print_addr);
+
+// Stops a client's stream, if any, releasing the references it holds.
+static void beefmote_client_stop_stream(beefmote_client *client);
+
+// Sends the next batch of tracks of a client's stream.
+static void beefmote_client_stream(beefmote_client *client);
+
+// Aborts a client's stream: stops it, drops its output that hasn't been sent
+// yet and sends a terminating marker. Returns false if there was no stream.
+static bool beefmote_client_abort_stream(beefmote_client *client);
+
+// Called when a bulk command of a family (PL_MAIN for tracklists, PL_SEARCH
+// for searches) arrives: drops the pending commands of the same family it
+// makes useless, and aborts the running stream if it's of the same family.
+static void beefmote_client_supersede(beefmote_client *client, int family);
+
+// Returns the family of a bulk command (see beefmote_client_supersede), or -1.
+static int beefmote_bulk_family(int comm_id);
+
+// Returns whether a line looks like the request line of an HTTP request.
+static bool beefmote_http_detect(const char *line);
+
+// Goes through the request lines an HTTP client sent us, serving its
+// requests one at a time.
+static void beefmote_http_process_input(beefmote_client *client);
+
+// Serves the request an HTTP client just finished sending.
+static void beefmote_http_serve(beefmote_client *client);
+
+// Serves the tracks (or the search results, if query isn't NULL) of a playlist.
+// Tracks are streamed with an ETag naming the playlist's generation, and the
+// transfer fails if the playlist changes before they've all been sent.
+static void beefmote_http_serve_tracks(beefmote_client *client, ddb_playlist_t *playlist, const char *query,
+                                       bool head);
+
+// Sends the head of an HTTP response. Bodies are either body, sent with a
+// Content-Length, or sent afterwards in chunks (see beefmote_http_print_chunk)
+// if body is NULL.
+static void beefmote_http_respond(beefmote_client *client, int status, const char *etag, const char *body,
+                                  bool head);
+
+// Sends a chunk of a chunked HTTP response body.
+static void beefmote_http_print_chunk(beefmote_client *client, const char *str);
+
+// Decodes the value of a parameter of a URL query string. Returns false if
+// the parameter isn't there.
+static bool beefmote_http_query_param(const char *query, const char *name, char *buf, int size);
+
+// Updates the epoll events we're waiting for on a client.
+static void beefmote_client_update_events(beefmote_client *client);
+
+// Wakes up Beefmote's thread (e.g. because there's new data to send).
+static void beefmote_wakeup_thread();
+
+// Plays a track of any playlist, switching to its playlist first if it isn't
+// the current one. Returns false if the track isn't in a playlist anymore.
+static bool beefmote_play_track(DB_playItem_t *track);
 
 // A function for a adding a track to a playlist's playback queue.
 // playlist: must be either PL_MAIN or PL_SEARCH.
@@ -205,13 +1583,62 @@ static int plugin_start()
 {
     beefmote_stopthread = 0;
     beefmote_currtrack = NULL;
-    beefmote_notify_playlist_changed = false;
-    beefmote_notify_playlist_switched = false;
-    beefmote_notify_now_playing = false;
-    beefmote_client_socket = -1;
+    beefmote_sessions = NULL;
+    beefmote_sessions_n = 0;
+    beefmote_event_seq = 0;
+    beefmote_clients = NULL;
+    beefmote_clients_by_socket = NULL;
+    beefmote_clients_by_socket_n = 0;
+    beefmote_clients_n = 0;
+    beefmote_listeners_n = 0;
+    beefmote_playlist_infos = NULL;
+    beefmote_changed_seq = 0;
+    beefmote_scan = beefmote_scan_generic;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        beefmote_scan = beefmote_scan_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        beefmote_scan = beefmote_scan_sse2;
+    }
+#endif
+    beefmote_boot_id = (unsigned long) time(NULL);
     beefmote_stopthread_mutex = deadbeef->mutex_create_nonrecursive();
+    beefmote_clients_mutex = deadbeef->mutex_create_nonrecursive();
+    beefmote_queue_mutex = deadbeef->mutex_create_nonrecursive();
+    beefmote_status_mutex = deadbeef->mutex_create_nonrecursive();
+    beefmote_queue_n = 0;
+    beefmote_queue_sync();      // nobody to tell yet, we just take it as it is
+    memset(beefmote_wheel, 0, sizeof(beefmote_wheel));
+    memset(beefmote_wheel_occupied, 0, sizeof(beefmote_wheel_occupied));
+    beefmote_wheel_tick = beefmote_now_ms() / BEEFMOTE_TIMER_TICK_MS;
+    memset(beefmote_adjusters, 0, sizeof(beefmote_adjusters));
+    beefmote_adjusters[BEEFMOTE_ADJUSTER_VOLUME].get = beefmote_adjust_volume_get;
+    beefmote_adjusters[BEEFMOTE_ADJUSTER_VOLUME].set = beefmote_adjust_volume_set;
+    beefmote_adjusters[BEEFMOTE_ADJUSTER_POSITION].get = beefmote_adjust_position_get;
+    beefmote_adjusters[BEEFMOTE_ADJUSTER_POSITION].set = beefmote_adjust_position_set;
     beefmote_initialize_commands();
+    beefmote_load_settings();
+    beefmote_status_open();
+
+    beefmote_epoll = epoll_create1(EPOLL_CLOEXEC);
+    beefmote_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (beefmote_epoll == -1 || beefmote_wakeup == -1) {
+        beefmote_debug_print("error: couldn't create epoll instance\n");
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = beefmote_wakeup };
+    epoll_ctl(beefmote_epoll, EPOLL_CTL_ADD, beefmote_wakeup, &ev);
+
+#ifdef BEEFMOTE_IO_URING
+    beefmote_uring_enabled = deadbeef->conf_get_int("beefmote.io_uring", 0) && beefmote_uring_init();
+    beefmote_debug_print("using %s\n", beefmote_uring_enabled ? "io_uring" : "epoll");
+#endif
+
     beefmote_listen();
+    beefmote_workers_start();
     beefmote_tid = deadbeef->thread_start(beefmote_thread, NULL);
 
     return 0;
@@ -226,11 +1653,32 @@ static int plugin_stop()
         beefmote_stopthread = 1;
         deadbeef->mutex_unlock(beefmote_stopthread_mutex);
 
-        if (beefmote_socket != -1) {
-            close(beefmote_socket);
-        }
-
+        beefmote_wakeup_thread();
         deadbeef->thread_join(beefmote_tid);    // wait for Beefmote's thread to finish
+        beefmote_workers_stop_all();
+
+        __atomic_store_n(&beefmote_import.cancel, true, __ATOMIC_RELAXED);
+        beefmote_import_free();
+
+        beefmote_listeners_close();
+#ifdef BEEFMOTE_IO_URING
+        if (beefmote_uring_enabled) {
+            beefmote_uring_free();
+            beefmote_uring_enabled = false;
+        }
+#endif
+        close(beefmote_wakeup);
+        close(beefmote_epoll);
+        free(beefmote_clients_by_socket);
+        beefmote_status_close();
+        deadbeef->mutex_free(beefmote_status_mutex);
+        beefmote_status_mutex = 0;
+        beefmote_tid = 0;
+        beefmote_sessions_free();
+        beefmote_queue_free();
+        deadbeef->mutex_free(beefmote_queue_mutex);
+        beefmote_queue_mutex = 0;
+        deadbeef->mutex_free(beefmote_clients_mutex);
         deadbeef->mutex_free(beefmote_stopthread_mutex);
     }
 
@@ -277,10 +1725,7 @@ static inline void client_print_newline(int client_socket)
 {
     assert(client_socket > 0);
 
-    int bytes_n = write(client_socket, "\n", 1);
-    if (bytes_n != 1) {
-        beefmote_debug_print("error: couldn't send all data to client\n");
-    }   
+    client_print_string(client_socket, "\n");
 }
 
 static void client_print_string(int client_socket, const char* string)
@@ -288,10 +1733,33 @@ static void client_print_string(int client_socket, const char* string)
     assert(client_socket > 0);
     assert(string);
 
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
+        return;
+    }
+
+    const char *ptr = string;
     int len = strlen(string);
-    int bytes_n = write(client_socket, string, len);
-    if (bytes_n != len) {
-        beefmote_debug_print("error: couldn't send all data to client\n");
+
+    // Compose the output line by line. Only complete lines (or lines too long
+    // to fit in the line buffer) make it to the outbound queue.
+    while (len > 0) {
+        const char *newline = memchr(ptr, '\n', len);
+        int n = newline ? newline - ptr + 1 : len;
+        int room = sizeof(client->line) - client->line_len;
+
+        if (n > room) {
+            n = room;
+        }
+
+        memcpy(client->line + client->line_len, ptr, n);
+        client->line_len += n;
+        ptr += n;
+        len -= n;
+
+        if (client->line[client->line_len - 1] == '\n' || client->line_len == sizeof(client->line)) {
+            beefmote_client_commit_line(client);
+        }
     }
 }
 
@@ -300,594 +1768,7764 @@ static void client_print_track(int client_socket, DB_playItem_t *track, bool pri
     assert(client_socket > 0);
     assert(track);
 
-    const char *track_artist = deadbeef->pl_meta_for_key(track, "artist")->value;
-    const char *track_album = deadbeef->pl_meta_for_key(track, "album")->value;
-    const char *track_title = deadbeef->pl_meta_for_key(track, "title")->value;
-    const char *track_tracknumber = deadbeef->pl_meta_for_key(track, "track")->value;
+    char track_str[BEEFMOTE_STR_MAXLENGTH];
+    beefmote_format_track(track_str, sizeof(track_str), track, print_addr);
+    client_print_string(client_socket, track_str);
+}
+
+static int beefmote_format_track(char *buf, int size, DB_playItem_t *track, bool print_addr)
+{
+    assert(buf);
+    assert(track);
+
     char track_length[100];
     float len = deadbeef->pl_get_item_duration(track);
     deadbeef->pl_format_time(len, track_length, 100);
-    char track_str[BEEFMOTE_STR_MAXLENGTH];
+
+    // Metadata can be changed by other threads while we read it, so we copy it
+    // under the lock and format it afterwards. Snapshot workers would spend
+    // most of their time waiting for the lock otherwise.
+    char track_artist[BEEFMOTE_STR_MAXLENGTH];
+    char track_album[BEEFMOTE_STR_MAXLENGTH];
+    char track_title[BEEFMOTE_STR_MAXLENGTH];
+    char track_tracknumber[BEEFMOTE_NAME_MAXLENGTH];
+    int n;
+
+    deadbeef->pl_lock();
+    beefmote_copy_meta(track_artist, sizeof(track_artist), track, "artist");
+    beefmote_copy_meta(track_album, sizeof(track_album), track, "album");
+    beefmote_copy_meta(track_title, sizeof(track_title), track, "title");
+    beefmote_copy_meta(track_tracknumber, sizeof(track_tracknumber), track, "track");
+    deadbeef->pl_unlock();
 
     if (print_addr) {
-        sprintf(track_str, "%p [%s - %s] %s - %s (%s)\n", track, track_artist, track_album, track_tracknumber, track_title,
-                track_length);
+        n = snprintf(buf, size, "%p [%s - %s] %s - %s (%s)\n", track, track_artist, track_album,
+                     track_tracknumber, track_title, track_length);
     }
     else {
-        sprintf(track_str, "[%s - %s] %s - %s (%s)\n", track_artist, track_album, track_tracknumber, track_title,
-                track_length);
+        n = snprintf(buf, size, "[%s - %s] %s - %s (%s)\n", track_artist, track_album, track_tracknumber,
+                     track_title, track_length);
     }
 
-    int track_str_len = strlen(track_str);
-    int bytes_n = write(client_socket, track_str, track_str_len);
-    if (bytes_n != track_str_len) {
-        beefmote_debug_print("error: failure while sending data to client\n");
+    // Truncated, but still a line.
+    if (n >= size) {
+        buf[size - 2] = '\n';
+        n = size - 1;
     }
+
+    return n;
 }
 
-static int client_print_playlist(int client_socket, ddb_playlist_t *playlist, bool print_addr)
+static void beefmote_copy_meta(char *buf, int size, DB_playItem_t *track, const char *key)
 {
-    assert(client_socket > 0);
-    assert(playlist);
+    assert(buf);
+    assert(track);
+    assert(key);
 
-    int i = 0;
-    DB_playItem_t *track;
+    const char *value = deadbeef->pl_find_meta(track, key);
+    int len = value ? strlen(value) : 1;
 
-    int pl_count = deadbeef->plt_get_item_count(playlist, PL_MAIN);
+    if (len >= size) {
+        len = size - 1;
+    }
 
-    char str[BEEFMOTE_STR_MAXLENGTH];
-    sprintf(str, "[BEEFMOTE_TRACKLIST_BEGIN] %d\n", pl_count);
-    client_print_string(client_socket, str);
+    memcpy(buf, value ? value : "?", len);
+    buf[len] = 0;
+}
 
+static uint64_t beefmote_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    while (track = deadbeef->plt_get_item_for_idx(playlist, i++, PL_MAIN)) {
-        char idx[BEEFMOTE_STR_MAXLENGTH];
-        sprintf(idx, "[BEEFMOTE_TRACKLIST_TRACK] (%d) ", i - 1);
-        client_print_string(client_socket, idx);
-        client_print_track(client_socket, track, print_addr);
-        deadbeef->pl_item_unref(track);
-    }
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    client_print_string(client_socket, "[BEEFMOTE_TRACKLIST_END]\n");
+static int beefmote_format_track_json(char *buf, int size, DB_playItem_t *track, int idx)
+{
+    assert(buf);
+    assert(track);
 
-    return --i;
+    // Every field gets a buffer of its own, and all of them together fit in
+    // BEEFMOTE_JSON_MAXLENGTH, so the object is never cut short.
+    char artist[BEEFMOTE_STR_MAXLENGTH];
+    char album[BEEFMOTE_STR_MAXLENGTH];
+    char tracknumber[BEEFMOTE_NAME_MAXLENGTH];
+    char title[BEEFMOTE_STR_MAXLENGTH];
+    float duration = deadbeef->pl_get_item_duration(track);
+
+    deadbeef->pl_lock();
+    beefmote_json_string(artist, sizeof(artist), deadbeef->pl_find_meta(track, "artist"));
+    beefmote_json_string(album, sizeof(album), deadbeef->pl_find_meta(track, "album"));
+    beefmote_json_string(tracknumber, sizeof(tracknumber), deadbeef->pl_find_meta(track, "track"));
+    beefmote_json_string(title, sizeof(title), deadbeef->pl_find_meta(track, "title"));
+    deadbeef->pl_unlock();
+
+    return snprintf(buf, size, "{\"index\":%d,\"address\":\"%p\",\"artist\":%s,\"album\":%s,\"track\":%s,"
+                    "\"title\":%s,\"duration\":%.3f}", idx, track, artist, album, tracknumber, title, duration);
 }
 
-static void beefmote_thread(void *data)
+static int beefmote_json_string(char *buf, int size, const char *str)
 {
-    char beefmote_buffer[BEEFMOTE_BUFSIZE];
-    memset(beefmote_buffer, 0, BEEFMOTE_BUFSIZE);
+    assert(buf);
+    assert(size >= 8);
 
-    struct sockaddr_in client_addr;
-    int client_size = sizeof(client_addr);
+    if (!str) {
+        return sprintf(buf, "null");
+    }
 
-    fd_set readfds;
-    struct timeval timeout;
+    int n = 0;
+    const unsigned char *ptr = (const unsigned char*) str;
 
-    char welcome_str[BEEFMOTE_STR_MAXLENGTH];
-    strcpy(welcome_str, "Hello! Welcome to Beefmote's server. Type \"");
-    strcat(welcome_str, beefmote_commands[BEEFMOTE_HELP].name);
-    strcat(welcome_str, "\" for a list of available commands\n\n");
-    int welcome_len = strlen(welcome_str);
+    buf[n++] = '"';
 
-    // Infinite loop. We only exit when Deadbeef calls the
-    // plugin_stop function on program exit.
-    for (;;) {
-        deadbeef->mutex_lock(beefmote_stopthread_mutex);
-        if (beefmote_stopthread == 1) {
-            deadbeef->mutex_unlock(beefmote_stopthread_mutex);
-            return;
+    // Keep room for the longest escape sequence, the closing quote and the
+    // terminating null.
+    for (; *ptr && n < size - 8; ptr++) {
+        switch (*ptr) {
+        case '"':
+        case '\\':
+            buf[n++] = '\\';
+            buf[n++] = *ptr;
+            break;
+
+        case '\n':
+            buf[n++] = '\\';
+            buf[n++] = 'n';
+            break;
+
+        case '\t':
+            buf[n++] = '\\';
+            buf[n++] = 't';
+            break;
+
+        default:
+            if (*ptr < 0x20) {
+                n += sprintf(buf + n, "\\u%04x", *ptr);
+            }
+            else {
+                buf[n++] = *ptr;
+            }
+            break;
         }
-        deadbeef->mutex_unlock(beefmote_stopthread_mutex);
+    }
 
-        if (beefmote_socket == -1) {
-            continue;
+    // Don't leave half a UTF-8 character behind if we had to cut it short.
+    if (*ptr) {
+        while (n > 1 && ((unsigned char) buf[n - 1] & 0xc0) == 0x80) {
+            n--;
         }
 
-        // Accept (non-blocking) client connection.
-        if ((beefmote_client_socket = accept(beefmote_socket, (struct sockaddr *) &client_addr,
-                                    &client_size)) < 0) {
-            sleep(BEEFMOTE_WAIT_CLIENT);        // let's not kill the CPU, shall we?
-            continue;
+        if (n > 1 && (unsigned char) buf[n - 1] >= 0xc0) {
+            n--;
         }
+    }
+
+    buf[n++] = '"';
+    buf[n] = 0;
 
-        beefmote_debug_print("got connection from %s\n", inet_ntoa(client_addr.sin_addr));
+    return n;
+}
+
+static beefmote_playlist_info *beefmote_playlist_info_get(ddb_playlist_t *playlist)
+{
+    assert(playlist);
 
-        int bytes_n = write(beefmote_client_socket, welcome_str, welcome_len);
+    beefmote_playlist_info *info;
 
-        if (bytes_n != welcome_len) {
-            beefmote_debug_print("error: failure while sending data to client\n");
+    for (info = beefmote_playlist_infos; info; info = info->next) {
+        if (info->playlist == playlist) {
+            break;
         }
+    }
 
-        // At this point, a client is connected. We now just have to wait for it
-        // to say something to us. We check every BEEFMOTE_WAIT_CLIENT seconds to
-        // see if the client said something.
-        for (;;) {
-            deadbeef->mutex_lock(beefmote_stopthread_mutex);
-            if (beefmote_stopthread == 1) {
-                deadbeef->mutex_unlock(beefmote_stopthread_mutex);
-                close(beefmote_client_socket);
-                beefmote_client_socket = -1;
-                return;
+    if (!info) {
+        // Forget about the playlists that have been deleted before adding a new one.
+        beefmote_playlist_info **link = &beefmote_playlist_infos;
+        int pl_n = deadbeef->plt_get_count();
+
+        while (*link) {
+            bool found = false;
+
+            for (int i = 0; i < pl_n && !found; i++) {
+                ddb_playlist_t *pl = deadbeef->plt_get_for_idx(i);
+                if (pl) {
+                    found = pl == (*link)->playlist;
+                    deadbeef->plt_unref(pl);
+                }
             }
-            deadbeef->mutex_unlock(beefmote_stopthread_mutex);
 
-            // All this stuff has to be set *every* time before a select(),
-            // because select() modifies it.
-            FD_ZERO(&readfds);
-            FD_SET(beefmote_client_socket, &readfds);
-            timeout.tv_sec = BEEFMOTE_WAIT_CLIENT;
-            timeout.tv_usec = 0;
-            int rv = select(beefmote_client_socket + 1, &readfds, NULL, NULL, &timeout);
-
-            if (rv == -1) {
-                beefmote_debug_print("error: select failed\n");
-                close(beefmote_client_socket);
-                beefmote_client_socket = -1;
-                break;
-            } else if (rv == 0) {
+            // Jobs might still be going through its mirror, or taking its snapshots or sync hashes.
+            if (found || (*link)->mirror.scans > 0 || (*link)->builds[0] || (*link)->builds[1] ||
+                (*link)->sync.build) {
+                link = &(*link)->next;
                 continue;
-            } else {
-                if (FD_ISSET(beefmote_client_socket, &readfds)) {
-                    // Read and print data from client.
-                    int bytes_n = read(beefmote_client_socket, beefmote_buffer, BEEFMOTE_BUFSIZE);
-
-                    if (bytes_n < 0) {
-                        beefmote_debug_print("error: failed on read(), errno = %d, closing client socket\n", errno);
-                        close(beefmote_client_socket);
-                        beefmote_client_socket = -1;
-                        break;
-                    }
+            }
 
-                    if (bytes_n == 0) {
-                        beefmote_debug_print("client %s closed connection\n",
-                                             inet_ntoa(client_addr.sin_addr));
-                        close(beefmote_client_socket);
-                        beefmote_client_socket = -1;
-                        break;
-                    }
+            beefmote_playlist_info *stale = *link;
+            *link = stale->next;
+            beefmote_playlist_info_free(stale);
+        }
 
-                    // Process commands.
-                    beefmote_debug_print("received %d bytes from client %s: %s", bytes_n,
-                                         inet_ntoa(client_addr.sin_addr), beefmote_buffer);
-                    beefmote_process_command(beefmote_client_socket, beefmote_buffer);
-                    memset(beefmote_buffer, 0, BEEFMOTE_BUFSIZE);
-                }
-            }
+        info = calloc(1, sizeof(beefmote_playlist_info));
+        if (!info) {
+            return NULL;
         }
+
+        deadbeef->plt_ref(playlist);
+        info->playlist = playlist;
+        info->content_checked = __atomic_load_n(&beefmote_playlist_generation, __ATOMIC_ACQUIRE) - 1;
+        info->metadata_checked = __atomic_load_n(&beefmote_metadata_generation, __ATOMIC_ACQUIRE);
+        info->next = beefmote_playlist_infos;
+        beefmote_playlist_infos = info;
     }
-}
 
-static void beefmote_listen()
-{
-    // Try to get IP and port from settings.
-    deadbeef->conf_lock();
-    const char *ip_str = deadbeef->conf_get_str_fast("beefmote.ip", "");
-    const char *port_str = deadbeef->conf_get_str_fast("beefmote.port", "");
-    bool config_ip_found = false;
-    bool config_port_found = false;
-    struct sockaddr_in servaddr;
+    unsigned content = __atomic_load_n(&beefmote_playlist_generation, __ATOMIC_ACQUIRE);
+    unsigned metadata = __atomic_load_n(&beefmote_metadata_generation, __ATOMIC_ACQUIRE);
 
-    memset(&servaddr, 0, sizeof(servaddr));
+    // Deadbeef doesn't tell which track's metadata changed, so that counts as
+    // a change for every playlist.
+    if (info->metadata_checked != metadata) {
+        info->metadata_checked = metadata;
+        info->generation++;
+    }
 
-    // IP found in config file.
-    if (strcmp(ip_str, "")) {
-        beefmote_debug_print("IP found in config file: %s\n", ip_str);
+    if (info->content_checked != content) {
+        info->content_checked = content;
 
-        config_ip_found = true;
-        inet_pton(AF_INET, ip_str, &(servaddr));
+        uint64_t fingerprint = 0xcbf29ce484222325ULL;
 
-        // Debug: Print converted IP (it should match ip_str)
-        if (DEBUG) {
-            char str[INET_ADDRSTRLEN];
+        deadbeef->pl_lock();
 
-            inet_ntop(AF_INET, &(servaddr), str, INET_ADDRSTRLEN);
-            beefmote_debug_print("Converted IP: %s\n", str);
+        int tracks_n = deadbeef->plt_get_item_count(playlist, PL_MAIN);
+        DB_playItem_t **tracks = malloc((tracks_n ? tracks_n : 1) * sizeof(DB_playItem_t*));
+        DB_playItem_t *track = tracks ? deadbeef->plt_get_first(playlist, PL_MAIN) : NULL;
+        int idx = 0;
+
+        for (; track && idx < tracks_n; idx++) {
+            tracks[idx] = track;
+            fingerprint = (fingerprint ^ (uintptr_t) track) * 0x100000001b3ULL;
+            track = deadbeef->pl_get_next(track, PL_MAIN);
         }
-    }
 
-    // Port found in config file.
-    if (strcmp(port_str, "")) {
-        beefmote_debug_print("Port found in config file: %s\n", port_str);
+        if (track) {
+            deadbeef->pl_item_unref(track);
+        }
 
-        config_port_found = true;
-        int port = strtol(port_str, NULL, 10);
+        deadbeef->pl_unlock();
 
-        servaddr.sin_port = htons(port);
+        // If we couldn't take the tracks, the content counts as changed.
+        if (!tracks || idx != info->tracks_n || memcmp(tracks, info->tracks, idx * sizeof(DB_playItem_t*))) {
+            info->fingerprint = fingerprint;
+            info->generation++;
+        }
 
-        if (DEBUG) {
-            beefmote_debug_print("Converted port: %d\n", port);
+        beefmote_playlist_info_release(info);
+
+        if (tracks) {
+            info->tracks = tracks;
+            info->tracks_n = idx;
+        }
+        else {
+            info->content_checked--;
         }
     }
 
-    deadbeef->conf_unlock();
+    return info;
+}
 
-    beefmote_socket = socket(AF_INET, SOCK_STREAM, 0);
+static void beefmote_playlist_info_free(beefmote_playlist_info *info)
+{
+    assert(info);
 
-    if (beefmote_socket == -1) {
-        beefmote_debug_print("error: couldn't create socket\n");
-        return;
+    for (int i = 0; i < 2; i++) {
+        if (info->snapshots[i]) {
+            beefmote_snapshot_unref(info->snapshots[i]);
+        }
     }
 
-    // Reuse address (useful if the user closes and opens the program quickly again).
-    int enabled = 1;
-    if (setsockopt(beefmote_socket, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) == -1) {
-        beefmote_debug_print("error: couldn't set SO_REUSEADDR\n");
-    }
+    beefmote_sync_tree_clear(&info->sync);
+    beefmote_search_mirror_free(&info->mirror);
+    beefmote_uri_index_free(&info->uris);
+    beefmote_playlist_info_release(info);
 
-    // Set IP and port if they weren't found in the config file.
-    servaddr.sin_family = AF_INET;
+    deadbeef->plt_unref(info->playlist);
+    free(info);
+}
 
-    if (!config_ip_found) {
-        beefmote_debug_print("IP not found in config file, defaulting to all interfaces\n");
-        servaddr.sin_addr.s_addr = htonl(INADDR_ANY);   // bind to all interfaces
+static void beefmote_playlist_info_release(beefmote_playlist_info *info)
+{
+    assert(info);
+
+    for (int i = 0; i < info->tracks_n; i++) {
+        deadbeef->pl_item_unref(info->tracks[i]);
     }
 
-    if (!config_port_found) {
-        beefmote_debug_print("port not found in config file, defaulting to %d\n",
-                             BEEFMOTE_DEFAULT_PORT);
-        servaddr.sin_port = htons(BEEFMOTE_DEFAULT_PORT);
+    free(info->tracks);
+    info->tracks = NULL;
+    info->tracks_n = 0;
+}
+
+static void beefmote_playlist_infos_free()
+{
+    while (beefmote_playlist_infos) {
+        beefmote_playlist_info *info = beefmote_playlist_infos;
+        beefmote_playlist_infos = info->next;
+        beefmote_playlist_info_free(info);
     }
+}
 
-    // Set socket to non-blocking mode.
-    fcntl(beefmote_socket, F_SETFL, O_NONBLOCK | fcntl(beefmote_socket, F_GETFL, 0));
+static beefmote_search_mirror *beefmote_search_mirror_get(ddb_playlist_t *playlist)
+{
+    assert(playlist);
 
-    // Bind socket.
-    if (bind(beefmote_socket, (struct sockaddr*) &servaddr, sizeof(servaddr))) {
-        beefmote_debug_print("error: couldn't bind socket\n");
-        close(beefmote_socket);
-        beefmote_socket = -1;
-        return;
+    beefmote_playlist_info *info = beefmote_playlist_info_get(playlist);
+    if (!info) {
+        return NULL;
     }
 
-    // Put socket to listen.
-    if (listen(beefmote_socket, 1)) {
-        beefmote_debug_print("error: couldn't put socket to listen\n");
-        close(beefmote_socket);
-        beefmote_socket = -1;
-        return;
+    beefmote_search_mirror *mirror = &info->mirror;
+
+    // Fold again the tracks whose metadata changed since we last looked, or
+    // everything if we can't tell which ones they were anymore.
+    DB_playItem_t *changed[BEEFMOTE_CHANGED_TRACKS_MAX];
+    int changed_n = 0;
+    bool reuse = true;
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    uint64_t seq = beefmote_changed_seq;
+
+    if (seq - mirror->changed_seq > BEEFMOTE_CHANGED_TRACKS_MAX) {
+        reuse = false;
+    }
+    else {
+        for (uint64_t i = mirror->changed_seq; i < seq; i++) {
+            changed[changed_n++] = beefmote_changed_tracks[i % BEEFMOTE_CHANGED_TRACKS_MAX];
+        }
     }
-}
 
-static void beefmote_command_new(int comm_id, const char *comm_name, const char *comm_help,
-                                 void (*execute)(int client_socket, void* data))
-{
-    assert(comm_id >= 0 && comm_id < BEEFMOTE_COMMANDS_N);
-    assert(comm_name);
-    assert(comm_help);
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
 
-    strcpy(beefmote_commands[comm_id].name, comm_name);
-    beefmote_commands[comm_id].name_len = strlen(comm_name);
-    strcpy(beefmote_commands[comm_id].help, comm_help);
-    beefmote_commands[comm_id].execute = execute;
-}
+    // Folding tracks again in place would pull the rug from under search jobs
+    // in flight; building it again leaves them what they're going through.
+    if (mirror->scans > 0 && changed_n > 0) {
+        mirror->valid = false;
+    }
 
-static void beefmote_initialize_commands()
-{
-    beefmote_command_new(BEEFMOTE_HELP, "h", "prints this message.", beefmote_command_help);
+    if (mirror->valid && reuse && changed_n > 0) {
+        deadbeef->pl_lock();
 
-    beefmote_command_new(BEEFMOTE_PLAYLISTS, "pl",
-                         "usage: pl [idx]. If passed with no arguments, prints all playlists (" \
-                         "the current playlist is marked with (*)). " \
-                         "If passed with an index number, sets the current playlist to the " \
-                         "playlist with index idx.",
-		    	 beefmote_command_playlists);
+        for (int i = 0; i < changed_n && mirror->valid; i++) {
+            int idx = beefmote_search_mirror_find(mirror, changed[i]);
 
-    beefmote_command_new(BEEFMOTE_TRACKLIST, "tl", "prints all the tracks in the current playlist.",
-                         beefmote_command_tracklist);
+            if (idx != -1 && !beefmote_search_mirror_refold(mirror, idx)) {
+                mirror->valid = false;
+            }
+        }
 
-    beefmote_command_new(BEEFMOTE_TRACKLIST_ADDRESS, "tla",
-                         "like tl, but prepends each track by its memory address.",
-                         beefmote_command_tracklist_address);
+        deadbeef->pl_unlock();
+    }
 
-    beefmote_command_new(BEEFMOTE_TRACKCURR, "tc", "prints the current track.", beefmote_command_trackcurr);
+    mirror->changed_seq = seq;
 
-    beefmote_command_new(BEEFMOTE_PLAY, "pp", "plays current track.", beefmote_command_play);
+    if (!mirror->valid || !reuse || mirror->fingerprint != info->fingerprint) {
+        if (!beefmote_search_mirror_build(mirror, playlist, reuse && mirror->valid)) {
+            return NULL;
+        }
+    }
 
-    beefmote_command_new(BEEFMOTE_PLAY_SEARCH, "ps", "usage: ps idx. " \
-                         "Plays a track by its index in the search list.",
-                         beefmote_command_play_search);
+    return mirror;
+}
 
-    beefmote_command_new(BEEFMOTE_PLAY_ADDRESS, "pa", "usage: pa memaddr. " \
-                         "Plays a track by memory address; memaddr must be written in " \
-                         "hex notation.", beefmote_command_play_address);
+static bool beefmote_search_mirror_build(beefmote_search_mirror *mirror, ddb_playlist_t *playlist, bool reuse)
+{
+    assert(mirror);
+    assert(playlist);
 
-    beefmote_command_new(BEEFMOTE_PLAY_RESUME, "p",
-                         "Usage: p [idx]. If passed with no arguments, pauses/resumes playback. " \
-                         "If passed with an index, plays the track at index idx in the current " \
-                         "playlist.", beefmote_command_play_resume);
+    // Search jobs in flight still go through what we have, so that's kept
+    // until they're done.
+    beefmote_search_mirror *retired = mirror->scans > 0 ? malloc(sizeof(beefmote_search_mirror)) : NULL;
 
-    beefmote_command_new(BEEFMOTE_RANDOM, "r", "plays random track.", beefmote_command_random);
+    if (mirror->scans > 0 && !retired) {
+        return false;
+    }
 
-    beefmote_command_new(BEEFMOTE_STOP_AFTER_CURRENT, "sac", "stops playback after current track.",
-                         beefmote_command_stop_after_current);
+    beefmote_search_mirror old = *mirror;
+    beefmote_search_mirror *new = mirror;
+    bool failed = false;
+
+    memset(new, 0, sizeof(beefmote_search_mirror));
+    new->changed_seq = old.changed_seq;
+    new->scans = old.scans;
+    new->retired = retired;
+
+    // Tracks are counted again from scratch, but when reusing the old values,
+    // those we had already are put back in their albums without looking them up.
+    if (reuse) {
+        new->browse = old.browse;
+        memset(&old.browse, 0, sizeof(beefmote_browse));
+        beefmote_browse_clear(&new->browse);
+    }
 
-    beefmote_command_new(BEEFMOTE_STOP, "s", "stops playback.", beefmote_command_stop);
+    deadbeef->pl_lock();
 
-    beefmote_command_new(BEEFMOTE_PREVIOUS, "pv", "plays previous track.", beefmote_command_previous);
+    int tracks_n = deadbeef->plt_get_item_count(playlist, PL_MAIN);
 
-    beefmote_command_new(BEEFMOTE_NEXT, "nt", "plays next track.", beefmote_command_next);
+    new->slots_n = 16;
+    while (new->slots_n < tracks_n * 2) {
+        new->slots_n *= 2;
+    }
 
-    beefmote_command_new(BEEFMOTE_VOLUME_UP, "vu", "usage: vu [step]. If no argument is passed, " \
-                         "increases volume by a default step of 5. If a number is passed, increases volume " \
-                         "by that amount.", beefmote_command_volume_up);
+    new->tracks = malloc((tracks_n ? tracks_n : 1) * sizeof(DB_playItem_t *));
+    new->slots = malloc(new->slots_n * sizeof(int));
+    new->album_of = malloc((tracks_n ? tracks_n : 1) * sizeof(int));
+    new->album_pos = malloc((tracks_n ? tracks_n : 1) * sizeof(int));
+    new->durations = malloc((tracks_n ? tracks_n : 1) * sizeof(float));
+    failed = !new->tracks || !new->slots || !new->album_of || !new->album_pos || !new->durations;
+
+    for (int f = 0; f < BEEFMOTE_SEARCH_FIELDS_N && !failed; f++) {
+        // Most values are short, so this is usually enough.
+        new->arena_cap[f] = tracks_n * 32 + BEEFMOTE_ARENA_PADDING;
+        new->arena[f] = malloc(new->arena_cap[f]);
+        new->offsets[f] = malloc((tracks_n + 1) * sizeof(size_t));
+        failed = !new->arena[f] || !new->offsets[f];
+    }
 
-    beefmote_command_new(BEEFMOTE_VOLUME_DOWN, "vd", "usage: vd [step]. If no argument is passed, " \
-                         "decreases volume by a default step of 5. If a number is passed, decreases volume " \
-                         "by that amount.", beefmote_command_volume_down);
+    if (!failed) {
+        memset(new->slots, 0xff, new->slots_n * sizeof(int));
+    }
 
-    beefmote_command_new(BEEFMOTE_SEEK_FORWARD, "sf", "seeks forward.", beefmote_command_seek_forward);
+    uint64_t fingerprint = 0xcbf29ce484222325ULL;
+    DB_playItem_t *track = failed ? NULL : deadbeef->plt_get_first(playlist, PL_MAIN);
+    int idx = 0;
 
-    beefmote_command_new(BEEFMOTE_SEEK_BACKWARD, "sb", "seeks backward.", beefmote_command_seek_backward);
+    for (; idx < tracks_n && track && !failed; idx++) {
+        new->tracks[idx] = track;
+        fingerprint = (fingerprint ^ (uintptr_t) track) * 0x100000001b3ULL;
 
-    beefmote_command_new(BEEFMOTE_SEARCH, "/", "usage: / str. Searches a string in the current " \
-            "playlist and returns a list of matching tracks. The matched tracks can be played by using their index " \
-            "number with the ps command.", beefmote_command_search);
+        int slot = ((uintptr_t) track >> 4) & (new->slots_n - 1);
+        while (new->slots[slot] != -1) {
+            slot = (slot + 1) & (new->slots_n - 1);
+        }
+        new->slots[slot] = idx;
 
-    beefmote_command_new(BEEFMOTE_NOTIFY_PLAYLIST_CHANGED, "ntfy-plchanged",
-                         "usage: ntfy-plchanged true/false. Sets whether to notify when the current playlist changes. " \
-                         "Default: false.", beefmote_command_notify_playlist_changed);
+        int old_idx = reuse ? beefmote_search_mirror_find(&old, track) : -1;
 
-    beefmote_command_new(BEEFMOTE_NOTIFY_PLAYLIST_SWITCHED, "ntfy-plswitched",
-                         "usage: ntfy-plswitched true/false. Sets whether to notify when the playlist switches. " \
-                         "Default: false.", beefmote_command_notify_playlist_switched);
+        for (int f = 0; f < BEEFMOTE_SEARCH_FIELDS_N && !failed; f++) {
+            const char *value = NULL;
+            size_t len;
 
-    beefmote_command_new(BEEFMOTE_NOTIFY_NOW_PLAYING, "ntfy-nowplaying",
-                         "usage: ntfy-nowplaying true/false. Sets whether to notify when a new track " \
-                         "starts to play. Default: false.",
-                         beefmote_command_notify_now_playing);
+            if (old_idx != -1) {
+                len = old.offsets[f][old_idx + 1] - old.offsets[f][old_idx] - 1;
+            }
+            else {
+                value = deadbeef->pl_find_meta(track, beefmote_search_fields[f]);
+                len = value ? strlen(value) : 0;
+            }
 
-    beefmote_command_new(BEEFMOTE_ADD_PLAYBACKQUEUE_ADDRESS, "apa", "usage: apa memaddr. Adds a track by " \
-                         "memory address to the playback queue.", beefmote_command_add_playbackqueue_address);
+            if (new->arena_len[f] + len + 1 + BEEFMOTE_ARENA_PADDING > new->arena_cap[f]) {
+                size_t cap = new->arena_cap[f] * 2 + len;
+                char *arena = realloc(new->arena[f], cap);
 
-    beefmote_command_new(BEEFMOTE_ADD_PLAYBACKQUEUE, "ap", "usage: ap idx. Adds a track to the " \
-                         "playback queue.", beefmote_command_add_playbackqueue);
+                if (!arena) {
+                    failed = true;
+                    break;
+                }
 
-    beefmote_command_new(BEEFMOTE_ADD_SEARCH_PLAYBACKQUEUE, "aps", "usage: aps idx. Adds a searched track to the " \
-                         "playback queue.", beefmote_command_add_search_playbackqueue);
+                new->arena[f] = arena;
+                new->arena_cap[f] = cap;
+            }
 
-    beefmote_command_new(BEEFMOTE_EXIT, "exit", "terminates Deadbeef.", beefmote_command_exit);
-}
+            char *dst = new->arena[f] + new->arena_len[f];
 
-static void beefmote_process_command(int client_socket, char *command)
-{
-    assert(client_socket > 0);
-    assert(command);
-    assert(beefmote_commands);
+            if (old_idx != -1) {
+                memcpy(dst, old.arena[f] + old.offsets[f][old_idx], len);
+            }
+            else {
+                beefmote_fold(dst, value ? value : "", len);
+            }
 
-    char* ptr = command;
-    char* arg = NULL;
+            dst[len] = 0;
+            new->offsets[f][idx] = new->arena_len[f];
+            new->arena_len[f] += len + 1;
+        }
 
-    // Remove trailing whitespace from command and detect argument.
-    while (*ptr++) {
-        if (!arg && *(ptr + 1) != 0 && isspace(*ptr) && !isspace(*(ptr + 1))) {
-            arg = ptr + 1;
-            *ptr = 0;
-            break;
+        if (!failed && old_idx != -1) {
+            new->durations[idx] = old.durations[old_idx];
+            failed = !beefmote_browse_count(new, idx, old.album_of[old_idx]);
         }
-        else if (isspace(*ptr)) {
-            *ptr = 0;
-            break;
+        else if (!failed) {
+            failed = !beefmote_browse_add(new, idx);
         }
-    }
 
-    if (arg) {
-        // Remove trailing \r\n from argument.
-        char* arg_ptr = arg;
+        track = deadbeef->pl_get_next(track, PL_MAIN);
+    }
 
-        while (*arg_ptr++) {
-            if (*arg_ptr == '\r' || *arg_ptr == '\n') {
-                *arg_ptr = 0;
-            }
-        }
+    if (track) {
+        deadbeef->pl_item_unref(track);
     }
 
-    // At this point, we are guaranteed that:
-    // 1) "command" is a string which contains no whitespace (and thus
-    // can potentially match a Beefmote's command name).
-    // 2) arg is whatever comes after "command", minus trailing \r\n. This
-    // *includes* whatever whitespace was there, so beefmote_command_* functions
-    // must do any necessary cleanup themselves.
+    deadbeef->pl_unlock();
 
-    int comm_len = strlen(command);
+    new->tracks_n = idx;
+    new->fingerprint = fingerprint;
 
-    for (int i = 0; i < BEEFMOTE_COMMANDS_N; i++) {
-        if (comm_len != beefmote_commands[i].name_len) {
-            continue;
-        }
+    if (retired) {
+        *retired = old;
+    }
+    else {
+        beefmote_search_mirror_free(&old);
+    }
 
-        if (strncmp(beefmote_commands[i].name, command, beefmote_commands[i].name_len) == 0) {
-            beefmote_commands[i].execute(client_socket, arg);
-            return;
-        }
+    if (failed) {
+        beefmote_debug_print("error: couldn't build search mirror\n");
+        beefmote_search_mirror_free(new);
+        return false;
     }
 
-    char invalid[] = "\nPlease type a valid command\n\n";
-    int invalid_len = strlen(invalid);
-    int bytes_n = write(client_socket, invalid, invalid_len);
-    if (bytes_n != invalid_len) {
-        beefmote_debug_print("error: couldn't send all data to client\n");
+    for (int f = 0; f < BEEFMOTE_SEARCH_FIELDS_N; f++) {
+        new->offsets[f][idx] = new->arena_len[f];
+        memset(new->arena[f] + new->arena_len[f], 0, BEEFMOTE_ARENA_PADDING);
     }
+
+    new->valid = true;
+    beefmote_debug_print("built search mirror of %d tracks\n", new->tracks_n);
+
+    return true;
 }
 
-static int beefmote_message(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2)
+static bool beefmote_search_mirror_refold(beefmote_search_mirror *mirror, int idx)
 {
-    assert(deadbeef);
+    assert(mirror);
+    assert(idx >= 0 && idx < mirror->tracks_n);
 
-    ddb_event_track_t* ev;
+    beefmote_browse_remove(mirror, idx);
 
-    switch (id) {
-    case DB_EV_SONGCHANGED:
-        beefmote_currtrack = ((ddb_event_trackchange_t*) ctx)->to;
+    for (int f = 0; f < BEEFMOTE_SEARCH_FIELDS_N; f++) {
+        const char *value = deadbeef->pl_find_meta(mirror->tracks[idx], beefmote_search_fields[f]);
+        size_t len = value ? strlen(value) : 0;
+        size_t old_len = mirror->offsets[f][idx + 1] - mirror->offsets[f][idx] - 1;
+        char *arena = mirror->arena[f];
 
-        if (beefmote_currtrack && beefmote_notify_now_playing && beefmote_client_socket != -1) {
-            int idx = deadbeef->pl_get_idx_of(beefmote_currtrack);
+        // Make room for the new value, moving the ones after it.
+        if (len != old_len) {
+            size_t arena_len = mirror->arena_len[f] + len - old_len;
 
-            char str[BEEFMOTE_STR_MAXLENGTH];
-            sprintf(str, "[BEEFMOTE_NOW_PLAYING] (%d) ", idx);
+            if (arena_len + BEEFMOTE_ARENA_PADDING > mirror->arena_cap[f]) {
+                size_t cap = arena_len + BEEFMOTE_ARENA_PADDING + mirror->arena_cap[f] / 2;
 
-            client_print_string(beefmote_client_socket, str);
-            client_print_track(beefmote_client_socket, beefmote_currtrack, true);
-            client_print_newline(beefmote_client_socket);
-        }
+                arena = realloc(arena, cap);
+                if (!arena) {
+                    return false;
+                }
 
-        break;
+                mirror->arena[f] = arena;
+                mirror->arena_cap[f] = cap;
+            }
 
-    /* Deadbeef is basically useless if you want to get a by-track
-     * changelog, meaning you CAN'T get a list of, e.g. added or
-     * deleted tracks to/from a playlist. Such is life. When a song
-     * is deleted, the case is DB_EV_PLAYLISTCHANGED, and p1 is
-     * DDB_PLAYLIST_CHANGE_CONTENT. That's all the info you get,
-     * meaning a client will have to get the ENTIRE tracklist
-     * AGAIN for just the one deleted track if it wants to keep in
-     * sync with the Deadbeef playlist. *sigh* */
-    case DB_EV_PLAYLISTCHANGED:
-        if (p1 == DDB_PLAYLIST_CHANGE_CONTENT) {
-            if (beefmote_client_socket != -1 && beefmote_notify_playlist_changed) {
-                client_print_string(beefmote_client_socket, "[BEEFMOTE_PLAYLIST_CHANGED]\n");
+            size_t next = mirror->offsets[f][idx + 1];
+            memmove(arena + (next + len - old_len), arena + next, mirror->arena_len[f] - next);
+
+            for (int i = idx + 1; i <= mirror->tracks_n; i++) {
+                mirror->offsets[f][i] += len - old_len;
             }
-        }
-        break;
 
-    case DB_EV_PLAYLISTSWITCHED:
-        if (beefmote_client_socket != -1 && beefmote_notify_playlist_switched) {
-            client_print_string(beefmote_client_socket, "[BEEFMOTE_PLAYLIST_SWITCHED]\n");
+            mirror->arena_len[f] = arena_len;
+            memset(arena + arena_len, 0, BEEFMOTE_ARENA_PADDING);
         }
 
-        break;
+        beefmote_fold(arena + mirror->offsets[f][idx], value ? value : "", len);
+        arena[mirror->offsets[f][idx] + len] = 0;
     }
 
-    return 0;
+    return beefmote_browse_add(mirror, idx);
 }
 
-static void beefmote_command_help(int client_socket, void *data)
+static int beefmote_search_mirror_find(beefmote_search_mirror *mirror, DB_playItem_t *track)
 {
-    assert(client_socket > 0);
-    assert(beefmote_commands[BEEFMOTE_HELP].name);
+    assert(mirror);
 
-    char help[BEEFMOTE_STR_MAXLENGTH * 2];
-    int help_len, bytes_n;
+    if (!mirror->valid) {
+        return -1;
+    }
 
-    client_print_newline(client_socket);
+    int slot = ((uintptr_t) track >> 4) & (mirror->slots_n - 1);
 
-    for (int i = 0; i < BEEFMOTE_COMMANDS_N; i++) {
-        strcpy(help, beefmote_commands[i].name);
-        strcat(help, "\n\t");
-        strcat(help, beefmote_commands[i].help);
-        strcat(help, "\n");
-        help_len = strlen(help);
-        bytes_n = write(client_socket, help, help_len);
-        if (bytes_n != help_len) {
-            beefmote_debug_print("error: couldn't send all data to client\n");
+    while (mirror->slots[slot] != -1) {
+        if (mirror->tracks[mirror->slots[slot]] == track) {
+            return mirror->slots[slot];
         }
+
+        slot = (slot + 1) & (mirror->slots_n - 1);
     }
 
-    client_print_newline(client_socket);
+    return -1;
 }
 
-static void beefmote_command_playlists(int client_socket, void *data)
+static uint64_t beefmote_uri_hash(const char *uri)
 {
-    assert(client_socket > 0);
-    assert(deadbeef);
-
-    int pl_n = deadbeef->plt_get_count();
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
 
-    if (pl_n <= 0) {
-        client_print_string(client_socket, "\nNo playlists\n\n");
-        return;
+    while (*uri) {
+        hash = (hash ^ (unsigned char) *uri++) * 0x100000001b3ULL;
     }
 
-    if (data) {
-        int idx = strtol((char*) data, NULL, 10);
+    return hash;
+}
 
-        if (idx < 0 || idx >= pl_n) {
-            client_print_string(client_socket, "\nPlaylist index out of bounds\n\n");
-            return;
-        }
+static beefmote_uri_index *beefmote_uri_index_get(ddb_playlist_t *playlist)
+{
+    assert(playlist);
 
-        deadbeef->plt_set_curr_idx(idx);
-        return;
+    beefmote_playlist_info *info = beefmote_playlist_info_get(playlist);
+    if (!info) {
+        return NULL;
     }
 
-    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    beefmote_uri_index *index = &info->uris;
 
-    char str[BEEFMOTE_STR_MAXLENGTH];
+    // Paths don't change with the rest of the metadata, so only the tracks
+    // coming and going matter.
+    if (index->valid && index->fingerprint == info->fingerprint) {
+        return index;
+    }
 
-    for (int i = 0; i < pl_n; i++) {
-        ddb_playlist_t *pl = deadbeef->plt_get_for_idx(i);
-        char pl_name[BEEFMOTE_STR_MAXLENGTH];
+    beefmote_uri_index_free(index);
+
+    deadbeef->pl_lock();
+
+    int tracks_n = deadbeef->plt_get_item_count(playlist, PL_MAIN);
+    int slots_n = 16;
+
+    while (slots_n < 2 * tracks_n) {
+        slots_n *= 2;
+    }
+
+    index->tracks = malloc((tracks_n > 0 ? tracks_n : 1) * sizeof(DB_playItem_t*));
+    index->hashes = malloc((tracks_n > 0 ? tracks_n : 1) * sizeof(uint64_t));
+    index->slots = malloc(slots_n * sizeof(int));
+
+    if (!index->tracks || !index->hashes || !index->slots) {
+        deadbeef->pl_unlock();
+        beefmote_uri_index_free(index);
+        return NULL;
+    }
+
+    memset(index->slots, -1, slots_n * sizeof(int));
+    index->slots_n = slots_n;
+
+    DB_playItem_t *track = deadbeef->plt_get_first(playlist, PL_MAIN);
+
+    while (track && index->tracks_n < tracks_n) {
+        const char *uri = deadbeef->pl_find_meta(track, ":URI");
+        int idx = index->tracks_n++;
+
+        index->tracks[idx] = track;     // keeps the reference we got it with
+        index->hashes[idx] = beefmote_uri_hash(uri ? uri : "");
+
+        int slot = index->hashes[idx] & (slots_n - 1);
+
+        while (index->slots[slot] != -1) {
+            slot = (slot + 1) & (slots_n - 1);
+        }
+
+        index->slots[slot] = idx;
+        track = deadbeef->pl_get_next(track, PL_MAIN);
+    }
+
+    if (track) {
+        deadbeef->pl_item_unref(track);
+    }
+
+    deadbeef->pl_unlock();
+
+    index->fingerprint = info->fingerprint;
+    index->valid = true;
+
+    return index;
+}
+
+static void beefmote_uri_index_free(beefmote_uri_index *index)
+{
+    assert(index);
+
+    if (index->tracks) {
+        for (int i = 0; i < index->tracks_n; i++) {
+            deadbeef->pl_item_unref(index->tracks[i]);
+        }
+    }
+
+    free(index->tracks);
+    free(index->hashes);
+    free(index->slots);
+    memset(index, 0, sizeof(beefmote_uri_index));
+}
+
+static DB_playItem_t *beefmote_uri_find(const char *uri, int *plt_idx)
+{
+    assert(uri);
+    assert(plt_idx);
+
+    uint64_t hash = beefmote_uri_hash(uri);
+    int curr = deadbeef->plt_get_curr_idx();
+    int pl_n = deadbeef->plt_get_count();
+
+    for (int i = -1; i < pl_n; i++) {
+        // The current playlist goes first.
+        int pl_idx = i == -1 ? curr : i;
+
+        if (pl_idx < 0 || (i != -1 && pl_idx == curr)) {
+            continue;
+        }
+
+        ddb_playlist_t *playlist = deadbeef->plt_get_for_idx(pl_idx);
+        if (!playlist) {
+            continue;
+        }
+
+        beefmote_uri_index *index = beefmote_uri_index_get(playlist);
+        DB_playItem_t *found = NULL;
+
+        deadbeef->plt_unref(playlist);
+
+        if (!index) {
+            continue;
+        }
+
+        int mask = index->slots_n - 1;
+
+        deadbeef->pl_lock();
+
+        for (int slot = hash & mask; index->slots[slot] != -1; slot = (slot + 1) & mask) {
+            int idx = index->slots[slot];
+
+            if (index->hashes[idx] != hash) {
+                continue;
+            }
+
+            const char *track_uri = deadbeef->pl_find_meta(index->tracks[idx], ":URI");
+
+            if (track_uri && !strcmp(track_uri, uri)) {
+                found = index->tracks[idx];
+                deadbeef->pl_item_ref(found);
+                break;
+            }
+        }
+
+        deadbeef->pl_unlock();
+
+        if (found) {
+            *plt_idx = pl_idx;
+            return found;
+        }
+    }
+
+    return NULL;
+}
+
+static void beefmote_search_mirror_free(beefmote_search_mirror *mirror)
+{
+    assert(mirror);
+
+    if (mirror->tracks) {
+        for (int i = 0; i < mirror->tracks_n; i++) {
+            deadbeef->pl_item_unref(mirror->tracks[i]);
+        }
+    }
+
+    free(mirror->tracks);
+    free(mirror->slots);
+    free(mirror->album_of);
+    free(mirror->album_pos);
+    free(mirror->durations);
+    beefmote_browse_free(&mirror->browse);
+
+    for (int f = 0; f < BEEFMOTE_SEARCH_FIELDS_N; f++) {
+        free(mirror->arena[f]);
+        free(mirror->offsets[f]);
+    }
+
+    // Those outlive the content.
+    uint64_t changed_seq = mirror->changed_seq;
+    int scans = mirror->scans;
+    beefmote_search_mirror *retired = mirror->retired;
+
+    memset(mirror, 0, sizeof(beefmote_search_mirror));
+    mirror->changed_seq = changed_seq;
+    mirror->scans = scans;
+    mirror->retired = retired;
+}
+
+static bool beefmote_browse_add(beefmote_search_mirror *mirror, int idx)
+{
+    assert(mirror);
+
+    DB_playItem_t *track = mirror->tracks[idx];
+    const char *artist_name = deadbeef->pl_find_meta(track, "artist");
+    const char *album_name = deadbeef->pl_find_meta(track, "album");
+
+    // Search fields 0 and 1 are the folded artist and album.
+    int artist = beefmote_browse_artist(&mirror->browse, mirror->arena[0] + mirror->offsets[0][idx],
+                                        artist_name ? artist_name : "?");
+    int album = artist == -1 ? -1 : beefmote_browse_album(&mirror->browse, artist,
+                                                           mirror->arena[1] + mirror->offsets[1][idx],
+                                                           album_name ? album_name : "?");
+
+    if (album == -1) {
+        return false;
+    }
+
+    mirror->durations[idx] = deadbeef->pl_get_item_duration(track);
+
+    return beefmote_browse_count(mirror, idx, album);
+}
+
+static bool beefmote_browse_count(beefmote_search_mirror *mirror, int idx, int album)
+{
+    assert(mirror);
+
+    beefmote_browse *browse = &mirror->browse;
+    beefmote_album *b = &browse->albums[album];
+    beefmote_artist *a = &browse->artists[b->artist];
+
+    // Make room first, so that we never count a track only halfway.
+    if (b->tracks_n == b->tracks_cap) {
+        int cap = b->tracks_cap ? b->tracks_cap * 2 : 16;
+        int *tracks = realloc(b->tracks, cap * sizeof(int));
+
+        if (!tracks) {
+            return false;
+        }
+
+        b->tracks = tracks;
+        b->tracks_cap = cap;
+    }
+
+    if (b->tracks_n == 0 && a->albums_n == a->albums_cap) {
+        int cap = a->albums_cap ? a->albums_cap * 2 : 4;
+        int *albums = realloc(a->albums, cap * sizeof(int));
+
+        if (!albums) {
+            return false;
+        }
+
+        a->albums = albums;
+        a->albums_cap = cap;
+    }
+
+    if (a->tracks_n++ == 0) {
+        browse->sorted_valid = false;
+    }
+
+    if (b->tracks_n == 0) {
+        b->artist_pos = a->albums_n;
+        a->albums[a->albums_n++] = album;
+    }
+
+    mirror->album_of[idx] = album;
+    mirror->album_pos[idx] = b->tracks_n;
+    b->tracks[b->tracks_n++] = idx;
+    b->duration += mirror->durations[idx];
+
+    return true;
+}
+
+static void beefmote_browse_remove(beefmote_search_mirror *mirror, int idx)
+{
+    assert(mirror);
+    assert(idx >= 0 && idx < mirror->tracks_n);
+
+    beefmote_browse *browse = &mirror->browse;
+    beefmote_album *b = &browse->albums[mirror->album_of[idx]];
+    beefmote_artist *a = &browse->artists[b->artist];
+
+    // The album's last track takes this one's place.
+    int last = b->tracks[--b->tracks_n];
+    b->tracks[mirror->album_pos[idx]] = last;
+    mirror->album_pos[last] = mirror->album_pos[idx];
+
+    b->duration -= mirror->durations[idx];
+
+    if (b->tracks_n == 0) {
+        b->duration = 0;    // don't let rounding errors pile up
+
+        int last_album = a->albums[--a->albums_n];
+        a->albums[b->artist_pos] = last_album;
+        browse->albums[last_album].artist_pos = b->artist_pos;
+    }
+
+    if (--a->tracks_n == 0) {
+        browse->sorted_valid = false;
+    }
+}
+
+static void beefmote_browse_clear(beefmote_browse *browse)
+{
+    assert(browse);
+
+    for (int i = 0; i < browse->artists_n; i++) {
+        browse->artists[i].tracks_n = 0;
+        browse->artists[i].albums_n = 0;
+    }
+
+    for (int i = 0; i < browse->albums_n; i++) {
+        browse->albums[i].tracks_n = 0;
+        browse->albums[i].duration = 0;
+    }
+
+    browse->sorted_valid = false;
+}
+
+static int beefmote_browse_artist(beefmote_browse *browse, const char *key, const char *name)
+{
+    assert(browse);
+    assert(key);
+    assert(name);
+
+    uint64_t hash = beefmote_hash_string(0xcbf29ce484222325ULL, key);
+
+    if (browse->artist_slots) {
+        int slot = hash & (browse->artist_slots_n - 1);
+
+        while (browse->artist_slots[slot] != -1) {
+            if (!strcmp(browse->artists[browse->artist_slots[slot]].key, key)) {
+                return browse->artist_slots[slot];
+            }
+
+            slot = (slot + 1) & (browse->artist_slots_n - 1);
+        }
+    }
+
+    if (browse->artists_n == browse->artists_cap) {
+        int cap = browse->artists_cap ? browse->artists_cap * 2 : 64;
+        beefmote_artist *artists = realloc(browse->artists, cap * sizeof(beefmote_artist));
+
+        if (!artists) {
+            return -1;
+        }
+
+        browse->artists = artists;
+        browse->artists_cap = cap;
+    }
+
+    // Keep the table at most half full, rehashing everything when it grows.
+    if ((browse->artists_n + 1) * 2 > browse->artist_slots_n) {
+        int slots_n = browse->artist_slots_n ? browse->artist_slots_n * 2 : 128;
+        int *slots = malloc(slots_n * sizeof(int));
+
+        if (!slots) {
+            return -1;
+        }
+
+        memset(slots, 0xff, slots_n * sizeof(int));
+
+        for (int i = 0; i < browse->artists_n; i++) {
+            int slot = beefmote_hash_string(0xcbf29ce484222325ULL, browse->artists[i].key) & (slots_n - 1);
+
+            while (slots[slot] != -1) {
+                slot = (slot + 1) & (slots_n - 1);
+            }
+
+            slots[slot] = i;
+        }
+
+        free(browse->artist_slots);
+        browse->artist_slots = slots;
+        browse->artist_slots_n = slots_n;
+    }
+
+    beefmote_artist *artist = &browse->artists[browse->artists_n];
+    artist->key = strdup(key);
+    artist->name = strdup(name);
+    artist->tracks_n = 0;
+    artist->albums = NULL;
+    artist->albums_n = 0;
+    artist->albums_cap = 0;
+
+    if (!artist->key || !artist->name) {
+        free(artist->key);
+        free(artist->name);
+        return -1;
+    }
+
+    int slot = hash & (browse->artist_slots_n - 1);
+
+    while (browse->artist_slots[slot] != -1) {
+        slot = (slot + 1) & (browse->artist_slots_n - 1);
+    }
+
+    browse->artist_slots[slot] = browse->artists_n;
+
+    return browse->artists_n++;
+}
+
+static int beefmote_browse_album(beefmote_browse *browse, int artist, const char *key, const char *name)
+{
+    assert(browse);
+    assert(key);
+    assert(name);
+
+    // Albums are told apart by artist too, so the hash starts from the artist id.
+    uint64_t hash = beefmote_hash_string(0xcbf29ce484222325ULL ^ (uint64_t) artist, key);
+
+    if (browse->album_slots) {
+        int slot = hash & (browse->album_slots_n - 1);
+
+        while (browse->album_slots[slot] != -1) {
+            beefmote_album *album = &browse->albums[browse->album_slots[slot]];
+
+            if (album->artist == artist && !strcmp(album->key, key)) {
+                return browse->album_slots[slot];
+            }
+
+            slot = (slot + 1) & (browse->album_slots_n - 1);
+        }
+    }
+
+    if (browse->albums_n == browse->albums_cap) {
+        int cap = browse->albums_cap ? browse->albums_cap * 2 : 64;
+        beefmote_album *albums = realloc(browse->albums, cap * sizeof(beefmote_album));
+
+        if (!albums) {
+            return -1;
+        }
+
+        browse->albums = albums;
+        browse->albums_cap = cap;
+    }
+
+    if ((browse->albums_n + 1) * 2 > browse->album_slots_n) {
+        int slots_n = browse->album_slots_n ? browse->album_slots_n * 2 : 128;
+        int *slots = malloc(slots_n * sizeof(int));
+
+        if (!slots) {
+            return -1;
+        }
+
+        memset(slots, 0xff, slots_n * sizeof(int));
+
+        for (int i = 0; i < browse->albums_n; i++) {
+            beefmote_album *album = &browse->albums[i];
+            int slot = beefmote_hash_string(0xcbf29ce484222325ULL ^ (uint64_t) album->artist, album->key) &
+                       (slots_n - 1);
+
+            while (slots[slot] != -1) {
+                slot = (slot + 1) & (slots_n - 1);
+            }
+
+            slots[slot] = i;
+        }
+
+        free(browse->album_slots);
+        browse->album_slots = slots;
+        browse->album_slots_n = slots_n;
+    }
+
+    beefmote_album *album = &browse->albums[browse->albums_n];
+    album->artist = artist;
+    album->key = strdup(key);
+    album->name = strdup(name);
+    album->tracks = NULL;
+    album->tracks_n = 0;
+    album->tracks_cap = 0;
+    album->duration = 0;
+
+    if (!album->key || !album->name) {
+        free(album->key);
+        free(album->name);
+        return -1;
+    }
+
+    int slot = hash & (browse->album_slots_n - 1);
+
+    while (browse->album_slots[slot] != -1) {
+        slot = (slot + 1) & (browse->album_slots_n - 1);
+    }
+
+    browse->album_slots[slot] = browse->albums_n;
+
+    return browse->albums_n++;
+}
+
+// Sort order of artist ids, for qsort_r.
+static int beefmote_compare_artists(const void *a, const void *b, void *artists)
+{
+    return strcmp(((beefmote_artist*) artists)[*(const int*) a].key, ((beefmote_artist*) artists)[*(const int*) b].key);
+}
+
+static bool beefmote_browse_sort(beefmote_browse *browse)
+{
+    assert(browse);
+
+    if (browse->sorted_valid) {
+        return true;
+    }
+
+    int *sorted = realloc(browse->sorted, (browse->artists_n ? browse->artists_n : 1) * sizeof(int));
+
+    if (!sorted) {
+        return false;
+    }
+
+    browse->sorted = sorted;
+    browse->sorted_n = 0;
+
+    for (int i = 0; i < browse->artists_n; i++) {
+        if (browse->artists[i].tracks_n > 0) {
+            sorted[browse->sorted_n++] = i;
+        }
+    }
+
+    qsort_r(sorted, browse->sorted_n, sizeof(int), beefmote_compare_artists, browse->artists);
+    browse->sorted_valid = true;
+
+    return true;
+}
+
+static void beefmote_browse_free(beefmote_browse *browse)
+{
+    assert(browse);
+
+    for (int i = 0; i < browse->artists_n; i++) {
+        free(browse->artists[i].key);
+        free(browse->artists[i].name);
+        free(browse->artists[i].albums);
+    }
+
+    for (int i = 0; i < browse->albums_n; i++) {
+        free(browse->albums[i].key);
+        free(browse->albums[i].name);
+        free(browse->albums[i].tracks);
+    }
+
+    free(browse->artists);
+    free(browse->albums);
+    free(browse->artist_slots);
+    free(browse->album_slots);
+    free(browse->sorted);
+    memset(browse, 0, sizeof(beefmote_browse));
+}
+
+static uint64_t beefmote_hash_string(uint64_t hash, const char *str)
+{
+    assert(str);
+
+    for (; *str; str++) {
+        hash = (hash ^ (unsigned char) *str) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static void beefmote_fold(char *dst, const char *src, size_t len)
+{
+    assert(dst);
+    assert(src);
+
+    for (size_t i = 0; i < len;) {
+        unsigned char c = src[i];
+
+        if (c < 0x80) {
+            dst[i++] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+            continue;
+        }
+
+        // Letters we fold take two or three bytes.
+        size_t n = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 : 1;
+        uint32_t code_point = c & (n == 2 ? 0x1f : 0x0f);
+
+        if (i + n > len) {
+            n = 1;
+        }
+
+        for (size_t j = 1; j < n; j++) {
+            unsigned char next = src[i + j];
+
+            if ((next & 0xc0) != 0x80) {
+                n = 1;
+                break;
+            }
+
+            code_point = code_point << 6 | (next & 0x3f);
+        }
+
+        if (n == 1) {
+            dst[i++] = c;
+            continue;
+        }
+
+        code_point = beefmote_fold_code_point(code_point);
+
+        if (n == 2) {
+            dst[i] = 0xc0 | code_point >> 6;
+        }
+        else {
+            dst[i] = 0xe0 | code_point >> 12;
+            dst[i + 1] = 0x80 | (code_point >> 6 & 0x3f);
+        }
+
+        dst[i + n - 1] = 0x80 | (code_point & 0x3f);
+        i += n;
+    }
+}
+
+static uint32_t beefmote_fold_code_point(uint32_t c)
+{
+    // Ranges of uppercase and titlecase letters of the Basic Multilingual Plane
+    // (from Unicode 14.0, and with U+03C2, final sigma, folded to U+03C3 too)
+    // and how far their lowercase versions are. Some of them alternate: only
+    // their even (or odd) code points fold, usually to the one right after.
+    enum { ALL, EVEN, ODD };
+    static const struct { uint16_t first, last; int32_t delta; uint8_t which; } ranges[] = {
+        { 0x00c0, 0x00d6, 32, ALL },      { 0x00d8, 0x00de, 32, ALL },      { 0x0100, 0x012e, 1, EVEN },
+        { 0x0132, 0x0136, 1, EVEN },      { 0x0139, 0x0147, 1, ODD },       { 0x014a, 0x0176, 1, EVEN },
+        { 0x0178, 0x0178, -121, ALL },    { 0x0179, 0x017d, 1, ODD },       { 0x0181, 0x0181, 210, ALL },
+        { 0x0182, 0x0184, 1, EVEN },      { 0x0186, 0x0186, 206, ALL },     { 0x0187, 0x0187, 1, ALL },
+        { 0x0189, 0x018a, 205, ALL },     { 0x018b, 0x018b, 1, ALL },       { 0x018e, 0x018e, 79, ALL },
+        { 0x018f, 0x018f, 202, ALL },     { 0x0190, 0x0190, 203, ALL },     { 0x0191, 0x0191, 1, ALL },
+        { 0x0193, 0x0193, 205, ALL },     { 0x0194, 0x0194, 207, ALL },     { 0x0196, 0x0196, 211, ALL },
+        { 0x0197, 0x0197, 209, ALL },     { 0x0198, 0x0198, 1, ALL },       { 0x019c, 0x019c, 211, ALL },
+        { 0x019d, 0x019d, 213, ALL },     { 0x019f, 0x019f, 214, ALL },     { 0x01a0, 0x01a4, 1, EVEN },
+        { 0x01a6, 0x01a6, 218, ALL },     { 0x01a7, 0x01a7, 1, ALL },       { 0x01a9, 0x01a9, 218, ALL },
+        { 0x01ac, 0x01ac, 1, ALL },       { 0x01ae, 0x01ae, 218, ALL },     { 0x01af, 0x01af, 1, ALL },
+        { 0x01b1, 0x01b2, 217, ALL },     { 0x01b3, 0x01b5, 1, ODD },       { 0x01b7, 0x01b7, 219, ALL },
+        { 0x01b8, 0x01b8, 1, ALL },       { 0x01bc, 0x01bc, 1, ALL },       { 0x01c4, 0x01c4, 2, ALL },
+        { 0x01c5, 0x01c5, 1, ALL },       { 0x01c7, 0x01c7, 2, ALL },       { 0x01c8, 0x01c8, 1, ALL },
+        { 0x01ca, 0x01ca, 2, ALL },       { 0x01cb, 0x01db, 1, ODD },       { 0x01de, 0x01ee, 1, EVEN },
+        { 0x01f1, 0x01f1, 2, ALL },       { 0x01f2, 0x01f4, 1, EVEN },      { 0x01f6, 0x01f6, -97, ALL },
+        { 0x01f7, 0x01f7, -56, ALL },     { 0x01f8, 0x021e, 1, EVEN },      { 0x0220, 0x0220, -130, ALL },
+        { 0x0222, 0x0232, 1, EVEN },      { 0x023b, 0x023b, 1, ALL },       { 0x023d, 0x023d, -163, ALL },
+        { 0x0241, 0x0241, 1, ALL },       { 0x0243, 0x0243, -195, ALL },    { 0x0244, 0x0244, 69, ALL },
+        { 0x0245, 0x0245, 71, ALL },      { 0x0246, 0x024e, 1, EVEN },      { 0x0370, 0x0372, 1, EVEN },
+        { 0x0376, 0x0376, 1, ALL },       { 0x037f, 0x037f, 116, ALL },     { 0x0386, 0x0386, 38, ALL },
+        { 0x0388, 0x038a, 37, ALL },      { 0x038c, 0x038c, 64, ALL },      { 0x038e, 0x038f, 63, ALL },
+        { 0x0391, 0x03a1, 32, ALL },      { 0x03a3, 0x03ab, 32, ALL },      { 0x03c2, 0x03c2, 1, ALL },
+        { 0x03cf, 0x03cf, 8, ALL },       { 0x03d8, 0x03ee, 1, EVEN },      { 0x03f4, 0x03f4, -60, ALL },
+        { 0x03f7, 0x03f7, 1, ALL },       { 0x03f9, 0x03f9, -7, ALL },      { 0x03fa, 0x03fa, 1, ALL },
+        { 0x03fd, 0x03ff, -130, ALL },    { 0x0400, 0x040f, 80, ALL },      { 0x0410, 0x042f, 32, ALL },
+        { 0x0460, 0x0480, 1, EVEN },      { 0x048a, 0x04be, 1, EVEN },      { 0x04c0, 0x04c0, 15, ALL },
+        { 0x04c1, 0x04cd, 1, ODD },       { 0x04d0, 0x052e, 1, EVEN },      { 0x0531, 0x0556, 48, ALL },
+        { 0x10a0, 0x10c5, 7264, ALL },    { 0x10c7, 0x10c7, 7264, ALL },    { 0x10cd, 0x10cd, 7264, ALL },
+        { 0x13a0, 0x13ef, 38864, ALL },   { 0x13f0, 0x13f5, 8, ALL },       { 0x1c90, 0x1cba, -3008, ALL },
+        { 0x1cbd, 0x1cbf, -3008, ALL },   { 0x1e00, 0x1e94, 1, EVEN },      { 0x1ea0, 0x1efe, 1, EVEN },
+        { 0x1f08, 0x1f0f, -8, ALL },      { 0x1f18, 0x1f1d, -8, ALL },      { 0x1f28, 0x1f2f, -8, ALL },
+        { 0x1f38, 0x1f3f, -8, ALL },      { 0x1f48, 0x1f4d, -8, ALL },      { 0x1f59, 0x1f5f, -8, ODD },
+        { 0x1f68, 0x1f6f, -8, ALL },      { 0x1f88, 0x1f8f, -8, ALL },      { 0x1f98, 0x1f9f, -8, ALL },
+        { 0x1fa8, 0x1faf, -8, ALL },      { 0x1fb8, 0x1fb9, -8, ALL },      { 0x1fba, 0x1fbb, -74, ALL },
+        { 0x1fbc, 0x1fbc, -9, ALL },      { 0x1fc8, 0x1fcb, -86, ALL },     { 0x1fcc, 0x1fcc, -9, ALL },
+        { 0x1fd8, 0x1fd9, -8, ALL },      { 0x1fda, 0x1fdb, -100, ALL },    { 0x1fe8, 0x1fe9, -8, ALL },
+        { 0x1fea, 0x1feb, -112, ALL },    { 0x1fec, 0x1fec, -7, ALL },      { 0x1ff8, 0x1ff9, -128, ALL },
+        { 0x1ffa, 0x1ffb, -126, ALL },    { 0x1ffc, 0x1ffc, -9, ALL },      { 0x2132, 0x2132, 28, ALL },
+        { 0x2160, 0x216f, 16, ALL },      { 0x2183, 0x2183, 1, ALL },       { 0x24b6, 0x24cf, 26, ALL },
+        { 0x2c00, 0x2c2f, 48, ALL },      { 0x2c60, 0x2c60, 1, ALL },       { 0x2c63, 0x2c63, -3814, ALL },
+        { 0x2c67, 0x2c6b, 1, ODD },       { 0x2c72, 0x2c72, 1, ALL },       { 0x2c75, 0x2c75, 1, ALL },
+        { 0x2c80, 0x2ce2, 1, EVEN },      { 0x2ceb, 0x2ced, 1, ODD },       { 0x2cf2, 0x2cf2, 1, ALL },
+        { 0xa640, 0xa66c, 1, EVEN },      { 0xa680, 0xa69a, 1, EVEN },      { 0xa722, 0xa72e, 1, EVEN },
+        { 0xa732, 0xa76e, 1, EVEN },      { 0xa779, 0xa77b, 1, ODD },       { 0xa77d, 0xa77d, -35332, ALL },
+        { 0xa77e, 0xa786, 1, EVEN },      { 0xa78b, 0xa78b, 1, ALL },       { 0xa790, 0xa792, 1, EVEN },
+        { 0xa796, 0xa7a8, 1, EVEN },      { 0xa7b3, 0xa7b3, 928, ALL },     { 0xa7b4, 0xa7c2, 1, EVEN },
+        { 0xa7c4, 0xa7c4, -48, ALL },     { 0xa7c6, 0xa7c6, -35384, ALL },  { 0xa7c7, 0xa7c9, 1, ODD },
+        { 0xa7d0, 0xa7d0, 1, ALL },       { 0xa7d6, 0xa7d8, 1, EVEN },      { 0xa7f5, 0xa7f5, 1, ALL },
+        { 0xff21, 0xff3a, 32, ALL },
+    };
+
+    int low = 0;
+    int high = sizeof(ranges) / sizeof(ranges[0]) - 1;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (ranges[mid].last < c) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    if (c >= ranges[low].first && c <= ranges[low].last &&
+        (ranges[low].which == ALL || (c & 1) == (ranges[low].which == ODD))) {
+        return c + ranges[low].delta;
+    }
+
+    return c;
+}
+
+static size_t beefmote_scan_generic(const char *hay, size_t from, size_t end, const char *needle, size_t k)
+{
+    assert(hay);
+    assert(needle);
+    assert(k > 0);
+
+    if (from >= end) {
+        return end;
+    }
+
+    const char *found = memmem(hay + from, end - from, needle, k);
+
+    return found ? (size_t) (found - hay) : end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Both vector versions compare a vector's worth of candidate positions at
+// once, checking the first and the last byte of the needle, and only compare
+// the rest of it where both of them match. Hay must be followed by at least a
+// vector of readable bytes.
+__attribute__((target("sse2")))
+static size_t beefmote_scan_sse2(const char *hay, size_t from, size_t end, const char *needle, size_t k)
+{
+    assert(hay);
+    assert(needle);
+    assert(k > 0);
+
+    if (end < k || from > end - k) {
+        return end;
+    }
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+    size_t stop = end - k + 1;     // candidate positions are before this
+
+    for (size_t i = from; i < stop; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*) (hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*) (hay + i + k - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+
+            if (pos >= stop) {
+                return end;
+            }
+
+            if (k <= 2 || !memcmp(hay + pos + 1, needle + 1, k - 2)) {
+                return pos;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return end;
+}
+
+__attribute__((target("avx2")))
+static size_t beefmote_scan_avx2(const char *hay, size_t from, size_t end, const char *needle, size_t k)
+{
+    assert(hay);
+    assert(needle);
+    assert(k > 0);
+
+    if (end < k || from > end - k) {
+        return end;
+    }
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+    size_t stop = end - k + 1;
+
+    for (size_t i = from; i < stop; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*) (hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*) (hay + i + k - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                              _mm256_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+
+            if (pos >= stop) {
+                return end;
+            }
+
+            if (k <= 2 || !memcmp(hay + pos + 1, needle + 1, k - 2)) {
+                return pos;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return end;
+}
+#endif
+
+static int beefmote_search(ddb_playlist_t *playlist, const char *text, DB_playItem_t ***results,
+                           beefmote_search_session *session)
+{
+    assert(playlist);
+    assert(text);
+    assert(results);
+
+    *results = NULL;
+
+    size_t k = strlen(text);
+    if (k == 0) {
+        return 0;
+    }
+
+    beefmote_search_mirror *mirror = beefmote_search_mirror_get(playlist);
+    char *needle = malloc(k);
+    int *hits = mirror ? malloc((mirror->tracks_n + 1) * sizeof(int)) : NULL;
+    int hits_n = 0;
+
+    if (!hits || !needle) {
+        free(needle);
+        free(hits);
+        return -1;
+    }
+
+    beefmote_fold(needle, text, k);
+
+    if (session && beefmote_search_session_narrows(session, playlist, mirror, needle, k)) {
+        for (int h = 0; h < session->hits_n; h++) {
+            int i = session->hits[h];
+
+            for (int f = 0; f < BEEFMOTE_SEARCH_FIELDS_N; f++) {
+                size_t end = mirror->offsets[f][i + 1];
+
+                if (beefmote_scan(mirror->arena[f], mirror->offsets[f][i], end, needle, k) < end) {
+                    hits[hits_n++] = i;
+                    break;
+                }
+            }
+        }
+    }
+    else {
+        hits_n = beefmote_search_scan(mirror, needle, k, hits);
+
+        if (hits_n == -1) {
+            free(needle);
+            free(hits);
+            return -1;
+        }
+    }
+
+    *results = malloc((hits_n ? hits_n : 1) * sizeof(DB_playItem_t *));
+
+    if (!*results) {
+        free(needle);
+        free(hits);
+        return -1;
+    }
+
+    for (int h = 0; h < hits_n; h++) {
+        deadbeef->pl_item_ref(mirror->tracks[hits[h]]);
+        (*results)[h] = mirror->tracks[hits[h]];
+    }
+
+    if (session) {
+        beefmote_search_session_reset(session);
+
+        deadbeef->plt_ref(playlist);
+        session->playlist = playlist;
+        session->fingerprint = mirror->fingerprint;
+        session->changed_seq = mirror->changed_seq;
+        session->text = needle;
+        session->text_len = k;
+        session->hits = hits;
+        session->hits_n = hits_n;
+    }
+    else {
+        free(needle);
+        free(hits);
+    }
+
+    return hits_n;
+}
+
+static int beefmote_search_scan(beefmote_search_mirror *mirror, const char *needle, size_t k, int *hits)
+{
+    assert(mirror);
+    assert(needle);
+    assert(hits);
+
+    uint8_t *found = calloc(mirror->tracks_n + 1, 1);
+    if (!found) {
+        return -1;
+    }
+
+    for (int f = 0; f < BEEFMOTE_SEARCH_FIELDS_N; f++) {
+        const size_t *offsets = mirror->offsets[f];
+        size_t pos = 0;
+
+        for (;;) {
+            pos = beefmote_scan(mirror->arena[f], pos, mirror->arena_len[f], needle, k);
+            if (pos >= mirror->arena_len[f]) {
+                break;
+            }
+
+            // Find out whose value it is, and go on from the next one.
+            int low = 0;
+            int high = mirror->tracks_n - 1;
+
+            while (low < high) {
+                int mid = (low + high + 1) / 2;
+
+                if (offsets[mid] <= pos) {
+                    low = mid;
+                }
+                else {
+                    high = mid - 1;
+                }
+            }
+
+            found[low] = 1;
+            pos = offsets[low + 1];
+        }
+    }
+
+    int hits_n = 0;
+
+    for (int i = 0; i < mirror->tracks_n; i++) {
+        if (found[i]) {
+            hits[hits_n++] = i;
+        }
+    }
+
+    free(found);
+
+    return hits_n;
+}
+
+static bool beefmote_search_all(beefmote_client *client, const char *text, ddb_playlist_t *playlist)
+{
+    assert(client);
+    assert(text);
+    assert(playlist);
+
+    size_t k = strlen(text);
+    int plt_n = k > 0 ? deadbeef->plt_get_count() : 0;
+
+    beefmote_search_batch *search = calloc(1, sizeof(beefmote_search_batch));
+    char *needle = malloc(k + 1);
+    beefmote_search_job *jobs = calloc(plt_n > 0 ? plt_n : 1, sizeof(beefmote_search_job));
+
+    if (!search || !needle || !jobs) {
+        free(search);
+        free(needle);
+        free(jobs);
+        return false;
+    }
+
+    beefmote_fold(needle, text, k);
+    deadbeef->plt_ref(playlist);
+    search->playlist = playlist;
+    search->jobs = jobs;
+    search->needle = needle;
+    strcpy(search->tag, client->tag);
+
+    // Mirrors are brought up to date here, since that isn't thread safe. Each
+    // job takes a copy, which stays valid until it lets go of the mirror.
+    for (int i = 0; i < plt_n; i++) {
+        ddb_playlist_t *plt = deadbeef->plt_get_for_idx(i);
+        beefmote_search_mirror *mirror = plt ? beefmote_search_mirror_get(plt) : NULL;
+        int *hits = mirror ? malloc((mirror->tracks_n + 1) * sizeof(int)) : NULL;
+
+        // The other playlists are still worth searching.
+        if (!hits) {
+            if (plt) {
+                deadbeef->plt_unref(plt);
+            }
+            continue;
+        }
+
+        beefmote_search_job *job = &jobs[search->jobs_n++];
+
+        job->playlist = plt;
+        job->plt_idx = i;
+        job->mirror = mirror;
+        job->view = *mirror;
+        job->needle = needle;
+        job->k = k;
+        job->hits = hits;
+        mirror->scans++;
+    }
+
+    if (plt_n > 0 && search->jobs_n == 0) {
+        beefmote_search_all_free(search);
+        return false;
+    }
+
+    client->awaiting = &search->batch;
+    client->reply_deferred = true;
+    beefmote_jobs_dispatch(&search->batch, jobs, sizeof(beefmote_search_job), search->jobs_n, beefmote_job_search,
+                           beefmote_search_all_done);
+
+    return true;
+}
+
+static void beefmote_search_all_done(beefmote_batch *batch)
+{
+    assert(batch);
+
+    beefmote_search_batch *search = (beefmote_search_batch*) ((char*) batch - offsetof(beefmote_search_batch, batch));
+    beefmote_client *client = beefmote_clients;
+
+    // The client might have gone away in the meantime.
+    while (client && client->awaiting != batch) {
+        client = client->next;
+    }
+
+    if (!client) {
+        beefmote_search_all_free(search);
+        return;
+    }
+
+    // Playlists whose scan ran out of memory are left out, like the ones we
+    // couldn't start one for.
+    int results_n = 0;
+    int searched_n = 0;
+
+    for (int i = 0; i < search->jobs_n; i++) {
+        if (search->jobs[i].hits_n != -1) {
+            results_n += search->jobs[i].hits_n;
+            searched_n++;
+        }
+    }
+
+    bool failed = search->jobs_n > 0 && searched_n == 0;
+    DB_playItem_t **results = failed ? NULL : malloc((results_n ? results_n : 1) * sizeof(DB_playItem_t *));
+    int *plt_idxs = failed ? NULL : malloc((results_n ? results_n : 1) * sizeof(int));
+
+    failed = !results || !plt_idxs;
+
+    // Results come in playlist order, and in playlist order within each one.
+    for (int i = 0, n = 0; i < search->jobs_n && !failed; i++) {
+        beefmote_search_job *job = &search->jobs[i];
+
+        for (int h = 0; h < job->hits_n; h++, n++) {
+            DB_playItem_t *track = job->view.tracks[job->hits[h]];
+
+            deadbeef->pl_item_ref(track);
+            results[n] = track;
+            plt_idxs[n] = job->plt_idx;
+        }
+    }
+
+    client->awaiting = NULL;
+    beefmote_client_retag(client, search->tag);
+    client_print_newline(client->socket);
+
+    // Results are streamed like tracklists are.
+    if (!failed) {
+        beefmote_client_set_results(client, results, results_n);
+        client->results_plt = plt_idxs;
+        beefmote_client_start_stream(client, search->playlist, PL_SEARCH, false);
+    }
+    else {
+        free(results);
+        free(plt_idxs);
+        client_print_string(client->socket, "Out of memory\n\n");
+
+        if (search->tag[0]) {
+            client_print_string(client->socket, "[BEEFMOTE_DONE]\n");
+        }
+    }
+
+    beefmote_client_retag(client, "");
+    beefmote_search_all_free(search);
+}
+
+static void beefmote_search_all_free(beefmote_search_batch *search)
+{
+    assert(search);
+
+    for (int i = 0; i < search->jobs_n; i++) {
+        beefmote_search_job *job = &search->jobs[i];
+
+        if (job->hits) {
+            beefmote_search_mirror_unpin(job->mirror);
+            free(job->hits);
+        }
+
+        if (job->playlist) {
+            deadbeef->plt_unref(job->playlist);
+        }
+    }
+
+    deadbeef->plt_unref(search->playlist);
+    free(search->jobs);
+    free(search->needle);
+    free(search);
+}
+
+static void beefmote_search_mirror_unpin(beefmote_search_mirror *mirror)
+{
+    assert(mirror);
+    assert(mirror->scans > 0);
+
+    if (--mirror->scans > 0) {
+        return;
+    }
+
+    while (mirror->retired) {
+        beefmote_search_mirror *retired = mirror->retired;
+        mirror->retired = retired->retired;
+        beefmote_search_mirror_free(retired);
+        free(retired);
+    }
+}
+
+static void beefmote_job_search(void *data)
+{
+    beefmote_search_job *job = data;
+
+    assert(job);
+
+    job->hits_n = beefmote_search_scan(&job->view, job->needle, job->k, job->hits);
+}
+
+static bool beefmote_search_session_narrows(beefmote_search_session *session, ddb_playlist_t *playlist,
+                                            beefmote_search_mirror *mirror, const char *text, size_t len)
+{
+    assert(session);
+    assert(mirror);
+    assert(text);
+
+    return session->playlist == playlist && session->fingerprint == mirror->fingerprint &&
+           session->changed_seq == mirror->changed_seq && session->text && len >= session->text_len &&
+           memmem(text, len, session->text, session->text_len);
+}
+
+static void beefmote_search_session_reset(beefmote_search_session *session)
+{
+    assert(session);
+
+    if (session->playlist) {
+        deadbeef->plt_unref(session->playlist);
+    }
+
+    free(session->text);
+    free(session->hits);
+    memset(session, 0, sizeof(beefmote_search_session));
+}
+
+static beefmote_sync_tree *beefmote_sync_tree_get(ddb_playlist_t *playlist, beefmote_batch **building)
+{
+    assert(playlist);
+    assert(building);
+
+    *building = NULL;
+
+    // Without the tracks of the playlist, we can't tell which chunks changed.
+    beefmote_playlist_info *info = beefmote_playlist_info_get(playlist);
+    if (!info || !info->tracks) {
+        return NULL;
+    }
+
+    beefmote_sync_tree *tree = &info->sync;
+
+    if (!tree->build && tree->valid && tree->generation == info->generation) {
+        return tree;
+    }
+
+    if (!tree->build) {
+        tree->build = beefmote_sync_start(info);
+    }
+
+    *building = tree->build ? &tree->build->batch : NULL;
+
+    return NULL;
+}
+
+// Ascending order of track addresses, for qsort and bsearch.
+static int beefmote_compare_tracks(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(DB_playItem_t * const *) a;
+    uintptr_t y = (uintptr_t) *(DB_playItem_t * const *) b;
+
+    return (x > y) - (x < y);
+}
+
+static beefmote_sync_build *beefmote_sync_start(beefmote_playlist_info *info)
+{
+    assert(info);
+
+    beefmote_sync_tree *tree = &info->sync;
+
+    // Chunks are hashed again when one of their tracks had its metadata
+    // changed, or all of them if we can't tell which ones those were anymore.
+    DB_playItem_t *changed[BEEFMOTE_CHANGED_TRACKS_MAX];
+    int changed_n = 0;
+    bool reuse = tree->valid;
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    uint64_t seq = beefmote_changed_seq;
+
+    if (seq - tree->changed_seq > BEEFMOTE_CHANGED_TRACKS_MAX) {
+        reuse = false;
+    }
+    else {
+        for (uint64_t i = tree->changed_seq; i < seq; i++) {
+            changed[changed_n++] = beefmote_changed_tracks[i % BEEFMOTE_CHANGED_TRACKS_MAX];
+        }
+    }
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    qsort(changed, changed_n, sizeof(DB_playItem_t *), beefmote_compare_tracks);
+
+    int tracks_n = info->tracks_n;
+    int chunks_n = (tracks_n + BEEFMOTE_SYNC_CHUNK - 1) / BEEFMOTE_SYNC_CHUNK;
+    int old_chunks_n = tree->levels_n > 0 ? tree->level_n[0] : 0;
+
+    beefmote_sync_build *build = calloc(1, sizeof(beefmote_sync_build));
+    DB_playItem_t **tracks = malloc((tracks_n ? tracks_n : 1) * sizeof(DB_playItem_t *));
+    char **lines = calloc(chunks_n ? chunks_n : 1, sizeof(char *));
+    uint64_t *chunks = malloc((chunks_n ? chunks_n : 1) * sizeof(uint64_t));
+    beefmote_sync_job *jobs = malloc((chunks_n ? chunks_n : 1) * sizeof(beefmote_sync_job));
+
+    if (!build || !tracks || !lines || !chunks || !jobs) {
+        free(build);
+        free(tracks);
+        free(lines);
+        free(chunks);
+        free(jobs);
+        return NULL;
+    }
+
+    for (int i = 0; i < tracks_n; i++) {
+        deadbeef->pl_item_ref(info->tracks[i]);
+        tracks[i] = info->tracks[i];
+    }
+
+    int jobs_n = 0;
+
+    for (int c = 0; c < chunks_n; c++) {
+        int first = c * BEEFMOTE_SYNC_CHUNK;
+        int n = tracks_n - first < BEEFMOTE_SYNC_CHUNK ? tracks_n - first : BEEFMOTE_SYNC_CHUNK;
+        int old_n = tree->tracks_n - first < BEEFMOTE_SYNC_CHUNK ? tree->tracks_n - first : BEEFMOTE_SYNC_CHUNK;
+        bool kept = reuse && c < old_chunks_n && tree->lines[c] && old_n == n &&
+                    !memcmp(tracks + first, tree->tracks + first, n * sizeof(DB_playItem_t *));
+
+        for (int i = first; i < first + n && kept && changed_n > 0; i++) {
+            kept = !bsearch(&tracks[i], changed, changed_n, sizeof(DB_playItem_t *), beefmote_compare_tracks);
+        }
+
+        if (kept) {
+            chunks[c] = tree->level[0][c];
+            lines[c] = tree->lines[c];
+            tree->lines[c] = NULL;
+            continue;
+        }
+
+        beefmote_sync_job *job = &jobs[jobs_n++];
+
+        memset(job, 0, sizeof(beefmote_sync_job));
+        job->format.tracks = tracks + first;
+        job->format.first = first;
+        job->format.tracks_n = n;
+        job->format.print_addr = true;
+        job->chunk = c;
+    }
+
+    // What we took from the hashes we had is gone from them.
+    tree->valid = false;
+
+    build->jobs = jobs;
+    build->info = info;
+    build->tracks_n = tracks_n;
+    build->tracks = tracks;
+    build->lines = lines;
+    build->chunks = chunks;
+    build->generation = info->generation;
+    build->changed_seq = seq;
+
+    beefmote_debug_print("hashing %d of %d sync chunks\n", jobs_n, chunks_n);
+    beefmote_jobs_dispatch(&build->batch, jobs, sizeof(beefmote_sync_job), jobs_n, beefmote_job_sync,
+                           beefmote_sync_done);
+
+    return build;
+}
+
+static void beefmote_job_sync(void *data)
+{
+    beefmote_sync_job *job = data;
+
+    assert(job);
+
+    beefmote_job_format(&job->format);
+
+    char *buf = job->format.buf;
+
+    if (!buf) {
+        return;
+    }
+
+    // Formatting leaves plenty of room after the last line.
+    buf[job->format.len] = 0;
+    job->hash = beefmote_siphash(beefmote_sync_key, buf, job->format.len);
+
+    char *shrunk = realloc(buf, job->format.len + 1);
+    job->format.buf = shrunk ? shrunk : buf;
+}
+
+static void beefmote_sync_done(beefmote_batch *batch)
+{
+    assert(batch);
+
+    beefmote_sync_build *build = (beefmote_sync_build*) ((char*) batch - offsetof(beefmote_sync_build, batch));
+    beefmote_sync_tree *tree = &build->info->sync;
+    int chunks_n = (build->tracks_n + BEEFMOTE_SYNC_CHUNK - 1) / BEEFMOTE_SYNC_CHUNK;
+
+    // The lines of chunks we couldn't format are left NULL.
+    for (int i = 0; i < batch->jobs_n; i++) {
+        beefmote_sync_job *job = &build->jobs[i];
+
+        build->lines[job->chunk] = job->format.buf;
+        build->chunks[job->chunk] = job->hash;
+    }
+
+    beefmote_sync_tree_clear(tree);
+
+    tree->build = NULL;
+    tree->generation = build->generation;
+    tree->changed_seq = build->changed_seq;
+    tree->tracks_n = build->tracks_n;
+    tree->tracks = build->tracks;
+    tree->lines = build->lines;
+    tree->level[0] = build->chunks;
+    tree->level_n[0] = chunks_n;
+    tree->levels_n = 1;
+
+    bool failed = false;
+
+    for (int i = 0; i < chunks_n && !failed; i++) {
+        failed = !tree->lines[i];
+    }
+
+    if (failed || !beefmote_sync_tree_grow(tree)) {
+        beefmote_sync_tree_clear(tree);
+    }
+    else {
+        tree->valid = true;
+    }
+
+    // Clients that went away in the meantime aren't there anymore.
+    for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+        if (client->awaiting != batch) {
+            continue;
+        }
+
+        client->awaiting = NULL;
+        beefmote_client_retag(client, client->sync_tag);
+        beefmote_sync_reply(client, tree->valid ? tree : NULL, client->sync_comm_id, client->sync_args);
+
+        if (client->sync_tag[0]) {
+            client_print_string(client->socket, "[BEEFMOTE_DONE]\n");
+        }
+
+        beefmote_client_retag(client, "");
+        free(client->sync_args);
+        client->sync_args = NULL;
+    }
+
+    free(build->jobs);
+    free(build);
+}
+
+static bool beefmote_sync_tree_grow(beefmote_sync_tree *tree)
+{
+    assert(tree);
+    assert(tree->levels_n == 1);
+
+    if (tree->level_n[0] == 0) {
+        free(tree->level[0]);
+        tree->level[0] = NULL;
+        tree->levels_n = 0;
+        tree->root = beefmote_siphash(beefmote_sync_key, "", 0);
+        return true;
+    }
+
+    while (tree->level_n[tree->levels_n - 1] > 1 && tree->levels_n < BEEFMOTE_SYNC_LEVELS_MAX) {
+        int below_n = tree->level_n[tree->levels_n - 1];
+        uint64_t *below = tree->level[tree->levels_n - 1];
+        int nodes_n = (below_n + BEEFMOTE_SYNC_FANOUT - 1) / BEEFMOTE_SYNC_FANOUT;
+        uint64_t *nodes = malloc(nodes_n * sizeof(uint64_t));
+
+        if (!nodes) {
+            return false;
+        }
+
+        for (int i = 0; i < nodes_n; i++) {
+            int first = i * BEEFMOTE_SYNC_FANOUT;
+            int n = below_n - first < BEEFMOTE_SYNC_FANOUT ? below_n - first : BEEFMOTE_SYNC_FANOUT;
+            nodes[i] = beefmote_siphash(beefmote_sync_key, below + first, n * sizeof(uint64_t));
+        }
+
+        tree->level[tree->levels_n] = nodes;
+        tree->level_n[tree->levels_n] = nodes_n;
+        tree->levels_n++;
+    }
+
+    tree->root = tree->level[tree->levels_n - 1][0];
+
+    return true;
+}
+
+static void beefmote_sync_tree_clear(beefmote_sync_tree *tree)
+{
+    assert(tree);
+
+    if (tree->lines) {
+        for (int i = 0; i * BEEFMOTE_SYNC_CHUNK < tree->tracks_n; i++) {
+            free(tree->lines[i]);
+        }
+    }
+
+    for (int i = 0; i < tree->tracks_n; i++) {
+        deadbeef->pl_item_unref(tree->tracks[i]);
+    }
+
+    for (int i = 0; i < tree->levels_n; i++) {
+        free(tree->level[i]);
+    }
+
+    free(tree->lines);
+    free(tree->tracks);
+
+    // What we went through is still worth remembering, and so is the build.
+    uint64_t changed_seq = tree->changed_seq;
+    beefmote_sync_build *build = tree->build;
+
+    memset(tree, 0, sizeof(beefmote_sync_tree));
+    tree->changed_seq = changed_seq;
+    tree->build = build;
+}
+
+static beefmote_snapshot *beefmote_snapshot_get(ddb_playlist_t *playlist, bool print_addr,
+                                                beefmote_batch **building)
+{
+    assert(playlist);
+    assert(building);
+
+    *building = NULL;
+
+    beefmote_playlist_info *info = beefmote_playlist_info_get(playlist);
+    if (!info) {
+        return NULL;
+    }
+
+    beefmote_snapshot **cached = &info->snapshots[print_addr ? 1 : 0];
+    beefmote_snapshot_build **build = &info->builds[print_addr ? 1 : 0];
+
+    if (*cached && (*cached)->generation == info->generation) {
+        (*cached)->refs++;
+        return *cached;
+    }
+
+    if (*cached) {
+        beefmote_snapshot_unref(*cached);
+        *cached = NULL;
+    }
+
+    // One being taken of what the playlist was still goes to the clients
+    // waiting for it, but isn't kept.
+    if (*build && (*build)->generation != info->generation) {
+        (*build)->info = NULL;
+        *build = NULL;
+    }
+
+    if (!*build) {
+        *build = beefmote_snapshot_start(info, print_addr);
+    }
+
+    *building = *build ? &(*build)->batch : NULL;
+
+    return NULL;
+}
+
+static beefmote_snapshot_build *beefmote_snapshot_start(beefmote_playlist_info *info, bool print_addr)
+{
+    assert(info);
+
+    beefmote_snapshot_build *build = calloc(1, sizeof(beefmote_snapshot_build));
+    beefmote_snapshot *snapshot = calloc(1, sizeof(beefmote_snapshot));
+
+    if (!build || !snapshot) {
+        free(build);
+        free(snapshot);
+        return NULL;
+    }
+
+    snapshot->fd = memfd_create("beefmote-tracklist", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (snapshot->fd == -1) {
+        beefmote_debug_print("error: couldn't create memfd, errno = %d\n", errno);
+        free(build);
+        free(snapshot);
+        return NULL;
+    }
+
+    // The playlist must not change while we go through it, or the count in
+    // the first line could be wrong. We only hold the lock long enough to
+    // take a reference to every track; formatting them is done afterwards,
+    // in parallel.
+    deadbeef->pl_lock();
+
+    int tracks_n = deadbeef->plt_get_item_count(info->playlist, PL_MAIN);
+    DB_playItem_t **tracks = malloc((tracks_n ? tracks_n : 1) * sizeof(DB_playItem_t *));
+    int idx = 0;
+
+    if (tracks) {
+        DB_playItem_t *track = deadbeef->plt_get_first(info->playlist, PL_MAIN);
+
+        for (; idx < tracks_n && track; idx++) {
+            tracks[idx] = track;
+            track = deadbeef->pl_get_next(track, PL_MAIN);
+        }
+
+        if (track) {
+            deadbeef->pl_item_unref(track);
+        }
+    }
+
+    deadbeef->pl_unlock();
+
+    snapshot->tracks_n = idx;
+    snapshot->generation = info->generation;
+    snapshot->refs = 1;
+    snapshot->slices = malloc((idx / BEEFMOTE_STREAM_SLICE + 1) * sizeof(off_t));
+
+    deadbeef->plt_ref(info->playlist);
+    build->snapshot = snapshot;
+    build->info = info;
+    build->playlist = info->playlist;
+    build->tracks = tracks;
+    build->tracks_n = idx;
+    build->generation = info->generation;
+    build->print_addr = print_addr;
+    build->failed = !tracks || !snapshot->slices;
+
+    char line[BEEFMOTE_NAME_MAXLENGTH];
+    int len = sprintf(line, "[BEEFMOTE_TRACKLIST_BEGIN] %d\n", idx);
+
+    build->failed = build->failed || write(snapshot->fd, line, len) != len;
+    snapshot->size += len;
+
+    beefmote_snapshot_round(build);
+
+    return build;
+}
+
+static void beefmote_snapshot_round(beefmote_snapshot_build *build)
+{
+    assert(build);
+
+    int round_n = (beefmote_workers_n + 1) * 2;
+    int jobs_n = 0;
+
+    for (int i = build->first; i < build->tracks_n && jobs_n < round_n && !build->failed;
+         i += BEEFMOTE_FORMAT_RANGE) {
+        beefmote_format_job *job = &build->jobs[jobs_n++];
+
+        job->tracks = build->tracks + i;
+        job->first = i;
+        job->tracks_n = build->tracks_n - i < BEEFMOTE_FORMAT_RANGE ? build->tracks_n - i : BEEFMOTE_FORMAT_RANGE;
+        job->print_addr = build->print_addr;
+        job->buf = NULL;
+        job->len = 0;
+    }
+
+    beefmote_jobs_dispatch(&build->batch, build->jobs, sizeof(beefmote_format_job), jobs_n, beefmote_job_format,
+                           beefmote_snapshot_round_done);
+}
+
+static void beefmote_snapshot_round_done(beefmote_batch *batch)
+{
+    assert(batch);
+
+    beefmote_snapshot_build *build = (beefmote_snapshot_build*) ((char*) batch -
+                                                                 offsetof(beefmote_snapshot_build, batch));
+    beefmote_snapshot *snapshot = build->snapshot;
+
+    for (int i = 0; i < batch->jobs_n; i++) {
+        beefmote_format_job *job = &build->jobs[i];
+
+        if (!build->failed && job->buf) {
+            for (int j = 0; j * BEEFMOTE_STREAM_SLICE < job->tracks_n; j++) {
+                snapshot->slices[job->first / BEEFMOTE_STREAM_SLICE + j] = snapshot->size + job->slices[j];
+            }
+
+            build->failed = write(snapshot->fd, job->buf, job->len) != job->len;
+            snapshot->size += job->len;
+        }
+        else {
+            build->failed = true;
+        }
+
+        free(job->buf);
+        build->first = job->first + job->tracks_n;
+    }
+
+    if (!build->failed && build->first < build->tracks_n) {
+        beefmote_snapshot_round(build);
+        return;
+    }
+
+    for (int i = 0; i < build->tracks_n; i++) {
+        deadbeef->pl_item_unref(build->tracks[i]);
+    }
+
+    free(build->tracks);
+
+    if (!build->failed && build->tracks_n == 0) {
+        snapshot->slices[0] = snapshot->size;
+    }
+
+    char line[BEEFMOTE_NAME_MAXLENGTH];
+    int len = sprintf(line, "[BEEFMOTE_TRACKLIST_END]\n");
+    build->failed = build->failed || write(snapshot->fd, line, len) != len;
+    snapshot->size += len;
+
+    // Nobody can change it from now on, not even by mistake.
+    if (build->failed ||
+        fcntl(snapshot->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        beefmote_debug_print("error: couldn't write tracklist snapshot, errno = %d\n", errno);
+        close(snapshot->fd);
+        free(snapshot->slices);
+        free(snapshot);
+        snapshot = NULL;
+    }
+    else {
+        beefmote_debug_print("took snapshot of %d tracks (%ld bytes)\n", snapshot->tracks_n, (long) snapshot->size);
+    }
+
+    if (build->info) {
+        build->info->builds[build->print_addr ? 1 : 0] = NULL;
+
+        if (snapshot) {
+            snapshot->refs++;
+            build->info->snapshots[build->print_addr ? 1 : 0] = snapshot;
+        }
+    }
+
+    // Clients that went away in the meantime aren't there anymore.
+    for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+        if (client->awaiting == batch) {
+            client->awaiting = NULL;
+            beefmote_client_send_tracklist(client, build->playlist, snapshot, build->print_addr);
+        }
+    }
+
+    if (snapshot) {
+        beefmote_snapshot_unref(snapshot);
+    }
+
+    deadbeef->plt_unref(build->playlist);
+    free(build);
+}
+
+static void beefmote_snapshot_unref(beefmote_snapshot *snapshot)
+{
+    assert(snapshot);
+    assert(snapshot->refs > 0);
+
+    if (--snapshot->refs > 0) {
+        return;
+    }
+
+    close(snapshot->fd);
+    free(snapshot->slices);
+    free(snapshot);
+}
+
+static void beefmote_worker(void *data)
+{
+    deadbeef->mutex_lock(beefmote_jobs_mutex);
+
+    while (true) {
+        while (!beefmote_workers_stop && !beefmote_batches) {
+            deadbeef->cond_wait(beefmote_jobs_cond, beefmote_jobs_mutex);
+        }
+
+        if (beefmote_workers_stop) {
+            break;
+        }
+
+        beefmote_batch *batch = beefmote_batches;
+        void *job = batch->jobs + batch->picked++ * batch->job_size;
+
+        if (batch->picked == batch->jobs_n) {
+            beefmote_batches = batch->next;
+
+            if (!beefmote_batches) {
+                beefmote_batches_tail = &beefmote_batches;
+            }
+        }
+
+        deadbeef->mutex_unlock(beefmote_jobs_mutex);
+
+        batch->run(job);
+
+        deadbeef->mutex_lock(beefmote_jobs_mutex);
+
+        if (--batch->left > 0) {
+            continue;
+        }
+
+        if (batch->done) {
+            batch->next = beefmote_batches_done;
+            beefmote_batches_done = batch;
+            beefmote_wakeup_thread();
+        }
+
+        deadbeef->cond_broadcast(beefmote_jobs_done_cond);
+    }
+
+    deadbeef->mutex_unlock(beefmote_jobs_mutex);
+}
+
+static void beefmote_workers_start()
+{
+    beefmote_workers_n = 0;
+    beefmote_workers_stop = false;
+    beefmote_batches = NULL;
+    beefmote_batches_tail = &beefmote_batches;
+    beefmote_batches_done = NULL;
+    beefmote_batches_n = 0;
+    beefmote_jobs_mutex = deadbeef->mutex_create_nonrecursive();
+    beefmote_jobs_cond = deadbeef->cond_create();
+    beefmote_jobs_done_cond = deadbeef->cond_create();
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores > 1 ? cores - 1 : 1;     // Beefmote's thread doesn't run jobs itself
+
+    if (wanted > BEEFMOTE_WORKERS_MAX) {
+        wanted = BEEFMOTE_WORKERS_MAX;
+    }
+
+    for (int i = 0; i < wanted; i++) {
+        intptr_t tid = deadbeef->thread_start(beefmote_worker, NULL);
+
+        if (!tid) {
+            beefmote_debug_print("error: couldn't start worker thread\n");
+            break;
+        }
+
+        beefmote_workers[beefmote_workers_n++] = tid;
+    }
+
+    beefmote_debug_print("started %d worker threads\n", beefmote_workers_n);
+}
+
+static void beefmote_workers_stop_all()
+{
+    deadbeef->mutex_lock(beefmote_jobs_mutex);
+    beefmote_workers_stop = true;
+    deadbeef->cond_broadcast(beefmote_jobs_cond);
+    deadbeef->mutex_unlock(beefmote_jobs_mutex);
+
+    for (int i = 0; i < beefmote_workers_n; i++) {
+        deadbeef->thread_join(beefmote_workers[i]);
+    }
+
+    beefmote_workers_n = 0;
+    deadbeef->cond_free(beefmote_jobs_done_cond);
+    deadbeef->cond_free(beefmote_jobs_cond);
+    deadbeef->mutex_free(beefmote_jobs_mutex);
+}
+
+static void beefmote_import_thread(void *data)
+{
+    beefmote_import_job *job = data;
+
+    if (deadbeef->pl_add_files_begin(job->playlist) != 0) {
+        // Somebody else (e.g. the GUI) is adding files.
+        __atomic_store_n(&job->errors, job->paths_n, __ATOMIC_RELAXED);
+    }
+    else {
+        char *path = job->paths;
+
+        while (path && !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+            char *tab = strchr(path, '\t');
+
+            if (tab) {
+                *tab = 0;
+            }
+
+            struct stat st;
+
+            if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                beefmote_import_dir(job, path);
+            }
+            else {
+                beefmote_import_file(job, path);
+            }
+
+            path = tab ? tab + 1 : NULL;
+        }
+
+        deadbeef->pl_add_files_end();
+        deadbeef->plt_modified(job->playlist);
+    }
+
+    // Clients hear about all of it at once, instead of about every file added.
+    __atomic_store_n(&job->running, false, __ATOMIC_RELEASE);
+    deadbeef->sendmessage(DB_EV_PLAYLISTCHANGED, 0, DDB_PLAYLIST_CHANGE_CONTENT, 0);
+
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+}
+
+static void beefmote_import_dir(beefmote_import_job *job, const char *path)
+{
+    if (deadbeef->plt_add_dir2(0, job->playlist, path, beefmote_import_found, job) < 0 &&
+        !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void beefmote_import_file(beefmote_import_job *job, const char *path)
+{
+    __atomic_add_fetch(&job->scanned, 1, __ATOMIC_RELAXED);
+
+    if (deadbeef->plt_add_file2(0, job->playlist, path, beefmote_import_added, job) < 0 &&
+        !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int beefmote_import_added(DB_playItem_t *track, void *data)
+{
+    beefmote_import_job *job = data;
+
+    __atomic_add_fetch(&job->added, 1, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&job->cancel, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+static int beefmote_import_found(DB_playItem_t *track, void *data)
+{
+    beefmote_import_job *job = data;
+
+    __atomic_add_fetch(&job->scanned, 1, __ATOMIC_RELAXED);
+
+    return beefmote_import_added(track, data);
+}
+
+static void beefmote_import_progress(beefmote_timer *timer)
+{
+    beefmote_import_job *job = (beefmote_import_job*) ((char*) timer - offsetof(beefmote_import_job, timer));
+    bool done = __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+    int scanned = __atomic_load_n(&job->scanned, __ATOMIC_RELAXED);
+    int added = __atomic_load_n(&job->added, __ATOMIC_RELAXED);
+    int errors = __atomic_load_n(&job->errors, __ATOMIC_RELAXED);
+
+    // Nothing is sent while the import thread is stuck on a slow disk.
+    if (job->client && (done || scanned + errors != job->reported)) {
+        char str[BEEFMOTE_STR_MAXLENGTH];
+
+        if (done) {
+            sprintf(str, "[BEEFMOTE_IMPORT_END] %d %d %d %s\n", scanned, added, errors,
+                    job->cancel ? "cancelled" : "completed");
+        }
+        else {
+            sprintf(str, "[BEEFMOTE_IMPORT_PROGRESS] %d %d %d\n", scanned, added, errors);
+        }
+
+        beefmote_client_retag(job->client, job->tag);
+        client_print_string(job->client->socket, str);
+
+        if (done && job->tag[0]) {
+            client_print_string(job->client->socket, "[BEEFMOTE_DONE]\n");
+        }
+
+        beefmote_client_retag(job->client, "");
+        job->reported = scanned + errors;
+    }
+
+    if (done) {
+        beefmote_import_free();
+    }
+    else {
+        beefmote_timer_set(timer, BEEFMOTE_IMPORT_PROGRESS_MS, beefmote_import_progress);
+    }
+}
+
+static void beefmote_import_free()
+{
+    if (!beefmote_import.tid) {
+        return;
+    }
+
+    deadbeef->thread_join(beefmote_import.tid);
+    deadbeef->plt_unref(beefmote_import.playlist);
+    free(beefmote_import.paths);
+    beefmote_import.tid = 0;
+}
+
+static float beefmote_adjust(beefmote_adjuster *adjuster, float value, bool relative)
+{
+    assert(adjuster);
+
+    float min, max;
+    float current = adjuster->get(&min, &max);
+
+    // What Deadbeef reports may not have caught up with what we set yet (seeks
+    // happen on the streamer's thread), so steps add to the target until the
+    // burst is over.
+    if (relative) {
+        value += adjuster->timer.armed ? adjuster->target : current;
+    }
+
+    if (value < min) {
+        value = min;
+    }
+    else if (value > max) {
+        value = max;
+    }
+
+    adjuster->target = value;
+
+    if (adjuster->timer.armed) {
+        adjuster->pending = true;
+    }
+    else {
+        adjuster->set(value);
+        beefmote_timer_set(&adjuster->timer, BEEFMOTE_ADJUST_WINDOW_MS, beefmote_adjust_window_end);
+    }
+
+    return value;
+}
+
+static void beefmote_adjust_window_end(beefmote_timer *timer)
+{
+    beefmote_adjuster *adjuster = (beefmote_adjuster*) ((char*) timer - offsetof(beefmote_adjuster, timer));
+
+    if (!adjuster->pending) {
+        return;
+    }
+
+    adjuster->set(adjuster->target);
+    adjuster->pending = false;
+    beefmote_timer_set(timer, BEEFMOTE_ADJUST_WINDOW_MS, beefmote_adjust_window_end);
+}
+
+static float beefmote_adjust_volume_get(float *min, float *max)
+{
+    *min = deadbeef->volume_get_min_db();
+    *max = 0;
+
+    return deadbeef->volume_get_db();
+}
+
+static void beefmote_adjust_volume_set(float value)
+{
+    deadbeef->volume_set_db(value);
+}
+
+static float beefmote_adjust_position_get(float *min, float *max)
+{
+    DB_playItem_t *track = deadbeef->streamer_get_playing_track();
+
+    *min = 0;
+    *max = 0;
+
+    if (!track) {
+        return 0;
+    }
+
+    float duration = deadbeef->pl_get_item_duration(track);
+    deadbeef->pl_item_unref(track);
+
+    *max = duration > 0 ? duration : 0;
+
+    return deadbeef->streamer_get_playpos();
+}
+
+static void beefmote_adjust_position_set(float value)
+{
+    float min, max;
+    beefmote_adjust_position_get(&min, &max);
+
+    // The track may have changed in the meantime. Deadbeef seeks in percents.
+    if (max > 0) {
+        deadbeef->playback_set_pos((value < max ? value : max) * 100 / max);
+    }
+}
+
+static bool beefmote_parse_float(const char *str, float *value)
+{
+    assert(str);
+    assert(value);
+
+    char *end;
+    *value = strtof(str, &end);
+
+    if (end == str) {
+        return false;
+    }
+
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+
+    return !*end && isfinite(*value);
+}
+
+static void beefmote_print_volume(int client_socket, float volume)
+{
+    char str[BEEFMOTE_NAME_MAXLENGTH];
+
+    sprintf(str, "[BEEFMOTE_VOLUME] %.1f\n", volume);
+    client_print_string(client_socket, str);
+}
+
+static void beefmote_seek(int client_socket, float value, bool relative)
+{
+    float min, max;
+    beefmote_adjust_position_get(&min, &max);
+
+    if (max <= 0) {
+        client_print_string(client_socket, "[BEEFMOTE_POSITION] Not seekable\n");
+        return;
+    }
+
+    if (relative) {
+        value = value * max / 100;
+    }
+
+    char str[BEEFMOTE_NAME_MAXLENGTH];
+
+    sprintf(str, "[BEEFMOTE_POSITION] %.1f\n", beefmote_adjust(&beefmote_adjusters[BEEFMOTE_ADJUSTER_POSITION], value,
+                                                               relative));
+    client_print_string(client_socket, str);
+}
+
+static void beefmote_jobs_dispatch(beefmote_batch *batch, void *jobs, size_t job_size, int jobs_n,
+                                   void (*run)(void *job), void (*done)(beefmote_batch *batch))
+{
+    assert(batch);
+    assert(jobs);
+    assert(run);
+
+    *batch = (beefmote_batch) {
+        .jobs = jobs,
+        .job_size = job_size,
+        .jobs_n = jobs_n,
+        .left = jobs_n,
+        .run = run,
+        .done = done,
+    };
+
+    if (done) {
+        beefmote_batches_n++;
+    }
+
+    // Without workers, the jobs are run right away; done is still called later
+    // on, like for any other batch.
+    if (jobs_n == 0 || beefmote_workers_n == 0) {
+        for (int i = 0; i < jobs_n; i++) {
+            run(batch->jobs + i * job_size);
+        }
+
+        batch->picked = jobs_n;
+        batch->left = 0;
+    }
+
+    deadbeef->mutex_lock(beefmote_jobs_mutex);
+
+    if (batch->left == 0) {
+        if (done) {
+            batch->next = beefmote_batches_done;
+            beefmote_batches_done = batch;
+            beefmote_wakeup_thread();
+        }
+    }
+    else {
+        *beefmote_batches_tail = batch;
+        beefmote_batches_tail = &batch->next;
+        deadbeef->cond_broadcast(beefmote_jobs_cond);
+    }
+
+    deadbeef->mutex_unlock(beefmote_jobs_mutex);
+}
+
+static void beefmote_jobs_collect()
+{
+    deadbeef->mutex_lock(beefmote_jobs_mutex);
+    beefmote_batch *batch = beefmote_batches_done;
+    beefmote_batches_done = NULL;
+    deadbeef->mutex_unlock(beefmote_jobs_mutex);
+
+    while (batch) {
+        // done may dispatch the batch again.
+        beefmote_batch *next = batch->next;
+
+        beefmote_batches_n--;
+        batch->done(batch);
+        batch = next;
+    }
+}
+
+static void beefmote_jobs_drain()
+{
+    beefmote_jobs_collect();
+
+    while (beefmote_batches_n > 0) {
+        deadbeef->mutex_lock(beefmote_jobs_mutex);
+
+        while (!beefmote_batches_done) {
+            deadbeef->cond_wait(beefmote_jobs_done_cond, beefmote_jobs_mutex);
+        }
+
+        deadbeef->mutex_unlock(beefmote_jobs_mutex);
+
+        beefmote_jobs_collect();
+    }
+}
+
+static void beefmote_job_format(void *data)
+{
+    beefmote_format_job *job = data;
+
+    assert(job);
+
+    // Most lines are far shorter than this, so we rarely need to grow it.
+    int size = job->tracks_n * 128 + 2 * BEEFMOTE_STR_MAXLENGTH;
+    char *buf = malloc(size);
+    int len = 0;
+
+    for (int i = 0; i < job->tracks_n && buf; i++) {
+        if (size - len < 2 * BEEFMOTE_STR_MAXLENGTH) {
+            char *grown = realloc(buf, size * 2);
+
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+
+            buf = grown;
+            size *= 2;
+        }
+
+        if (i % BEEFMOTE_STREAM_SLICE == 0) {
+            job->slices[i / BEEFMOTE_STREAM_SLICE] = len;
+        }
+
+        len += sprintf(buf + len, "[BEEFMOTE_TRACKLIST_TRACK] (%d) ", job->first + i);
+        len += beefmote_format_track(buf + len, BEEFMOTE_STR_MAXLENGTH, job->tracks[i], job->print_addr);
+    }
+
+    job->buf = buf;
+    job->len = buf ? len : 0;
+}
+
+static void beefmote_snapshots_sweep()
+{
+    unsigned content = __atomic_load_n(&beefmote_playlist_generation, __ATOMIC_ACQUIRE);
+    unsigned metadata = __atomic_load_n(&beefmote_metadata_generation, __ATOMIC_ACQUIRE);
+
+    if (content == beefmote_snapshots_checked[0] && metadata == beefmote_snapshots_checked[1]) {
+        return;
+    }
+
+    beefmote_snapshots_checked[0] = content;
+    beefmote_snapshots_checked[1] = metadata;
+
+    for (beefmote_playlist_info *info = beefmote_playlist_infos; info; info = info->next) {
+        if (!info->snapshots[0] && !info->snapshots[1]) {
+            continue;
+        }
+
+        beefmote_playlist_info_get(info->playlist);
+
+        for (int i = 0; i < 2; i++) {
+            if (info->snapshots[i] && info->snapshots[i]->generation != info->generation) {
+                beefmote_snapshot_unref(info->snapshots[i]);
+                info->snapshots[i] = NULL;
+            }
+        }
+    }
+}
+
+static void client_print_playlist(int client_socket, ddb_playlist_t *playlist, bool print_addr)
+{
+    assert(client_socket > 0);
+    assert(playlist);
+
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
+        return;
+    }
+
+    // Tracklists are shared by everybody asking for the same one; while one
+    // is being taken, the reply waits for it. If we can't take a snapshot, or
+    // the client wants every line tagged, we format the tracklist just for
+    // this client.
+    beefmote_batch *building = NULL;
+    beefmote_snapshot *snapshot = client->tag[0] ? NULL : beefmote_snapshot_get(playlist, print_addr, &building);
+
+    if (building) {
+        client->awaiting = building;
+        client->reply_deferred = true;
+        return;
+    }
+
+    beefmote_client_send_tracklist(client, playlist, snapshot, print_addr);
+
+    if (snapshot) {
+        beefmote_snapshot_unref(snapshot);
+    }
+}
+
+static void beefmote_client_send_tracklist(beefmote_client *client, ddb_playlist_t *playlist,
+                                           beefmote_snapshot *snapshot, bool print_addr)
+{
+    assert(client);
+    assert(playlist);
+
+    if (snapshot) {
+        beefmote_client_commit_line(client);
+
+        deadbeef->mutex_lock(beefmote_clients_mutex);
+        beefmote_client_enqueue_snapshot(client, snapshot);
+        deadbeef->mutex_unlock(beefmote_clients_mutex);
+        return;
+    }
+
+    int pl_count = deadbeef->plt_get_item_count(playlist, PL_MAIN);
+
+    char str[BEEFMOTE_STR_MAXLENGTH];
+    sprintf(str, "[BEEFMOTE_TRACKLIST_BEGIN] %d\n", pl_count);
+    client_print_string(client->socket, str);
+
+    beefmote_client_start_stream(client, playlist, PL_MAIN, print_addr);
+}
+
+static beefmote_client *beefmote_client_get(int client_socket)
+{
+    if (client_socket < 0 || client_socket >= beefmote_clients_by_socket_n) {
+        return NULL;
+    }
+
+    return beefmote_clients_by_socket[client_socket];
+}
+
+static void beefmote_client_accept(beefmote_listener *listener)
+{
+    assert(listener);
+
+    for (;;) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_size = sizeof(client_addr);
+        int client_socket = accept4(listener->socket, (struct sockaddr *) &client_addr, &client_size,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                beefmote_debug_print("error: failed on accept(), errno = %d\n", errno);
+            }
+
+            return;
+        }
+
+        beefmote_client_add(listener, client_socket, (struct sockaddr*) &client_addr);
+    }
+}
+
+static void beefmote_client_add(beefmote_listener *listener, int client_socket, struct sockaddr *client_addr)
+{
+    assert(listener);
+    assert(client_addr);
+
+    char name[BEEFMOTE_NAME_MAXLENGTH];
+    beefmote_format_address(name, sizeof(name), client_addr, client_socket);
+
+    if (beefmote_clients_n >= BEEFMOTE_MAX_CLIENTS) {
+        beefmote_debug_print("too many clients, rejecting connection from %s\n", name);
+        close(client_socket);
+        return;
+    }
+
+    beefmote_client *client = calloc(1, sizeof(beefmote_client));
+    if (!client) {
+        close(client_socket);
+        return;
+    }
+
+    // Replies are small and already batched by the outbound queue; don't
+    // let Nagle hold them back.
+    if (listener->family != AF_UNIX) {
+        int enabled = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+    }
+
+    // Phones drop off Wi-Fi without saying goodbye. Have the kernel probe
+    // quiet connections, and give up on data that's never acknowledged.
+    if (listener->family != AF_UNIX && beefmote_keepalive > 0) {
+        int enabled = 1;
+        int interval = BEEFMOTE_KEEPALIVE_INTERVAL;
+        int probes = BEEFMOTE_KEEPALIVE_PROBES;
+        unsigned user_timeout = (beefmote_keepalive + interval * probes) * 1000u;
+
+        setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled));
+        setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPIDLE, &beefmote_keepalive, sizeof(beefmote_keepalive));
+        setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+        setsockopt(client_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    }
+
+    // HTTP clients talk first, and don't expect a welcome message. Give
+    // them a moment to do so before sending it.
+    client->socket = client_socket;
+    client->events = EPOLLIN;
+    client->welcome_pending = true;
+    strcpy(client->name, name);
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    if (client_socket >= beefmote_clients_by_socket_n) {
+        int table_n = client_socket * 2 + 1;
+        beefmote_client **table = realloc(beefmote_clients_by_socket, table_n * sizeof(beefmote_client*));
+
+        if (!table) {
+            deadbeef->mutex_unlock(beefmote_clients_mutex);
+            close(client_socket);
+            free(client);
+            return;
+        }
+
+        memset(table + beefmote_clients_by_socket_n, 0,
+               (table_n - beefmote_clients_by_socket_n) * sizeof(beefmote_client*));
+        beefmote_clients_by_socket = table;
+        beefmote_clients_by_socket_n = table_n;
+    }
+
+    beefmote_clients_by_socket[client_socket] = client;
+    client->next = beefmote_clients;
+    if (beefmote_clients) {
+        beefmote_clients->prev = client;
+    }
+    beefmote_clients = client;
+    beefmote_clients_n++;
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+#ifdef BEEFMOTE_IO_URING
+    if (beefmote_uring_enabled) {
+        client->serial = ++beefmote_ring.serial & 0xffffff;
+        beefmote_uring_recv(client);
+    }
+    else
+#endif
+    {
+        struct epoll_event ev = { .events = client->events, .data.fd = client_socket };
+        epoll_ctl(beefmote_epoll, EPOLL_CTL_ADD, client_socket, &ev);
+    }
+
+    beefmote_timer_set(&client->welcome_timer, BEEFMOTE_WELCOME_DELAY_MS, beefmote_client_welcome_timeout);
+    beefmote_client_touch(client);
+
+    beefmote_debug_print("got connection from %s\n", client->name);
+}
+
+static void beefmote_client_welcome(beefmote_client *client)
+{
+    assert(client);
+
+    if (!client->welcome_pending) {
+        return;
+    }
+
+    char welcome_str[BEEFMOTE_STR_MAXLENGTH];
+    strcpy(welcome_str, "Hello! Welcome to Beefmote's server. Type \"");
+    strcat(welcome_str, beefmote_commands[BEEFMOTE_HELP].name);
+    strcat(welcome_str, "\" for a list of available commands\n\n");
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+    client->welcome_pending = false;
+    beefmote_client_enqueue(client, welcome_str, strlen(welcome_str), false);
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    beefmote_timer_cancel(&client->welcome_timer);
+}
+
+static void beefmote_client_touch(beefmote_client *client)
+{
+    assert(client);
+
+    if (beefmote_ping_interval > 0) {
+        beefmote_timer_set(&client->ping_timer, beefmote_ping_interval * 1000ull, beefmote_client_ping);
+    }
+
+    if (beefmote_idle_timeout > 0) {
+        beefmote_timer_set(&client->idle_timer, beefmote_idle_timeout * 1000ull, beefmote_client_idle_timeout);
+    }
+}
+
+static void beefmote_client_welcome_timeout(beefmote_timer *timer)
+{
+    beefmote_client *client = (beefmote_client*) ((char*) timer - offsetof(beefmote_client, welcome_timer));
+
+    beefmote_client_welcome(client);
+}
+
+static void beefmote_client_ping(beefmote_timer *timer)
+{
+    beefmote_client *client = (beefmote_client*) ((char*) timer - offsetof(beefmote_client, ping_timer));
+
+    // HTTP clients only hear from us when they ask for something.
+    if (!client->http && !client->closing) {
+        deadbeef->mutex_lock(beefmote_clients_mutex);
+        beefmote_client_enqueue_notification(client, "[BEEFMOTE_PING]\n");
+        deadbeef->mutex_unlock(beefmote_clients_mutex);
+    }
+
+    beefmote_timer_set(timer, beefmote_ping_interval * 1000ull, beefmote_client_ping);
+}
+
+static void beefmote_client_idle_timeout(beefmote_timer *timer)
+{
+    beefmote_client *client = (beefmote_client*) ((char*) timer - offsetof(beefmote_client, idle_timer));
+
+    beefmote_debug_print("client %s has been idle for %ds, closing connection\n", client->name, beefmote_idle_timeout);
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+    client->closing = true;
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+}
+
+static void beefmote_format_address(char *buf, int size, struct sockaddr *addr, int socket)
+{
+    assert(buf);
+    assert(addr);
+
+    char str[INET6_ADDRSTRLEN];
+
+    switch (addr->sa_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &((struct sockaddr_in*) addr)->sin_addr, str, sizeof(str));
+        snprintf(buf, size, "%s:%d", str, ntohs(((struct sockaddr_in*) addr)->sin_port));
+        break;
+
+    case AF_INET6:
+        inet_ntop(AF_INET6, &((struct sockaddr_in6*) addr)->sin6_addr, str, sizeof(str));
+        snprintf(buf, size, "[%s]:%d", str, ntohs(((struct sockaddr_in6*) addr)->sin6_port));
+        break;
+
+    default:
+        // Unix domain socket peers have no name worth printing.
+        snprintf(buf, size, "local:%d", socket);
+        break;
+    }
+}
+
+static void beefmote_client_close(beefmote_client *client)
+{
+    assert(client);
+
+    beefmote_debug_print("closing connection with %s\n", client->name);
+
+#ifdef BEEFMOTE_IO_URING
+    if (beefmote_uring_enabled) {
+        // Requests in flight hold on to the socket; the cancellation must be
+        // submitted while its descriptor still refers to it.
+        struct io_uring_sqe *sqe = beefmote_uring_sqe(BEEFMOTE_URING_CANCEL, client->socket, client->serial);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        beefmote_uring_enter(0, 0);
+
+        for (int bid = client->held_first; client->held_n > 0; client->held_n--) {
+            int next = beefmote_ring.buf_next[bid];
+            beefmote_uring_recycle(bid);
+            bid = next;
+        }
+    }
+    else
+#endif
+    {
+        epoll_ctl(beefmote_epoll, EPOLL_CTL_DEL, client->socket, NULL);
+    }
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    if (client->prev) {
+        client->prev->next = client->next;
+    }
+    else {
+        beefmote_clients = client->next;
+    }
+
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+
+    beefmote_clients_by_socket[client->socket] = NULL;
+    beefmote_clients_n--;
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    beefmote_timer_cancel(&client->welcome_timer);
+    beefmote_timer_cancel(&client->ping_timer);
+    beefmote_timer_cancel(&client->idle_timer);
+
+    // The import goes on without anybody to report to.
+    if (beefmote_import.client == client) {
+        beefmote_import.client = NULL;
+    }
+
+    beefmote_session_detach(client);
+
+    close(client->socket);
+
+    while (client->out_head) {
+        beefmote_chunk *chunk = client->out_head;
+        client->out_head = chunk->next;
+        beefmote_chunk_free(chunk);
+    }
+
+    for (int i = 0; i < BEEFMOTE_NOTIFICATIONS_N; i++) {
+        free(client->coalesced[i]);
+    }
+
+    for (int i = 0; i < client->pending_n; i++) {
+        free(client->pending[(client->pending_first + i) % BEEFMOTE_PENDING_MAX]);
+    }
+
+    beefmote_client_stop_stream(client);
+    beefmote_client_set_results(client, NULL, 0);
+    beefmote_search_session_reset(&client->search);
+    free(client->sync_args);
+    free(client);
+}
+
+static void beefmote_client_commit_line(beefmote_client *client)
+{
+    assert(client);
+
+    if (client->line_len == 0) {
+        return;
+    }
+
+    // Lines too long for the line buffer are queued in pieces; only the first
+    // one gets the tag.
+    char line[BEEFMOTE_TAG_MAXLENGTH + 2 + sizeof(client->line)];
+    int len = client->line_continued ? 0 : beefmote_tag_prefix(line, client->tag);
+
+    memcpy(line + len, client->line, client->line_len);
+    len += client->line_len;
+    client->line_continued = client->line[client->line_len - 1] != '\n';
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+    beefmote_client_enqueue(client, line, len, false);
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    client->line_len = 0;
+}
+
+static void beefmote_client_retag(beefmote_client *client, const char *tag)
+{
+    assert(client);
+    assert(tag);
+
+    beefmote_client_commit_line(client);
+
+    client->line_continued = false;
+    strcpy(client->tag, tag);
+}
+
+static int beefmote_tag_prefix(char *str, const char *tag)
+{
+    assert(str);
+    assert(tag);
+
+    return tag[0] ? sprintf(str, "@%s ", tag) : 0;
+}
+
+static void beefmote_client_enqueue(beefmote_client *client, const char *data, int len, bool stream)
+{
+    assert(client);
+    assert(data);
+
+    if (client->closing || len <= 0) {
+        return;
+    }
+
+    if (client->out_bytes + len > beefmote_queue_limit) {
+        beefmote_debug_print("client %s went over the outbound queue limit, disconnecting\n", client->name);
+        client->closing = true;
+        return;
+    }
+
+    // Small pieces of data are packed together in the last chunk, if it has
+    // room left and holds the same kind of output.
+    beefmote_chunk *chunk = client->out_tail;
+
+    if (!chunk || chunk->stream != stream || chunk->snapshot || chunk->cap - chunk->len < len) {
+        int cap = len > BEEFMOTE_CHUNK_SIZE ? len : BEEFMOTE_CHUNK_SIZE;
+
+        chunk = malloc(sizeof(beefmote_chunk) + cap);
+        if (!chunk) {
+            beefmote_debug_print("error: out of memory, disconnecting client %s\n", client->name);
+            client->closing = true;
+            return;
+        }
+
+        chunk->next = NULL;
+        chunk->len = 0;
+        chunk->cap = cap;
+        chunk->sent = 0;
+        chunk->stream = stream;
+        chunk->snapshot = NULL;
+
+        if (client->out_tail) {
+            client->out_tail->next = chunk;
+        }
+        else {
+            client->out_head = chunk;
+        }
+
+        client->out_tail = chunk;
+    }
+
+    memcpy(chunk->data + chunk->len, data, len);
+    chunk->len += len;
+    client->out_bytes += len;
+
+    if (client->out_bytes >= beefmote_queue_high) {
+        client->throttled = true;
+    }
+}
+
+static void beefmote_client_enqueue_snapshot(beefmote_client *client, beefmote_snapshot *snapshot)
+{
+    assert(client);
+    assert(snapshot);
+
+    if (client->closing) {
+        return;
+    }
+
+    beefmote_chunk *chunk = malloc(sizeof(beefmote_chunk));
+    if (!chunk) {
+        beefmote_debug_print("error: out of memory, disconnecting client %s\n", client->name);
+        client->closing = true;
+        return;
+    }
+
+    // Snapshot bytes aren't the client's to pay for, so they don't count
+    // towards its outbound queue size.
+    snapshot->refs++;
+    chunk->next = NULL;
+    chunk->len = snapshot->size;
+    chunk->cap = 0;
+    chunk->sent = 0;
+    chunk->stream = true;
+    chunk->snapshot = snapshot;
+    chunk->offset = 0;
+
+    if (client->out_tail) {
+        client->out_tail->next = chunk;
+    }
+    else {
+        client->out_head = chunk;
+    }
+
+    client->out_tail = chunk;
+}
+
+static void beefmote_chunk_free(beefmote_chunk *chunk)
+{
+    assert(chunk);
+
+    if (chunk->snapshot) {
+        beefmote_snapshot_unref(chunk->snapshot);
+    }
+
+    free(chunk);
+}
+
+static void beefmote_client_notify(beefmote_client *client, int notification, const char *str)
+{
+    assert(client);
+    assert(notification >= 0 && notification < BEEFMOTE_NOTIFICATIONS_N);
+    assert(str);
+
+    // Notifications are part of Beefmote's protocol. Clients that haven't
+    // been welcomed yet might turn out to speak HTTP.
+    if (client->http || client->welcome_pending) {
+        return;
+    }
+
+    // A client is only considered slow when it has a lot of data queued *and*
+    // its socket doesn't take any more. A fast client whose queue is full
+    // because of a tracklist stream is fine.
+    if (!client->throttled || !client->blocked) {
+        beefmote_client_enqueue_notification(client, str);
+        return;
+    }
+
+    switch (beefmote_overflow_policy) {
+    case BEEFMOTE_OVERFLOW_DROP:
+        beefmote_debug_print("client %s isn't keeping up, dropping notification\n", client->name);
+        break;
+
+    case BEEFMOTE_OVERFLOW_COALESCE:
+        free(client->coalesced[notification]);
+
+        // Queue changes only make sense all together, so the client will have to list it again.
+        if (notification == BEEFMOTE_NOTIFICATION_QUEUE) {
+            client->coalesced[notification] = strdup("[BEEFMOTE_QUEUE_RESYNC]\n");
+        }
+        else {
+            client->coalesced[notification] = strdup(str);
+        }
+        break;
+
+    case BEEFMOTE_OVERFLOW_DISCONNECT:
+        beefmote_debug_print("client %s isn't keeping up, disconnecting\n", client->name);
+        client->closing = true;
+        break;
+    }
+}
+
+static void beefmote_client_enqueue_notification(beefmote_client *client, const char *str)
+{
+    assert(client);
+    assert(str);
+
+    if (!client->session || !client->session->tagged) {
+        beefmote_client_enqueue(client, str, strlen(str), false);
+        return;
+    }
+
+    // Frame every line, so that no notification can be taken for a part of a reply.
+    while (*str) {
+        const char *newline = strchr(str, '\n');
+        int len = newline ? newline - str + 1 : (int) strlen(str);
+
+        beefmote_client_enqueue(client, "@* ", 3, false);
+        beefmote_client_enqueue(client, str, len, false);
+        str += len;
+    }
+}
+
+static bool beefmote_client_flush(beefmote_client *client)
+{
+    assert(client);
+
+    while (client->out_head && !client->closing && client->deficit > 0) {
+        beefmote_chunk *head = client->out_head;
+        ssize_t bytes_n;
+
+        if (head->snapshot) {
+            off_t offset = head->offset + head->sent;
+            int len = head->len - head->sent < client->deficit ? head->len - head->sent : client->deficit;
+            bytes_n = sendfile(client->socket, head->snapshot->fd, &offset, len);
+        }
+        else {
+            struct iovec iov[BEEFMOTE_FLUSH_IOV_N];
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = beefmote_client_gather(client, iov, client->deficit) };
+            bytes_n = sendmsg(client->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+
+        if (!beefmote_client_sent(client, bytes_n, errno)) {
+            break;
+        }
+    }
+
+    beefmote_client_flushed(client);
+
+    return client->out_head && !client->closing && client->deficit <= 0;
+}
+
+static int beefmote_client_gather(beefmote_client *client, struct iovec *iov, int limit)
+{
+    assert(client);
+    assert(iov);
+
+    int iov_n = 0;
+
+    for (beefmote_chunk *chunk = client->out_head; chunk && !chunk->snapshot && iov_n < BEEFMOTE_FLUSH_IOV_N &&
+         limit > 0; chunk = chunk->next) {
+        int len = chunk->len - chunk->sent < limit ? chunk->len - chunk->sent : limit;
+
+        iov[iov_n].iov_base = chunk->data + chunk->sent;
+        iov[iov_n].iov_len = len;
+        iov_n++;
+        limit -= len;
+    }
+
+    return iov_n;
+}
+
+static bool beefmote_client_sent(beefmote_client *client, ssize_t bytes_n, int err)
+{
+    assert(client);
+    assert(client->out_head);
+
+    if (bytes_n < 0) {
+        if (err == EINTR) {
+            return true;
+        }
+
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+            client->blocked = true;
+            return false;
+        }
+
+        beefmote_debug_print("error: failed on send(), errno = %d, closing client socket\n", err);
+        client->closing = true;
+        return false;
+    }
+
+    if (!client->out_head->snapshot) {
+        client->out_bytes -= bytes_n;
+    }
+
+    client->deficit -= bytes_n;
+
+    while (bytes_n > 0) {
+        beefmote_chunk *chunk = client->out_head;
+        int chunk_left = chunk->len - chunk->sent;
+
+        if (bytes_n < chunk_left) {
+            chunk->sent += bytes_n;
+            break;
+        }
+
+        bytes_n -= chunk_left;
+        client->out_head = chunk->next;
+        if (!client->out_head) {
+            client->out_tail = NULL;
+        }
+        beefmote_chunk_free(chunk);
+    }
+
+    return true;
+}
+
+static void beefmote_client_flushed(beefmote_client *client)
+{
+    assert(client);
+
+    // Clients with nothing to send don't save up for later.
+    if (!client->out_head) {
+        client->blocked = false;
+        client->deficit = 0;
+    }
+    else if (client->deficit > BEEFMOTE_DRR_QUANTUM) {
+        client->deficit = BEEFMOTE_DRR_QUANTUM;
+    }
+
+    if (client->throttled && client->out_bytes <= beefmote_queue_low) {
+        client->throttled = false;
+
+        for (int i = 0; i < BEEFMOTE_NOTIFICATIONS_N; i++) {
+            if (client->coalesced[i]) {
+                beefmote_client_enqueue_notification(client, client->coalesced[i]);
+                free(client->coalesced[i]);
+                client->coalesced[i] = NULL;
+            }
+        }
+    }
+}
+
+static bool beefmote_client_read(beefmote_client *client)
+{
+    assert(client);
+
+    // Keep room for the terminating null.
+    int room = sizeof(client->in) - 1 - client->in_len;
+    if (room <= 0) {
+        return true;
+    }
+
+#ifdef BEEFMOTE_IO_URING
+    // The kernel already put the data in provided buffers; take what fits.
+    if (beefmote_uring_enabled) {
+        int taken = 0;
+
+        while (client->held_n > 0 && taken < room) {
+            int bid = client->held_first;
+            int len = beefmote_ring.buf_len[bid] - client->held_offset;
+            if (len > room - taken) {
+                len = room - taken;
+            }
+
+            memcpy(client->in + client->in_len + taken,
+                   beefmote_ring.buffers + (size_t) bid * BEEFMOTE_URING_BUFFER_SIZE + client->held_offset, len);
+            taken += len;
+            client->held_offset += len;
+
+            if (client->held_offset == beefmote_ring.buf_len[bid]) {
+                client->held_first = beefmote_ring.buf_next[bid];
+                client->held_n--;
+                client->held_offset = 0;
+                beefmote_uring_recycle(bid);
+            }
+        }
+
+        if (taken > 0) {
+            beefmote_debug_print("received %d bytes from client %s\n", taken, client->name);
+            client->in_len += taken;
+            beefmote_client_touch(client);
+        }
+
+        return true;
+    }
+#endif
+
+    int bytes_n = recv(client->socket, client->in + client->in_len, room, 0);
+
+    if (bytes_n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return true;
+        }
+
+        beefmote_debug_print("error: failed on read(), errno = %d, closing client socket\n", errno);
+        return false;
+    }
+
+    if (bytes_n == 0) {
+        beefmote_debug_print("client %s closed connection\n", client->name);
+        return false;
+    }
+
+    beefmote_debug_print("received %d bytes from client %s\n", bytes_n, client->name);
+    client->in_len += bytes_n;
+    beefmote_client_touch(client);
+
+    return true;
+}
+
+static int beefmote_client_next_line(beefmote_client *client)
+{
+    assert(client);
+
+    char *newline = memchr(client->in, '\n', client->in_len);
+
+    if (newline) {
+        return newline - client->in + 1;
+    }
+
+    // No room left for a newline to ever arrive; take what we have as a line.
+    if (client->in_len == sizeof(client->in) - 1) {
+        return client->in_len;
+    }
+
+    return 0;
+}
+
+static void beefmote_client_process_input(beefmote_client *client)
+{
+    assert(client);
+
+    // The first line tells HTTP clients apart from everybody else.
+    if (client->welcome_pending && !client->closing) {
+        int len = beefmote_client_next_line(client);
+        if (len == 0) {
+            return;
+        }
+
+        char line[BEEFMOTE_BUFSIZE];
+        memcpy(line, client->in, len);
+        line[len] = 0;
+
+        char tag[BEEFMOTE_TAG_MAXLENGTH + 1];
+        char *request = beefmote_request_tag(line, tag);
+
+        if (beefmote_http_detect(line)) {
+            beefmote_debug_print("client %s speaks HTTP\n", client->name);
+
+            deadbeef->mutex_lock(beefmote_clients_mutex);
+            client->http = true;
+            client->welcome_pending = false;
+            deadbeef->mutex_unlock(beefmote_clients_mutex);
+        }
+        else if (request && beefmote_command_lookup(request) == BEEFMOTE_RESUME) {
+            // Resuming clients have already been welcomed.
+            deadbeef->mutex_lock(beefmote_clients_mutex);
+            client->welcome_pending = false;
+            deadbeef->mutex_unlock(beefmote_clients_mutex);
+        }
+        else {
+            beefmote_client_welcome(client);
+        }
+    }
+
+    if (client->http) {
+        beefmote_http_process_input(client);
+        return;
+    }
+
+    while (!client->closing && client->pending_n < BEEFMOTE_PENDING_MAX) {
+        int len = beefmote_client_next_line(client);
+        if (len == 0) {
+            break;
+        }
+
+        char command[BEEFMOTE_BUFSIZE];
+        memset(command, 0, BEEFMOTE_BUFSIZE);
+        memcpy(command, client->in, len);
+        client->in_len -= len;
+        memmove(client->in, client->in + len, client->in_len);
+
+        char tag[BEEFMOTE_TAG_MAXLENGTH + 1];
+        char *request = beefmote_request_tag(command, tag);
+
+        if (!request) {
+            client_print_string(client->socket, "[BEEFMOTE_INVALID_TAG]\n");
+            beefmote_client_commit_line(client);
+            continue;
+        }
+
+        int comm_id = beefmote_command_lookup(request);
+        int bucket = comm_id != -1 && beefmote_commands[comm_id].priority == BEEFMOTE_PRIORITY_BULK ?
+                     BEEFMOTE_BUCKET_BULK : BEEFMOTE_BUCKET_CONTROL;
+
+        // Over budget requests are turned down. Answering pings and aborting
+        // are always allowed, so that a client can get out of trouble.
+        int wait_ms = comm_id == BEEFMOTE_PONG || comm_id == BEEFMOTE_ABORT ? 0 :
+                      beefmote_bucket_take(&client->buckets[bucket], beefmote_rates[bucket]);
+
+        if (wait_ms > 0) {
+            char str[BEEFMOTE_NAME_MAXLENGTH];
+            sprintf(str, "[BEEFMOTE_THROTTLED] %d\n", wait_ms);
+
+            beefmote_client_retag(client, tag);
+            client_print_string(client->socket, str);
+
+            if (tag[0]) {
+                client_print_string(client->socket, "[BEEFMOTE_DONE]\n");
+            }
+
+            beefmote_client_retag(client, "");
+            continue;
+        }
+
+        // Clients that tag their requests get a reply to each of them, so
+        // nothing they asked for is dropped.
+        if (comm_id != -1 && beefmote_commands[comm_id].priority == BEEFMOTE_PRIORITY_BULK && !tag[0] &&
+            beefmote_bulk_family(comm_id) != -1) {
+            beefmote_client_supersede(client, beefmote_bulk_family(comm_id));
+        }
+
+        if (comm_id != -1 && beefmote_commands[comm_id].priority == BEEFMOTE_PRIORITY_CONTROL) {
+            beefmote_debug_print("processing control command from client %s: %s", client->name, command);
+            beefmote_client_run(client, command);
+            continue;
+        }
+
+        char *pending = strdup(command);
+        if (!pending) {
+            beefmote_debug_print("error: out of memory, dropping command from client %s\n", client->name);
+            continue;
+        }
+
+        client->pending[(client->pending_first + client->pending_n) % BEEFMOTE_PENDING_MAX] = pending;
+        client->pending_n++;
+    }
+}
+
+static char *beefmote_request_tag(char *line, char *tag)
+{
+    assert(line);
+    assert(tag);
+
+    tag[0] = 0;
+
+    if (line[0] != '@') {
+        return line;
+    }
+
+    int len = 1;
+
+    while (isalnum((unsigned char) line[len]) || line[len] == '-' || line[len] == '_' || line[len] == '.') {
+        len++;
+    }
+
+    if (len == 1 || len - 1 > BEEFMOTE_TAG_MAXLENGTH || line[len] != ' ') {
+        return NULL;
+    }
+
+    memcpy(tag, line + 1, len - 1);
+    tag[len - 1] = 0;
+
+    while (line[len] == ' ') {
+        len++;
+    }
+
+    return line + len;
+}
+
+static void beefmote_client_run(beefmote_client *client, char *line)
+{
+    assert(client);
+    assert(line);
+
+    char tag[BEEFMOTE_TAG_MAXLENGTH + 1];
+    char *command = beefmote_request_tag(line, tag);
+
+    if (!command) {
+        return;
+    }
+
+    bool streaming = client->stream.playlist;
+
+    beefmote_client_retag(client, tag);
+    client->reply_deferred = false;
+    beefmote_process_command(client->socket, command);
+
+    // A stream or an import started by the command is still replying to it.
+    if (tag[0] && (streaming || !client->stream.playlist) && !client->reply_deferred) {
+        client_print_string(client->socket, "[BEEFMOTE_DONE]\n");
+    }
+
+    beefmote_client_retag(client, "");
+}
+
+static int beefmote_bucket_take(beefmote_bucket *bucket, int rate)
+{
+    assert(bucket);
+
+    if (rate <= 0) {
+        return 0;
+    }
+
+    uint64_t now = beefmote_now_ms();
+    double burst = (double) rate * BEEFMOTE_RATE_BURST;
+
+    if (!bucket->refilled) {
+        bucket->tokens = burst;
+    }
+    else {
+        bucket->tokens += (now - bucket->refilled) * rate / 1000.0;
+
+        if (bucket->tokens > burst) {
+            bucket->tokens = burst;
+        }
+    }
+
+    bucket->refilled = now;
+
+    if (bucket->tokens >= 1) {
+        bucket->tokens -= 1;
+        return 0;
+    }
+
+    return (int) ((1 - bucket->tokens) * 1000 / rate) + 1;
+}
+
+static int beefmote_client_next_pending(beefmote_client *client)
+{
+    assert(client);
+
+    if (client->closing || client->pending_n == 0) {
+        return -1;
+    }
+
+    if (!client->stream.playlist && !client->awaiting) {
+        return 0;
+    }
+
+    // Commands are run in order, so nothing else is run for a client while
+    // something is being streamed to it, or its jobs are being run. Replies to tagged requests can't be
+    // mistaken for the stream's, so those can go ahead, unless they'd need
+    // the stream themselves. Untagged ones keep their place.
+    for (int i = 0; i < client->pending_n; i++) {
+        char tag[BEEFMOTE_TAG_MAXLENGTH + 1];
+        char *command = beefmote_request_tag(client->pending[(client->pending_first + i) % BEEFMOTE_PENDING_MAX], tag);
+
+        if (!tag[0]) {
+            return -1;
+        }
+
+        int comm_id = beefmote_command_lookup(command);
+
+        if (comm_id == -1 || beefmote_commands[comm_id].priority != BEEFMOTE_PRIORITY_BULK) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void beefmote_client_run_pending(beefmote_client *client)
+{
+    assert(client);
+
+    int next = beefmote_client_next_pending(client);
+
+    if (next == -1) {
+        return;
+    }
+
+    char *command = client->pending[(client->pending_first + next) % BEEFMOTE_PENDING_MAX];
+
+    // Close the gap, keeping the commands that were ahead of it in order.
+    for (int i = next; i > 0; i--) {
+        client->pending[(client->pending_first + i) % BEEFMOTE_PENDING_MAX] =
+            client->pending[(client->pending_first + i - 1) % BEEFMOTE_PENDING_MAX];
+    }
+
+    client->pending_first = (client->pending_first + 1) % BEEFMOTE_PENDING_MAX;
+    client->pending_n--;
+
+    beefmote_debug_print("processing command from client %s: %s", client->name, command);
+    beefmote_client_run(client, command);
+    free(command);
+}
+
+static bool beefmote_client_has_work(beefmote_client *client)
+{
+    assert(client);
+
+    if (client->closing) {
+        return false;
+    }
+
+    // HTTP clients get their requests served one at a time.
+    bool can_take_input = client->http ? !client->stream.playlist && !client->awaiting && !client->close_when_done
+                                       : client->pending_n < BEEFMOTE_PENDING_MAX;
+
+    if (can_take_input && beefmote_client_next_line(client) > 0) {
+        return true;
+    }
+
+#ifdef BEEFMOTE_IO_URING
+    if (client->held_n > 0 && client->in_len < (int) sizeof(client->in) - 1) {
+        return true;
+    }
+#endif
+
+    if (client->stream.playlist && !client->throttled) {
+        return true;
+    }
+
+    // Output left over by the last flush, which the socket would take.
+    if (client->out_head && !client->blocked) {
+        return true;
+    }
+
+    return beefmote_client_next_pending(client) != -1;
+}
+
+static void beefmote_client_start_stream(beefmote_client *client, ddb_playlist_t *playlist, int iter,
+                                         bool print_addr)
+{
+    assert(client);
+    assert(playlist);
+    assert(iter == PL_MAIN || iter == PL_SEARCH);
+
+    beefmote_client_stop_stream(client);
+
+    deadbeef->plt_ref(playlist);
+    client->stream.playlist = playlist;
+
+    if (iter == PL_SEARCH) {
+        client->stream.track = client->results_n > 0 ? client->results[0] : NULL;
+
+        if (client->stream.track) {
+            deadbeef->pl_item_ref(client->stream.track);
+        }
+    }
+    else {
+        client->stream.track = deadbeef->plt_get_first(playlist, iter);
+    }
+
+    client->stream.iter = iter;
+    client->stream.idx = 0;
+    client->stream.print_addr = print_addr;
+    client->stream.json = client->http;
+    client->stream.etagged = false;
+    strcpy(client->stream.tag, client->tag);
+    client->stream.generation = __atomic_load_n(&beefmote_playlist_generation, __ATOMIC_ACQUIRE);
+}
+
+static void beefmote_client_stop_stream(beefmote_client *client)
+{
+    assert(client);
+
+    if (client->stream.track) {
+        deadbeef->pl_item_unref(client->stream.track);
+        client->stream.track = NULL;
+    }
+
+    if (client->stream.playlist) {
+        deadbeef->plt_unref(client->stream.playlist);
+        client->stream.playlist = NULL;
+    }
+}
+
+static void beefmote_client_set_results(beefmote_client *client, DB_playItem_t **results, int results_n)
+{
+    assert(client);
+
+    for (int i = 0; i < client->results_n; i++) {
+        deadbeef->pl_item_unref(client->results[i]);
+    }
+
+    free(client->results);
+    free(client->results_plt);
+    client->results = results;
+    client->results_n = results_n;
+    client->results_plt = NULL;
+}
+
+static DB_playItem_t *beefmote_client_search_result(int client_socket, int idx)
+{
+    beefmote_client *client = beefmote_client_get(client_socket);
+
+    if (idx < 0) {
+        return NULL;
+    }
+
+    if (client) {
+        if (idx >= client->results_n) {
+            return NULL;
+        }
+
+        deadbeef->pl_item_ref(client->results[idx]);
+        return client->results[idx];
+    }
+
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    if (!pl_curr) {
+        return NULL;
+    }
+
+    DB_playItem_t *track = deadbeef->plt_get_item_for_idx(pl_curr, idx, PL_SEARCH);
+    deadbeef->plt_unref(pl_curr);
+
+    return track;
+}
+
+static void beefmote_client_stream(beefmote_client *client)
+{
+    assert(client);
+    assert(client->stream.playlist);
+
+    beefmote_tracklist_stream *stream = &client->stream;
+    char str[BEEFMOTE_JSON_MAXLENGTH + BEEFMOTE_NAME_MAXLENGTH];
+
+    // A body sent with an ETag has to be the version of the playlist the ETag
+    // names, or a client could cache a mix of two under it. If the playlist
+    // changed since, the only way to tell is to fail the transfer: we close the
+    // connection without the empty chunk that would end the body.
+    if (stream->etagged) {
+        beefmote_playlist_info *info = beefmote_playlist_info_get(stream->playlist);
+
+        if (!info || info->generation != stream->etag_generation) {
+            beefmote_debug_print("playlist changed while sending it to client %s, closing connection\n",
+                                 client->name);
+            beefmote_client_stop_stream(client);
+
+            deadbeef->mutex_lock(beefmote_clients_mutex);
+            client->closing = true;
+            deadbeef->mutex_unlock(beefmote_clients_mutex);
+            return;
+        }
+    }
+
+    // If the playlist changed since we last sent something, the track we're
+    // holding might not be in it anymore. In that case we just end the stream;
+    // the client gets a [BEEFMOTE_PLAYLIST_CHANGED] if it wants to know about it.
+    // Search results are the client's own, so they don't change under us.
+    unsigned generation = __atomic_load_n(&beefmote_playlist_generation, __ATOMIC_ACQUIRE);
+
+    if (stream->iter == PL_MAIN && stream->generation != generation) {
+        stream->generation = generation;
+
+        if (stream->track && deadbeef->plt_get_item_idx(stream->playlist, stream->track, stream->iter) == -1) {
+            deadbeef->pl_item_unref(stream->track);
+            stream->track = NULL;
+        }
+    }
+
+    // Send at most a slice of tracks, so that we get back to reading (and
+    // running control commands) quickly.
+    for (int i = 0; i < BEEFMOTE_STREAM_SLICE && stream->track && !client->throttled && !client->closing; i++) {
+        int len;
+
+        if (stream->json) {
+            char json[BEEFMOTE_JSON_MAXLENGTH];
+            int json_len = stream->idx > 0 ? sprintf(json, ",") : 0;
+            json_len += beefmote_format_track_json(json + json_len, sizeof(json) - json_len, stream->track,
+                                                   stream->idx);
+
+            len = sprintf(str, "%x\r\n", json_len);
+            memcpy(str + len, json, json_len);
+            len += json_len;
+            memcpy(str + len, "\r\n", 2);
+            len += 2;
+        }
+        else if (stream->iter == PL_MAIN) {
+            len = beefmote_tag_prefix(str, stream->tag);
+            len += sprintf(str + len, "[BEEFMOTE_TRACKLIST_TRACK] (%d) ", stream->idx);
+            len += beefmote_format_track(str + len, BEEFMOTE_STR_MAXLENGTH - len, stream->track, stream->print_addr);
+        }
+        else {
+            len = beefmote_tag_prefix(str, stream->tag);
+            len += sprintf(str + len, "(%d)\t", stream->idx);
+
+            if (client->results_plt) {
+                len += sprintf(str + len, "%d\t", client->results_plt[stream->idx]);
+            }
+
+            len += beefmote_format_track(str + len, BEEFMOTE_STR_MAXLENGTH - len, stream->track, stream->print_addr);
+        }
+
+        deadbeef->mutex_lock(beefmote_clients_mutex);
+        beefmote_client_enqueue(client, str, len, true);
+        deadbeef->mutex_unlock(beefmote_clients_mutex);
+        stream->idx++;
+
+        DB_playItem_t *next;
+
+        if (stream->iter == PL_SEARCH) {
+            next = stream->idx < client->results_n ? client->results[stream->idx] : NULL;
+
+            if (next) {
+                deadbeef->pl_item_ref(next);
+            }
+        }
+        else {
+            next = deadbeef->pl_get_next(stream->track, stream->iter);
+        }
+
+        deadbeef->pl_item_unref(stream->track);
+        stream->track = next;
+    }
+
+    if (stream->track) {
+        return;
+    }
+
+    // The end of the stream is the end of the reply to the request that started it.
+    beefmote_client_retag(client, stream->tag);
+
+    if (stream->json) {
+        beefmote_http_print_chunk(client, "]");
+        client_print_string(client->socket, "0\r\n\r\n");
+    }
+    else if (stream->iter == PL_MAIN) {
+        client_print_string(client->socket, "[BEEFMOTE_TRACKLIST_END]\n");
+    }
+    else if (stream->idx > 0) {
+        client_print_newline(client->socket);
+    }
+    else {
+        client_print_string(client->socket, "(nothing was found)\n\n");
+    }
+
+    if (stream->tag[0]) {
+        client_print_string(client->socket, "[BEEFMOTE_DONE]\n");
+    }
+
+    beefmote_client_retag(client, "");
+    beefmote_client_stop_stream(client);
+}
+
+static bool beefmote_client_abort_stream(beefmote_client *client)
+{
+    assert(client);
+
+    char str[BEEFMOTE_STR_MAXLENGTH];
+    char tag[BEEFMOTE_TAG_MAXLENGTH + 1];
+
+    // The aborted reply is ended with the tag of the request it answers, which
+    // isn't necessarily the one being run.
+    strcpy(tag, client->tag);
+
+    // Tracklists are sent from snapshots rather than streamed, unless taking
+    // the snapshot failed. Replies to tagged requests are always streamed.
+    if (!client->stream.playlist) {
+        int tracks_n = beefmote_client_abort_snapshots(client);
+
+        if (tracks_n == -1) {
+            return false;
+        }
+
+        beefmote_debug_print("aborting tracklist to client %s after %d tracks\n", client->name, tracks_n);
+        sprintf(str, "[BEEFMOTE_TRACKLIST_ABORTED] %d\n", tracks_n);
+        beefmote_client_retag(client, "");
+        client_print_string(client->socket, str);
+        beefmote_client_retag(client, tag);
+        return true;
+    }
+
+    beefmote_debug_print("aborting stream to client %s after %d tracks\n", client->name, client->stream.idx);
+
+    // Drop the stream output that hasn't started to be sent. Chunks only hold
+    // whole lines, so the client never sees half a track.
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    beefmote_chunk **link = &client->out_head;
+    client->out_tail = NULL;
+
+    while (*link) {
+        beefmote_chunk *chunk = *link;
+
+        if (chunk->stream && chunk->sent == 0) {
+            *link = chunk->next;
+            if (!chunk->snapshot) {
+                client->out_bytes -= chunk->len;
+            }
+            beefmote_chunk_free(chunk);
+            continue;
+        }
+
+        client->out_tail = chunk;
+        link = &chunk->next;
+    }
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    if (client->stream.iter == PL_MAIN) {
+        sprintf(str, "[BEEFMOTE_TRACKLIST_ABORTED] %d\n", client->stream.idx);
+    }
+    else {
+        sprintf(str, "[BEEFMOTE_SEARCH_ABORTED] %d\n", client->stream.idx);
+    }
+
+    beefmote_client_retag(client, client->stream.tag);
+    client_print_string(client->socket, str);
+
+    if (client->stream.tag[0]) {
+        client_print_string(client->socket, "[BEEFMOTE_DONE]\n");
+    }
+
+    beefmote_client_retag(client, tag);
+    beefmote_client_stop_stream(client);
+
+    return true;
+}
+
+static void beefmote_client_supersede(beefmote_client *client, int family)
+{
+    assert(client);
+
+    // Pending commands of the same family with nothing else queued after them
+    // would only send results the client no longer wants.
+    while (client->pending_n > 0) {
+        int last = (client->pending_first + client->pending_n - 1) % BEEFMOTE_PENDING_MAX;
+
+        if (beefmote_bulk_family(beefmote_command_lookup(client->pending[last])) != family) {
+            break;
+        }
+
+        beefmote_debug_print("dropping superseded command from client %s: %s", client->name,
+                             client->pending[last]);
+        free(client->pending[last]);
+        client->pending_n--;
+    }
+
+    if (client->pending_n > 0) {
+        return;
+    }
+
+    // Without a stream going on, there might be tracklist snapshots on their way.
+    if (client->stream.playlist ? client->stream.iter == family : family == PL_MAIN) {
+        beefmote_client_abort_stream(client);
+    }
+}
+
+static int beefmote_client_abort_snapshots(beefmote_client *client)
+{
+    assert(client);
+
+    int tracks_n = -1;
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    beefmote_chunk **link = &client->out_head;
+    client->out_tail = NULL;
+
+    while (*link) {
+        beefmote_chunk *chunk = *link;
+
+        if (chunk->snapshot && chunk->sent == 0) {
+            *link = chunk->next;
+            beefmote_chunk_free(chunk);
+            continue;
+        }
+
+        // Only the first chunk can be partially sent.
+        if (chunk->snapshot) {
+            beefmote_snapshot *snapshot = chunk->snapshot;
+            off_t pos = chunk->offset + chunk->sent;
+            char buf[BEEFMOTE_STR_MAXLENGTH + 1];
+            ssize_t n = pread(snapshot->fd, buf, sizeof(buf), pos - 1);
+            off_t cut = pos;
+
+            // Finish the line being sent, unless we're right at the start of one.
+            if (n > 0 && buf[0] != '\n') {
+                char *newline = memchr(buf + 1, '\n', n - 1);
+                cut = newline ? pos + (newline - buf) : pos + n - 1;
+            }
+
+            // Nothing left to abort once the last line has started to be sent.
+            if (cut <= snapshot->size - (off_t) strlen("[BEEFMOTE_TRACKLIST_END]\n")) {
+                chunk->len = cut - chunk->offset;
+                tracks_n = 0;
+
+                // Count the track lines in the slice we're cutting short.
+                int slice = -1;
+
+                for (int i = 0; i * BEEFMOTE_STREAM_SLICE < snapshot->tracks_n && snapshot->slices[i] < cut; i++) {
+                    slice = i;
+                }
+
+                if (slice >= 0) {
+                    char *lines = malloc(cut - snapshot->slices[slice]);
+                    ssize_t lines_n = lines ? pread(snapshot->fd, lines, cut - snapshot->slices[slice],
+                                                    snapshot->slices[slice]) : 0;
+
+                    tracks_n = slice * BEEFMOTE_STREAM_SLICE;
+
+                    for (ssize_t i = 0; i < lines_n; i++) {
+                        tracks_n += lines[i] == '\n';
+                    }
+
+                    free(lines);
+                }
+            }
+        }
+
+        client->out_tail = chunk;
+        link = &chunk->next;
+    }
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    return tracks_n;
+}
+
+static int beefmote_bulk_family(int comm_id)
+{
+    switch (comm_id) {
+    case BEEFMOTE_TRACKLIST:
+    case BEEFMOTE_TRACKLIST_ADDRESS:
+        return PL_MAIN;
+
+    case BEEFMOTE_SEARCH:
+    case BEEFMOTE_SEARCH_ALL:
+        return PL_SEARCH;
+
+    default:
+        return -1;
+    }
+}
+
+static bool beefmote_http_detect(const char *line)
+{
+    assert(line);
+
+    // "METHOD target HTTP/1.x"
+    const char *ptr = line;
+
+    while (*ptr >= 'A' && *ptr <= 'Z') {
+        ptr++;
+    }
+
+    return ptr != line && *ptr == ' ' && strstr(ptr, " HTTP/1.");
+}
+
+static void beefmote_http_process_input(beefmote_client *client)
+{
+    assert(client);
+    assert(client->http);
+
+    beefmote_http_request *request = &client->request;
+
+    while (!client->closing && !client->close_when_done && !client->stream.playlist) {
+        int len = beefmote_client_next_line(client);
+        if (len == 0) {
+            break;
+        }
+
+        char line[BEEFMOTE_BUFSIZE];
+        memcpy(line, client->in, len);
+        line[len] = 0;
+        client->in_len -= len;
+        memmove(client->in, client->in + len, client->in_len);
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = 0;
+        }
+
+        if (!request->in_headers) {
+            int minor;
+
+            // Some clients send an empty line after a request.
+            if (len == 0) {
+                continue;
+            }
+
+            memset(request, 0, sizeof(*request));
+
+            if (sscanf(line, "%63s %999s HTTP/1.%d", request->method, request->target, &minor) != 3) {
+                client->close_when_done = true;
+                beefmote_http_respond(client, 400, NULL, "Bad request\n", false);
+                break;
+            }
+
+            request->in_headers = true;
+            request->keep_alive = minor >= 1;
+            continue;
+        }
+
+        // Headers we don't care about (or too long to fit in a line) are skipped.
+        if (len > 0) {
+            if (!strncasecmp(line, "Connection:", 11)) {
+                if (strcasestr(line + 11, "close")) {
+                    request->keep_alive = false;
+                }
+                else if (strcasestr(line + 11, "keep-alive")) {
+                    request->keep_alive = true;
+                }
+            }
+            else if (!strncasecmp(line, "If-None-Match:", 14)) {
+                const char *value = line + 14;
+
+                while (isspace(*value)) {
+                    value++;
+                }
+
+                snprintf(request->if_none_match, sizeof(request->if_none_match), "%s", value);
+            }
+
+            continue;
+        }
+
+        request->in_headers = false;
+
+        if (!request->keep_alive) {
+            client->close_when_done = true;
+        }
+
+        beefmote_http_serve(client);
+        beefmote_client_commit_line(client);
+    }
+}
+
+static void beefmote_http_serve(beefmote_client *client)
+{
+    assert(client);
+
+    beefmote_http_request *request = &client->request;
+    bool head = !strcmp(request->method, "HEAD");
+
+    beefmote_debug_print("serving HTTP request from client %s: %s %s\n", client->name, request->method,
+                         request->target);
+
+    // We don't read request bodies, so the connection can't be used afterwards.
+    if (strcmp(request->method, "GET") && !head) {
+        client->close_when_done = true;
+        beefmote_http_respond(client, 405, NULL, "Method not allowed\n", head);
+        return;
+    }
+
+    char *path = request->target;
+    char *query = strchr(path, '?');
+
+    if (query) {
+        *query++ = 0;
+    }
+
+    if (!strcmp(path, "/playlists")) {
+        beefmote_http_respond(client, 200, NULL, NULL, head);
+        if (head) {
+            return;
+        }
+
+        ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+        int pl_n = deadbeef->plt_get_count();
+        char str[BEEFMOTE_STR_MAXLENGTH * 2];
+
+        beefmote_http_print_chunk(client, "[");
+
+        for (int i = 0; i < pl_n; i++) {
+            ddb_playlist_t *pl = deadbeef->plt_get_for_idx(i);
+            if (!pl) {
+                continue;
+            }
+
+            char pl_name[BEEFMOTE_STR_MAXLENGTH];
+            char pl_title[BEEFMOTE_STR_MAXLENGTH];
+            deadbeef->plt_get_title(pl, pl_name, sizeof(pl_name));
+            beefmote_json_string(pl_title, sizeof(pl_title), pl_name);
+
+            snprintf(str, sizeof(str), "%s{\"index\":%d,\"title\":%s,\"tracks\":%d,\"current\":%s}", i > 0 ? "," : "",
+                     i, pl_title, deadbeef->plt_get_item_count(pl, PL_MAIN), pl == pl_curr ? "true" : "false");
+            beefmote_http_print_chunk(client, str);
+
+            deadbeef->plt_unref(pl);
+        }
+
+        beefmote_http_print_chunk(client, "]");
+        beefmote_http_print_chunk(client, "");
+
+        if (pl_curr) {
+            deadbeef->plt_unref(pl_curr);
+        }
+    }
+    else if (!strncmp(path, "/playlists/", 11)) {
+        // /playlists/<idx or "current">[/search?q=<text>]
+        char *idx_str = path + 11;
+        char *end = idx_str;
+        ddb_playlist_t *playlist = NULL;
+
+        if (!strncmp(idx_str, "current", 7)) {
+            playlist = deadbeef->plt_get_curr();
+            end = idx_str + 7;
+        }
+        else {
+            long idx = strtol(idx_str, &end, 10);
+
+            if (end != idx_str && idx >= 0 && idx < deadbeef->plt_get_count()) {
+                playlist = deadbeef->plt_get_for_idx(idx);
+            }
+        }
+
+        bool search = !strcmp(end, "/search");
+
+        if (playlist && (!*end || search)) {
+            beefmote_http_serve_tracks(client, playlist, search ? (query ? query : "") : NULL, head);
+        }
+        else {
+            beefmote_http_respond(client, 404, NULL, "Not found\n", head);
+        }
+
+        if (playlist) {
+            deadbeef->plt_unref(playlist);
+        }
+    }
+    else if (!strcmp(path, "/nowplaying")) {
+        beefmote_http_respond(client, 200, NULL, NULL, head);
+        if (head) {
+            return;
+        }
+
+        char str[BEEFMOTE_JSON_MAXLENGTH + BEEFMOTE_NAME_MAXLENGTH];
+        char track[BEEFMOTE_JSON_MAXLENGTH];
+        bool playing = deadbeef->get_output()->state() == OUTPUT_STATE_PLAYING;
+
+        if (beefmote_currtrack) {
+            beefmote_format_track_json(track, sizeof(track), beefmote_currtrack,
+                                       deadbeef->pl_get_idx_of(beefmote_currtrack));
+        }
+        else {
+            strcpy(track, "null");
+        }
+
+        // In seconds, like everywhere else (playback_get_pos is in percents).
+        snprintf(str, sizeof(str), "{\"playing\":%s,\"position\":%.3f,\"track\":%s}", playing ? "true" : "false",
+                 beefmote_currtrack ? deadbeef->streamer_get_playpos() : 0, track);
+        beefmote_http_print_chunk(client, str);
+        beefmote_http_print_chunk(client, "");
+    }
+    else {
+        beefmote_http_respond(client, 404, NULL, "Not found\n", head);
+    }
+}
+
+static void beefmote_http_serve_tracks(beefmote_client *client, ddb_playlist_t *playlist, const char *query,
+                                       bool head)
+{
+    assert(client);
+    assert(playlist);
+
+    // Search results depend on the search text, so they aren't worth an ETag.
+    if (query) {
+        char text[BEEFMOTE_BUFSIZE];
+
+        if (!beefmote_http_query_param(query, "q", text, sizeof(text))) {
+            beefmote_http_respond(client, 400, NULL, "Missing q parameter\n", head);
+            return;
+        }
+
+        DB_playItem_t **results;
+        int results_n = beefmote_search(playlist, text, &results, &client->search);
+
+        if (results_n == -1) {
+            beefmote_http_respond(client, 500, NULL, "Out of memory\n", head);
+            return;
+        }
+
+        beefmote_client_set_results(client, results, results_n);
+        beefmote_http_respond(client, 200, NULL, NULL, head);
+
+        if (!head) {
+            beefmote_http_print_chunk(client, "[");
+            beefmote_client_start_stream(client, playlist, PL_SEARCH, false);
+        }
+
+        return;
+    }
+
+    beefmote_playlist_info *info = beefmote_playlist_info_get(playlist);
+    char etag[BEEFMOTE_NAME_MAXLENGTH];
+
+    if (!info) {
+        beefmote_http_respond(client, 200, NULL, NULL, head);
+    }
+    else {
+        snprintf(etag, sizeof(etag), "\"%lx-%u\"", beefmote_boot_id, info->generation);
+
+        // The client already has this version of the playlist.
+        const char *if_none_match = client->request.if_none_match;
+
+        if (!strcmp(if_none_match, "*") || strstr(if_none_match, etag)) {
+            beefmote_http_respond(client, 304, etag, NULL, head);
+            return;
+        }
+
+        beefmote_http_respond(client, 200, etag, NULL, head);
+    }
+
+    if (!head) {
+        beefmote_http_print_chunk(client, "[");
+        beefmote_client_start_stream(client, playlist, PL_MAIN, false);
+
+        if (info) {
+            client->stream.etagged = true;
+            client->stream.etag_generation = info->generation;
+        }
+    }
+}
+
+static void beefmote_http_respond(beefmote_client *client, int status, const char *etag, const char *body,
+                                  bool head)
+{
+    assert(client);
+
+    const char *reason;
+
+    switch (status) {
+    case 200: reason = "OK"; break;
+    case 304: reason = "Not Modified"; break;
+    case 400: reason = "Bad Request"; break;
+    case 404: reason = "Not Found"; break;
+    case 405: reason = "Method Not Allowed"; break;
+    default: reason = "Internal Server Error"; break;
+    }
+
+    char str[BEEFMOTE_STR_MAXLENGTH];
+    int len = sprintf(str, "HTTP/1.1 %d %s\r\nServer: Beefmote\r\n", status, reason);
+
+    // Make browsers check back with If-None-Match every time.
+    len += sprintf(str + len, "Cache-Control: no-cache\r\n");
+
+    if (etag) {
+        len += sprintf(str + len, "ETag: %s\r\n", etag);
+    }
+
+    if (client->close_when_done) {
+        len += sprintf(str + len, "Connection: close\r\n");
+    }
+
+    if (status == 405) {
+        len += sprintf(str + len, "Allow: GET, HEAD\r\n");
+    }
+
+    if (status == 304) {
+        body = NULL;
+    }
+    else if (body) {
+        len += sprintf(str + len, "Content-Type: text/plain; charset=utf-8\r\nContent-Length: %d\r\n",
+                       (int) strlen(body));
+    }
+    else {
+        len += sprintf(str + len, "Content-Type: application/json; charset=utf-8\r\nTransfer-Encoding: chunked\r\n");
+    }
+
+    sprintf(str + len, "\r\n");
+    client_print_string(client->socket, str);
+
+    if (body && !head) {
+        client_print_string(client->socket, body);
+    }
+}
+
+static void beefmote_http_print_chunk(beefmote_client *client, const char *str)
+{
+    assert(client);
+    assert(str);
+
+    // An empty chunk ends the body.
+    char size[BEEFMOTE_NAME_MAXLENGTH];
+    sprintf(size, "%x\r\n", (unsigned) strlen(str));
+
+    client_print_string(client->socket, size);
+    client_print_string(client->socket, str);
+    client_print_string(client->socket, "\r\n");
+}
+
+static bool beefmote_http_query_param(const char *query, const char *name, char *buf, int size)
+{
+    assert(query);
+    assert(name);
+    assert(buf);
+
+    int name_len = strlen(name);
+    const char *ptr = query;
+
+    while (ptr) {
+        if (!strncmp(ptr, name, name_len) && ptr[name_len] == '=') {
+            int n = 0;
+
+            for (ptr += name_len + 1; *ptr && *ptr != '&' && n < size - 1; ) {
+                if (*ptr == '+') {
+                    buf[n++] = ' ';
+                    ptr++;
+                }
+                else if (*ptr == '%' && isxdigit(ptr[1]) && isxdigit(ptr[2])) {
+                    char hex[3] = { ptr[1], ptr[2], 0 };
+                    buf[n++] = strtol(hex, NULL, 16);
+                    ptr += 3;
+                }
+                else {
+                    buf[n++] = *ptr++;
+                }
+            }
+
+            buf[n] = 0;
+            return true;
+        }
+
+        ptr = strchr(ptr, '&');
+        if (ptr) {
+            ptr++;
+        }
+    }
+
+    return false;
+}
+
+static void beefmote_client_update_events(beefmote_client *client)
+{
+    assert(client);
+
+#ifdef BEEFMOTE_IO_URING
+    // Input comes as completions; we only need to hear about full sockets
+    // taking more.
+    if (beefmote_uring_enabled) {
+        if (client->blocked && client->out_head && !client->closing && !client->pollout_armed) {
+            struct io_uring_sqe *sqe = beefmote_uring_sqe(BEEFMOTE_URING_POLLOUT, client->socket, client->serial);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLOUT;
+            client->pollout_armed = true;
+        }
+
+        return;
+    }
+#endif
+
+    uint32_t events = 0;
+
+    // Stop reading from clients whose input we can't process yet; TCP will
+    // take care of slowing them down.
+    if (client->in_len < (int) sizeof(client->in) - 1) {
+        events |= EPOLLIN;
+    }
+
+    if (client->out_head) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != client->events) {
+        struct epoll_event ev = { .events = events, .data.fd = client->socket };
+        epoll_ctl(beefmote_epoll, EPOLL_CTL_MOD, client->socket, &ev);
+        client->events = events;
+    }
+}
+
+static void beefmote_wakeup_thread()
+{
+    uint64_t one = 1;
+
+    if (write(beefmote_wakeup, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        beefmote_debug_print("error: couldn't wake up Beefmote's thread\n");
+    }
+}
+
+static void beefmote_thread(void *data)
+{
+    // Unlike send, sendfile has no MSG_NOSIGNAL; writing to a client that went
+    // away must not kill Deadbeef. The signal just stays pending on this thread.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+    // Infinite loop. We only exit when Deadbeef calls the
+    // plugin_stop function on program exit.
+    for (;;) {
+        deadbeef->mutex_lock(beefmote_stopthread_mutex);
+        if (beefmote_stopthread == 1) {
+            deadbeef->mutex_unlock(beefmote_stopthread_mutex);
+
+            beefmote_jobs_drain();
+
+            while (beefmote_clients) {
+                beefmote_client_close(beefmote_clients);
+            }
+
+            beefmote_playlist_infos_free();
+
+            return;
+        }
+        deadbeef->mutex_unlock(beefmote_stopthread_mutex);
+
+        // Don't sleep if there are commands or streams waiting for us. Otherwise
+        // wait for something to happen, or for the next timer to be due; we
+        // check every BEEFMOTE_WAIT_CLIENT seconds whether we've been asked to stop.
+        int timeout = beefmote_timers_run(BEEFMOTE_WAIT_CLIENT * 1000);
+
+        for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+            if (beefmote_client_has_work(client)) {
+                timeout = 0;
+                break;
+            }
+        }
+
+        beefmote_wait(timeout);
+        beefmote_jobs_collect();
+
+        // Control commands go first, for all clients. Then every client gets
+        // one of its other commands run, and a slice of its stream sent.
+        for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+            beefmote_client_process_input(client);
+        }
+
+        for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+            beefmote_client_run_pending(client);
+
+            if (client->stream.playlist && !client->throttled) {
+                beefmote_client_stream(client);
+            }
+        }
+
+        // Send everything we can without blocking.
+        deadbeef->mutex_lock(beefmote_clients_mutex);
+        beefmote_clients_flush();
+        for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+            beefmote_client_update_events(client);
+
+            if (client->close_when_done && !client->out_head && !client->stream.playlist && !client->awaiting) {
+                client->closing = true;
+            }
+        }
+        deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+        beefmote_client *next;
+        for (beefmote_client *client = beefmote_clients; client; client = next) {
+            next = client->next;
+
+            if (client->closing) {
+                beefmote_client_close(client);
+            }
+        }
+
+        beefmote_snapshots_sweep();
+    }
+}
+
+static void beefmote_wait(int timeout)
+{
+#ifdef BEEFMOTE_IO_URING
+    if (beefmote_uring_enabled) {
+        beefmote_uring_wait(timeout);
+        return;
+    }
+#endif
+
+    struct epoll_event events[BEEFMOTE_MAX_EVENTS];
+    int events_n = epoll_wait(beefmote_epoll, events, BEEFMOTE_MAX_EVENTS, timeout);
+
+    if (events_n == -1) {
+        if (errno != EINTR) {
+            beefmote_debug_print("error: epoll_wait failed, errno = %d\n", errno);
+        }
+
+        events_n = 0;
+    }
+
+    for (int i = 0; i < events_n; i++) {
+        int fd = events[i].data.fd;
+
+        if (fd == beefmote_wakeup) {
+            uint64_t value;
+            if (read(beefmote_wakeup, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                beefmote_debug_print("error: couldn't read wakeup counter\n");
+            }
+            continue;
+        }
+
+        beefmote_listener *listener = beefmote_listener_get(fd);
+        if (listener) {
+            if (listener->type == SOCK_DGRAM) {
+                beefmote_udp_receive(listener);
+            }
+            else {
+                beefmote_client_accept(listener);
+            }
+            continue;
+        }
+
+        beefmote_client *client = beefmote_client_get(fd);
+        if (!client) {
+            continue;
+        }
+
+        if ((events[i].events & (EPOLLHUP | EPOLLERR)) ||
+            ((events[i].events & EPOLLIN) && !beefmote_client_read(client))) {
+            deadbeef->mutex_lock(beefmote_clients_mutex);
+            client->closing = true;
+            deadbeef->mutex_unlock(beefmote_clients_mutex);
+        }
+    }
+}
+
+static void beefmote_clients_flush()
+{
+#ifdef BEEFMOTE_IO_URING
+    if (beefmote_uring_enabled) {
+        beefmote_uring_flush();
+        return;
+    }
+#endif
+
+    // Deficit round robin: every round, each client with something to send
+    // gets BEEFMOTE_DRR_QUANTUM more bytes it may send, so a client with a lot
+    // of output doesn't hold up the others. Whatever is left after
+    // BEEFMOTE_FLUSH_ROUNDS_MAX rounds waits until we've read what clients sent.
+    bool more = true;
+
+    for (int round = 0; round < BEEFMOTE_FLUSH_ROUNDS_MAX && more; round++) {
+        more = false;
+
+        for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+            if (client->out_head && !client->closing) {
+                client->deficit += BEEFMOTE_DRR_QUANTUM;
+                more = beefmote_client_flush(client) || more;
+            }
+        }
+    }
+}
+
+#ifdef BEEFMOTE_IO_URING
+static bool beefmote_uring_init()
+{
+    beefmote_uring *u = &beefmote_ring;
+    memset(u, 0, sizeof(*u));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+
+    u->fd = syscall(__NR_io_uring_setup, BEEFMOTE_URING_ENTRIES, &params);
+    if (u->fd < 0) {
+        beefmote_debug_print("io_uring: couldn't set up, errno = %d\n", errno);
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        beefmote_debug_print("io_uring: the kernel is too old\n");
+        beefmote_uring_free();
+        return false;
+    }
+
+    // The submission and completion rings share a mapping.
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->rings == MAP_FAILED) {
+        u->rings = NULL;
+    }
+
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+    }
+
+    u->buf_ring_size = BEEFMOTE_URING_BUFFERS * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED) {
+        u->buf_ring = NULL;
+    }
+
+    u->buffers = malloc((size_t) BEEFMOTE_URING_BUFFERS * BEEFMOTE_URING_BUFFER_SIZE);
+
+    if (!u->rings || !u->sqes || !u->buf_ring || !u->buffers) {
+        beefmote_debug_print("io_uring: couldn't map the rings\n");
+        beefmote_uring_free();
+        return false;
+    }
+
+    char *rings = u->rings;
+    u->sq_head = (unsigned*) (rings + params.sq_off.head);
+    u->sq_tail = (unsigned*) (rings + params.sq_off.tail);
+    u->sq_mask = *(unsigned*) (rings + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->sq_array = (unsigned*) (rings + params.sq_off.array);
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned*) (rings + params.cq_off.head);
+    u->cq_tail = (unsigned*) (rings + params.cq_off.tail);
+    u->cq_mask = *(unsigned*) (rings + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) u->buf_ring;
+    reg.ring_entries = BEEFMOTE_URING_BUFFERS;
+    reg.bgid = BEEFMOTE_URING_BUFFER_GROUP;
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        beefmote_debug_print("io_uring: couldn't register buffers, errno = %d\n", errno);
+        beefmote_uring_free();
+        return false;
+    }
+
+    for (int bid = 0; bid < BEEFMOTE_URING_BUFFERS; bid++) {
+        beefmote_uring_recycle(bid);
+    }
+
+    // Multishot recv came last; see whether it's there by receiving a byte
+    // through a socket pair. What's left in flight completes as stale.
+    bool supported = false;
+    int pair[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) == 0) {
+        struct io_uring_sqe *sqe = beefmote_uring_sqe(BEEFMOTE_URING_PROBE, pair[0], 0);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BEEFMOTE_URING_BUFFER_GROUP;
+
+        struct io_uring_cqe cqe;
+
+        if (write(pair[1], "?", 1) == 1) {
+            beefmote_uring_enter(1, 1000);
+
+            if (beefmote_uring_reap(&cqe)) {
+                supported = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) && (cqe.flags & IORING_CQE_F_BUFFER);
+
+                if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    beefmote_uring_recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+            }
+        }
+
+        sqe = beefmote_uring_sqe(BEEFMOTE_URING_CANCEL, pair[0], 0);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        beefmote_uring_enter(0, 0);
+
+        close(pair[0]);
+        close(pair[1]);
+    }
+
+    if (!supported) {
+        beefmote_debug_print("io_uring: the kernel doesn't support multishot recv\n");
+        beefmote_uring_free();
+        return false;
+    }
+
+    // The wakeup eventfd is polled like UDP listeners.
+    beefmote_uring_listen(beefmote_wakeup, SOCK_DGRAM);
+
+    return true;
+}
+
+static void beefmote_uring_free()
+{
+    beefmote_uring *u = &beefmote_ring;
+
+    // Closing the ring cancels everything in flight.
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+
+    if (u->rings) {
+        munmap(u->rings, u->rings_size);
+    }
+
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+
+    if (u->buf_ring) {
+        munmap(u->buf_ring, u->buf_ring_size);
+    }
+
+    free(u->buffers);
+    free(u->deferred);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static struct io_uring_sqe *beefmote_uring_sqe(int op, int fd, uint32_t serial)
+{
+    beefmote_uring *u = &beefmote_ring;
+
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        beefmote_uring_enter(0, 0);
+    }
+
+    unsigned idx = u->sq_local_tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t) op << 56 | (uint64_t) (serial & 0xffffff) << 32 | (uint32_t) fd;
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+
+    return sqe;
+}
+
+static void beefmote_uring_enter(unsigned wait_n, int timeout)
+{
+    beefmote_uring *u = &beefmote_ring;
+
+    unsigned submit_n = u->sq_local_tail - *u->sq_tail;
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+    // Getting events also flushes completions that overflowed the queue.
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000LL };
+    struct io_uring_getevents_arg arg = { .ts = (uintptr_t) &ts };
+
+    if (wait_n > 0) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    if (syscall(__NR_io_uring_enter, u->fd, submit_n, wait_n, flags,
+                wait_n > 0 ? &arg : NULL, wait_n > 0 ? sizeof(arg) : 0) < 0 &&
+        errno != ETIME && errno != EINTR) {
+        beefmote_debug_print("error: io_uring_enter failed, errno = %d\n", errno);
+    }
+}
+
+static bool beefmote_uring_reap(struct io_uring_cqe *cqe)
+{
+    beefmote_uring *u = &beefmote_ring;
+
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    *cqe = u->cqes[head & u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static void beefmote_uring_handle(struct io_uring_cqe *cqe)
+{
+    assert(cqe);
+
+    int op = cqe->user_data >> 56;
+    uint32_t serial = (cqe->user_data >> 32) & 0xffffff;
+    int fd = (int) (uint32_t) cqe->user_data;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (op == BEEFMOTE_URING_ACCEPT || op == BEEFMOTE_URING_POLL) {
+        beefmote_listener *listener = beefmote_listener_get(fd);
+
+        if (op == BEEFMOTE_URING_ACCEPT && cqe->res >= 0) {
+            struct sockaddr_storage client_addr;
+            socklen_t client_size = sizeof(client_addr);
+
+            if (listener && !getpeername(cqe->res, (struct sockaddr*) &client_addr, &client_size)) {
+                beefmote_client_add(listener, cqe->res, (struct sockaddr*) &client_addr);
+            }
+            else {
+                close(cqe->res);
+            }
+        }
+        else if (op == BEEFMOTE_URING_ACCEPT) {
+            beefmote_debug_print("error: failed on accept(), errno = %d\n", -cqe->res);
+        }
+        else if (fd == beefmote_wakeup) {
+            uint64_t value;
+            if (read(beefmote_wakeup, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                beefmote_debug_print("error: couldn't read wakeup counter\n");
+            }
+        }
+        else if (listener) {
+            beefmote_udp_receive(listener);
+        }
+
+        // Multishot requests end on errors; start them over.
+        if (!more && (listener || fd == beefmote_wakeup)) {
+            beefmote_uring_listen(fd, listener ? listener->type : SOCK_DGRAM);
+        }
+
+        return;
+    }
+
+    beefmote_client *client = beefmote_client_get(fd);
+    bool stale = !client || client->serial != serial || op == BEEFMOTE_URING_PROBE;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (stale || cqe->res <= 0) {
+            beefmote_uring_recycle(bid);
+        }
+        else {
+            beefmote_ring.buf_len[bid] = cqe->res;
+
+            if (client->held_n == 0) {
+                client->held_first = bid;
+            }
+            else {
+                beefmote_ring.buf_next[client->held_last] = bid;
+            }
+
+            client->held_last = bid;
+            client->held_n++;
+        }
+    }
+
+    if (stale) {
+        return;
+    }
+
+    if (op == BEEFMOTE_URING_RECV && !more) {
+        client->recv_armed = false;
+        client->recv_paused = false;
+
+        // Running out of buffers, or being paused, just needs a new recv.
+        if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+            if (cqe->res == 0) {
+                beefmote_debug_print("client %s closed connection\n", client->name);
+            }
+            else {
+                beefmote_debug_print("error: failed on read(), errno = %d, closing client socket\n", -cqe->res);
+            }
+
+            deadbeef->mutex_lock(beefmote_clients_mutex);
+            client->closing = true;
+            deadbeef->mutex_unlock(beefmote_clients_mutex);
+        }
+    }
+    else if (op == BEEFMOTE_URING_RECV && client->held_n >= BEEFMOTE_URING_CLIENT_BUFFERS && !client->recv_paused) {
+        // Stop receiving from clients whose input we can't process yet, so
+        // they don't take everybody's buffers; TCP will slow them down.
+        struct io_uring_sqe *sqe = beefmote_uring_sqe(BEEFMOTE_URING_CANCEL, fd, serial);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = cqe->user_data;
+        client->recv_paused = true;
+    }
+    else if (op == BEEFMOTE_URING_POLLOUT) {
+        client->pollout_armed = false;
+    }
+}
+
+static void beefmote_uring_wait(int timeout)
+{
+    beefmote_uring *u = &beefmote_ring;
+
+    // Completions reaped while sending go first; don't sleep if there were any.
+    int deferred_n = u->deferred_n;
+    u->deferred_n = 0;
+
+    for (int i = 0; i < deferred_n; i++) {
+        beefmote_uring_handle(&u->deferred[i]);
+    }
+
+    bool ready = deferred_n > 0 || *u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    beefmote_uring_enter(ready || timeout == 0 ? 0 : 1, timeout);
+
+    struct io_uring_cqe cqe;
+    while (beefmote_uring_reap(&cqe)) {
+        beefmote_uring_handle(&cqe);
+    }
+
+    for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+        if (client->held_n > 0) {
+            beefmote_client_read(client);
+        }
+
+        if (!client->recv_armed && !client->closing && client->held_n == 0) {
+            beefmote_uring_recv(client);
+        }
+    }
+}
+
+static void beefmote_uring_flush()
+{
+    beefmote_uring *u = &beefmote_ring;
+
+    for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+        client->sending = true;
+    }
+
+    // Every round sends a batch to every client that took everything so far,
+    // of up to its deficit, like beefmote_clients_flush does.
+    for (int round = 0; round < BEEFMOTE_FLUSH_ROUNDS_MAX; round++) {
+        int sends_n = 0;
+        bool sending = false;
+
+        for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+            if (!client->out_head || client->closing) {
+                client->sending = false;
+            }
+
+            if (!client->sending) {
+                continue;
+            }
+
+            sending = true;
+            client->deficit += BEEFMOTE_DRR_QUANTUM;
+            beefmote_chunk *head = client->out_head;
+
+            // There's no sendfile in io_uring, and splicing would take a pipe
+            // per client. Snapshots go out in big pieces anyway.
+            if (head->snapshot) {
+                off_t offset = head->offset + head->sent;
+                int len = head->len - head->sent < client->deficit ? head->len - head->sent : client->deficit;
+                ssize_t bytes_n = sendfile(client->socket, head->snapshot->fd, &offset, len);
+                client->sending = beefmote_client_sent(client, bytes_n, errno);
+                continue;
+            }
+
+            client->send_msg.msg_iov = client->send_iov;
+            client->send_msg.msg_iovlen = beefmote_client_gather(client, client->send_iov, client->deficit);
+
+            struct io_uring_sqe *sqe = beefmote_uring_sqe(BEEFMOTE_URING_SEND, client->socket, client->serial);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uintptr_t) &client->send_msg;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+            sends_n++;
+        }
+
+        if (!sending) {
+            break;
+        }
+
+        // MSG_DONTWAIT sends complete right away, either way. Until they do,
+        // the queues they point into must stay as they are, so other
+        // completions are put aside.
+        if (sends_n > 0) {
+            beefmote_uring_enter(sends_n, 1000);
+        }
+
+        while (sends_n > 0) {
+            struct io_uring_cqe cqe;
+
+            if (!beefmote_uring_reap(&cqe)) {
+                beefmote_uring_enter(1, 1000);
+                continue;
+            }
+
+            if ((int) (cqe.user_data >> 56) != BEEFMOTE_URING_SEND) {
+                if (u->deferred_n == u->deferred_cap) {
+                    int cap = u->deferred_cap ? u->deferred_cap * 2 : BEEFMOTE_URING_ENTRIES;
+                    struct io_uring_cqe *deferred = realloc(u->deferred, cap * sizeof(struct io_uring_cqe));
+
+                    if (!deferred) {
+                        beefmote_debug_print("error: out of memory, dropping an io_uring completion\n");
+                        if (cqe.flags & IORING_CQE_F_BUFFER) {
+                            beefmote_uring_recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                        }
+                        continue;
+                    }
+
+                    u->deferred = deferred;
+                    u->deferred_cap = cap;
+                }
+
+                u->deferred[u->deferred_n++] = cqe;
+                continue;
+            }
+
+            sends_n--;
+
+            beefmote_client *client = beefmote_client_get((int) (uint32_t) cqe.user_data);
+            if (client && client->sending) {
+                client->sending = beefmote_client_sent(client, cqe.res < 0 ? -1 : cqe.res, -cqe.res);
+            }
+        }
+    }
+
+    for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+        beefmote_client_flushed(client);
+    }
+}
+
+static void beefmote_uring_listen(int socket, int type)
+{
+    struct io_uring_sqe *sqe;
+
+    if (type == SOCK_STREAM) {
+        sqe = beefmote_uring_sqe(BEEFMOTE_URING_ACCEPT, socket, 0);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    else {
+        sqe = beefmote_uring_sqe(BEEFMOTE_URING_POLL, socket, 0);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+    }
+}
+
+static void beefmote_uring_recv(beefmote_client *client)
+{
+    assert(client);
+
+    struct io_uring_sqe *sqe = beefmote_uring_sqe(BEEFMOTE_URING_RECV, client->socket, client->serial);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BEEFMOTE_URING_BUFFER_GROUP;
+    client->recv_armed = true;
+}
+
+static void beefmote_uring_recycle(int bid)
+{
+    beefmote_uring *u = &beefmote_ring;
+
+    assert(bid >= 0 && bid < BEEFMOTE_URING_BUFFERS);
+
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (BEEFMOTE_URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t) (u->buffers + (size_t) bid * BEEFMOTE_URING_BUFFER_SIZE);
+    buf->len = BEEFMOTE_URING_BUFFER_SIZE;
+    buf->bid = bid;
+
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+#endif
+
+static void beefmote_listen()
+{
+    beefmote_listen_tcp();
+    beefmote_listen_unix();
+    beefmote_listen_udp();
+
+    if (beefmote_listeners_n == 0) {
+        beefmote_debug_print("error: not listening anywhere\n");
+    }
+}
+
+static void beefmote_listen_tcp()
+{
+    // Try to get port from settings.
+    deadbeef->conf_lock();
+    const char *port_str = deadbeef->conf_get_str_fast("beefmote.port", "");
+    int port = BEEFMOTE_DEFAULT_PORT;
+
+    // Port found in config file.
+    if (strcmp(port_str, "")) {
+        beefmote_debug_print("Port found in config file: %s\n", port_str);
+
+        port = strtol(port_str, NULL, 10);
+
+        if (DEBUG) {
+            beefmote_debug_print("Converted port: %d\n", port);
+        }
+    }
+    else {
+        beefmote_debug_print("port not found in config file, defaulting to %d\n",
+                             BEEFMOTE_DEFAULT_PORT);
+    }
+
+    deadbeef->conf_unlock();
+
+    beefmote_listen_inet(SOCK_STREAM, port);
+}
+
+static void beefmote_listen_udp()
+{
+    char secret[BEEFMOTE_STR_MAXLENGTH];
+
+    int port = deadbeef->conf_get_int("beefmote.udp_port", 0);
+    deadbeef->conf_get_str("beefmote.udp_secret", "", secret, sizeof(secret));
+
+    if (port <= 0) {
+        return;
+    }
+
+    // Without a secret anybody on the network could control the player.
+    if (!strcmp(secret, "")) {
+        beefmote_debug_print("error: UDP port set but no UDP secret, not listening on UDP\n");
+        return;
+    }
+
+    beefmote_debug_print("UDP port found in config file: %d\n", port);
+
+    beefmote_udp_derive_key(secret, beefmote_udp_key);
+    memset(beefmote_udp_senders, 0, sizeof(beefmote_udp_senders));
+
+    beefmote_listen_inet(SOCK_DGRAM, port);
+}
+
+static void beefmote_listen_inet(int type, int port)
+{
+    bool ipv6 = deadbeef->conf_get_int("beefmote.ipv6", 0);
+
+    // Try to get IP from settings.
+    deadbeef->conf_lock();
+    const char *ip_str = deadbeef->conf_get_str_fast("beefmote.ip", "");
+    bool config_ip_found = false;
+    int family = AF_INET;
+    struct sockaddr_in servaddr;
+    struct sockaddr_in6 servaddr6;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    memset(&servaddr6, 0, sizeof(servaddr6));
+
+    // IP found in config file. It can be either an IPv4 or an IPv6 address.
+    if (strcmp(ip_str, "")) {
+        beefmote_debug_print("IP found in config file: %s\n", ip_str);
+
+        if (inet_pton(AF_INET, ip_str, &servaddr.sin_addr) == 1) {
+            config_ip_found = true;
+            family = AF_INET;
+        }
+        else if (inet_pton(AF_INET6, ip_str, &servaddr6.sin6_addr) == 1) {
+            config_ip_found = true;
+            family = AF_INET6;
+        }
+        else {
+            beefmote_debug_print("error: invalid IP in config file: %s\n", ip_str);
+        }
+
+        // Debug: Print converted IP (it should match ip_str)
+        if (DEBUG && config_ip_found) {
+            char str[INET6_ADDRSTRLEN];
+
+            if (family == AF_INET) {
+                inet_ntop(AF_INET, &servaddr.sin_addr, str, sizeof(str));
+            }
+            else {
+                inet_ntop(AF_INET6, &servaddr6.sin6_addr, str, sizeof(str));
+            }
+
+            beefmote_debug_print("Converted IP: %s\n", str);
+        }
+    }
+
+    deadbeef->conf_unlock();
+
+    // Without an IP in the config file we bind to all interfaces: with a
+    // dual-stack IPv6 socket if IPv6 is enabled, or with an IPv4 one otherwise.
+    if (!config_ip_found) {
+        beefmote_debug_print("IP not found in config file, defaulting to all interfaces\n");
+
+        family = ipv6 ? AF_INET6 : AF_INET;
+        servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        servaddr6.sin6_addr = in6addr_any;
+    }
+
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+    servaddr6.sin6_family = AF_INET6;
+    servaddr6.sin6_port = htons(port);
+
+    if (family == AF_INET6) {
+        if (beefmote_listener_add(AF_INET6, type, (struct sockaddr*) &servaddr6, sizeof(servaddr6), 0) != -1) {
+            return;
+        }
+
+        if (config_ip_found) {
+            return;
+        }
+
+        beefmote_debug_print("couldn't listen on IPv6, falling back to IPv4\n");
+    }
+
+    beefmote_listener_add(AF_INET, type, (struct sockaddr*) &servaddr, sizeof(servaddr), 0);
+}
+
+static void beefmote_listen_unix()
+{
+    char path[sizeof(((struct sockaddr_un*) NULL)->sun_path)];
+    char mode_str[BEEFMOTE_NAME_MAXLENGTH];
+
+    deadbeef->conf_get_str("beefmote.unix_socket", "", path, sizeof(path));
+    deadbeef->conf_get_str("beefmote.unix_socket_mode", "0600", mode_str, sizeof(mode_str));
+
+    if (!strcmp(path, "")) {
+        return;
+    }
+
+    mode_t mode = strtol(mode_str, NULL, 8) & 0777;
+
+    beefmote_debug_print("Unix socket found in config file: %s (mode %03o)\n", path, mode);
+
+    struct sockaddr_un servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sun_family = AF_UNIX;
+    strcpy(servaddr.sun_path, path);
+
+    // Remove the socket a previous run left behind, but nothing else.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int listener = beefmote_listener_add(AF_UNIX, SOCK_STREAM, (struct sockaddr*) &servaddr, sizeof(servaddr), mode);
+
+    if (listener != -1) {
+        strcpy(beefmote_listeners[beefmote_listeners_n - 1].path, path);
+    }
+}
+
+static int beefmote_listener_add(int family, int type, struct sockaddr *addr, socklen_t addr_len, mode_t mode)
+{
+    assert(addr);
+
+    if (beefmote_listeners_n == BEEFMOTE_LISTENERS_MAX) {
+        beefmote_debug_print("error: too many listeners\n");
+        return -1;
+    }
+
+    int listener = socket(family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (listener == -1) {
+        beefmote_debug_print("error: couldn't create socket\n");
+        return -1;
+    }
+
+    if (family != AF_UNIX) {
+        // Reuse address (useful if the user closes and opens the program quickly again).
+        int enabled = 1;
+        if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) == -1) {
+            beefmote_debug_print("error: couldn't set SO_REUSEADDR\n");
+        }
+    }
+
+    // Accept IPv4 connections on IPv6 sockets too, whatever the system default is.
+    if (family == AF_INET6) {
+        int disabled = 0;
+        if (setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &disabled, sizeof(disabled)) == -1) {
+            beefmote_debug_print("error: couldn't unset IPV6_V6ONLY\n");
+        }
+    }
+
+    // Bind socket.
+    if (bind(listener, addr, addr_len)) {
+        beefmote_debug_print("error: couldn't bind socket, errno = %d\n", errno);
+        close(listener);
+        return -1;
+    }
+
+    // Nobody can connect before listen(), so this leaves no window with the
+    // wrong permissions.
+    if (family == AF_UNIX && chmod(((struct sockaddr_un*) addr)->sun_path, mode)) {
+        beefmote_debug_print("error: couldn't set Unix socket permissions\n");
+    }
+
+    // Put socket to listen.
+    if (type == SOCK_STREAM && listen(listener, BEEFMOTE_MAX_CLIENTS)) {
+        beefmote_debug_print("error: couldn't put socket to listen\n");
+        close(listener);
+        return -1;
+    }
+
+#ifdef BEEFMOTE_IO_URING
+    if (beefmote_uring_enabled) {
+        beefmote_uring_listen(listener, type);
+    }
+    else
+#endif
+    {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = listener };
+        epoll_ctl(beefmote_epoll, EPOLL_CTL_ADD, listener, &ev);
+    }
+
+    beefmote_listener *l = &beefmote_listeners[beefmote_listeners_n++];
+    memset(l, 0, sizeof(*l));
+    l->socket = listener;
+    l->family = family;
+    l->type = type;
+
+    return listener;
+}
+
+static beefmote_listener *beefmote_listener_get(int socket)
+{
+    for (int i = 0; i < beefmote_listeners_n; i++) {
+        if (beefmote_listeners[i].socket == socket) {
+            return &beefmote_listeners[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void beefmote_listeners_close()
+{
+    for (int i = 0; i < beefmote_listeners_n; i++) {
+        // Requests in flight on io_uring may hold on to the socket past
+        // close; make sure it stops listening right away.
+        if (beefmote_listeners[i].type == SOCK_STREAM) {
+            shutdown(beefmote_listeners[i].socket, SHUT_RDWR);
+        }
+
+        close(beefmote_listeners[i].socket);
+
+        if (beefmote_listeners[i].family == AF_UNIX) {
+            unlink(beefmote_listeners[i].path);
+        }
+    }
+
+    beefmote_listeners_n = 0;
+}
+
+static void beefmote_udp_receive(beefmote_listener *listener)
+{
+    assert(listener);
+
+    uint8_t packet[BEEFMOTE_UDP_MAX_LENGTH + 1];
+
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        ssize_t len = recvfrom(listener->socket, packet, sizeof(packet), 0, (struct sockaddr*) &addr, &addr_len);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                beefmote_debug_print("error: failed on recvfrom(), errno = %d\n", errno);
+            }
+
+            return;
+        }
+
+        char name[BEEFMOTE_NAME_MAXLENGTH];
+        beefmote_format_address(name, sizeof(name), (struct sockaddr*) &addr, listener->socket);
+
+        if (len <= BEEFMOTE_UDP_HEADER_LENGTH + BEEFMOTE_UDP_TAG_LENGTH || len > BEEFMOTE_UDP_MAX_LENGTH ||
+            memcmp(packet, BEEFMOTE_UDP_MAGIC, 2) || packet[2] != BEEFMOTE_UDP_VERSION) {
+            beefmote_debug_print("dropping malformed datagram from %s\n", name);
+            continue;
+        }
+
+        // Check the tag without bailing out early, so its timing gives nothing away.
+        uint64_t tag = beefmote_siphash(beefmote_udp_key, packet, len - BEEFMOTE_UDP_TAG_LENGTH);
+        uint8_t diff = 0;
+
+        for (int i = 0; i < BEEFMOTE_UDP_TAG_LENGTH; i++) {
+            diff |= packet[len - BEEFMOTE_UDP_TAG_LENGTH + i] ^ (uint8_t) (tag >> (8 * i));
+        }
+
+        if (diff) {
+            beefmote_debug_print("dropping datagram with a bad tag from %s\n", name);
+            continue;
+        }
+
+        uint32_t sender = (uint32_t) packet[4] << 24 | (uint32_t) packet[5] << 16 | (uint32_t) packet[6] << 8 | packet[7];
+        uint32_t seq = (uint32_t) packet[8] << 24 | (uint32_t) packet[9] << 16 | (uint32_t) packet[10] << 8 | packet[11];
+
+        if (!beefmote_udp_check_sequence(sender, seq)) {
+            beefmote_debug_print("dropping duplicate or reordered datagram %u from %s\n", seq, name);
+            continue;
+        }
+
+        char command[BEEFMOTE_BUFSIZE];
+        int command_len = len - BEEFMOTE_UDP_HEADER_LENGTH - BEEFMOTE_UDP_TAG_LENGTH;
+
+        memset(command, 0, BEEFMOTE_BUFSIZE);
+        memcpy(command, packet + BEEFMOTE_UDP_HEADER_LENGTH, command_len);
+        command[command_len] = '\n';
+
+        // Only control commands make sense without a connection to reply on.
+        int comm_id = beefmote_command_lookup(command);
+
+        if (comm_id == -1 || comm_id == BEEFMOTE_ABORT ||
+            beefmote_commands[comm_id].priority != BEEFMOTE_PRIORITY_CONTROL) {
+            beefmote_debug_print("dropping datagram with a command not allowed over UDP from %s\n", name);
+            continue;
+        }
+
+        beefmote_debug_print("processing datagram %u from %s: %s", seq, name, command);
+
+        // There's no client on the UDP socket, so whatever the command prints goes nowhere.
+        beefmote_process_command(listener->socket, command);
+    }
+}
+
+static bool beefmote_udp_check_sequence(uint32_t sender, uint32_t seq)
+{
+    beefmote_udp_sender *oldest = &beefmote_udp_senders[0];
+
+    for (int i = 0; i < BEEFMOTE_UDP_SENDERS_MAX; i++) {
+        beefmote_udp_sender *s = &beefmote_udp_senders[i];
+
+        if (s->last_seen && s->id == sender) {
+            // Serial number arithmetic, so sequence numbers can wrap around.
+            if ((int32_t) (seq - s->seq) <= 0) {
+                return false;
+            }
+
+            s->seq = seq;
+            s->last_seen = ++beefmote_udp_clock;
+            return true;
+        }
+
+        if (s->last_seen < oldest->last_seen) {
+            oldest = s;
+        }
+    }
+
+    // New sender; it takes the place of the one we heard from the longest time ago.
+    oldest->id = sender;
+    oldest->seq = seq;
+    oldest->last_seen = ++beefmote_udp_clock;
+
+    return true;
+}
+
+static void beefmote_udp_derive_key(const char *secret, uint8_t key[16])
+{
+    assert(secret);
+
+    static const uint8_t domains[2][16] = { "BeefmoteUdpKey-0", "BeefmoteUdpKey-1" };
+
+    for (int half = 0; half < 2; half++) {
+        uint64_t hash = beefmote_siphash(domains[half], secret, strlen(secret));
+
+        for (int i = 0; i < 8; i++) {
+            key[8 * half + i] = (uint8_t) (hash >> (8 * i));
+        }
+    }
+}
+
+#define BEEFMOTE_ROTL64(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define BEEFMOTE_SIPROUND \
+    do { \
+        v0 += v1; v1 = BEEFMOTE_ROTL64(v1, 13); v1 ^= v0; v0 = BEEFMOTE_ROTL64(v0, 32); \
+        v2 += v3; v3 = BEEFMOTE_ROTL64(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = BEEFMOTE_ROTL64(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = BEEFMOTE_ROTL64(v1, 17); v1 ^= v2; v2 = BEEFMOTE_ROTL64(v2, 32); \
+    } while (0)
+
+static uint64_t beefmote_read_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+static uint64_t beefmote_siphash(const uint8_t key[16], const void *data, size_t len)
+{
+    const uint8_t *in = data;
+    uint64_t k0 = beefmote_read_le64(key);
+    uint64_t k1 = beefmote_read_le64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    const uint8_t *end = in + len - (len % 8);
+
+    for (; in != end; in += 8) {
+        uint64_t m = beefmote_read_le64(in);
+        v3 ^= m;
+        BEEFMOTE_SIPROUND;
+        BEEFMOTE_SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64_t b = (uint64_t) len << 56;
+
+    for (int i = len % 8 - 1; i >= 0; i--) {
+        b |= (uint64_t) in[i] << (8 * i);
+    }
+
+    v3 ^= b;
+    BEEFMOTE_SIPROUND;
+    BEEFMOTE_SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    BEEFMOTE_SIPROUND;
+    BEEFMOTE_SIPROUND;
+    BEEFMOTE_SIPROUND;
+    BEEFMOTE_SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void beefmote_load_settings()
+{
+    beefmote_queue_low = deadbeef->conf_get_int("beefmote.queue_low", BEEFMOTE_QUEUE_LOW_WATERMARK);
+    beefmote_queue_high = deadbeef->conf_get_int("beefmote.queue_high", BEEFMOTE_QUEUE_HIGH_WATERMARK);
+    beefmote_queue_limit = deadbeef->conf_get_int("beefmote.queue_limit", BEEFMOTE_QUEUE_LIMIT);
+    beefmote_overflow_policy = deadbeef->conf_get_int("beefmote.overflow_policy", BEEFMOTE_OVERFLOW_COALESCE);
+
+    // Keep the settings sane, whatever the user wrote. The limit must leave
+    // room for at least a whole line over the high watermark.
+    if (beefmote_queue_low <= 0) {
+        beefmote_queue_low = BEEFMOTE_QUEUE_LOW_WATERMARK;
+    }
+
+    if (beefmote_queue_high < beefmote_queue_low) {
+        beefmote_queue_high = beefmote_queue_low;
+    }
+
+    if (beefmote_queue_limit < beefmote_queue_high + BEEFMOTE_STR_MAXLENGTH) {
+        beefmote_queue_limit = beefmote_queue_high + BEEFMOTE_STR_MAXLENGTH;
+    }
+
+    if (beefmote_overflow_policy < BEEFMOTE_OVERFLOW_DROP || beefmote_overflow_policy > BEEFMOTE_OVERFLOW_DISCONNECT) {
+        beefmote_overflow_policy = BEEFMOTE_OVERFLOW_COALESCE;
+    }
+
+    beefmote_debug_print("outbound queue: low watermark %d, high watermark %d, limit %d, policy %d\n",
+                         beefmote_queue_low, beefmote_queue_high, beefmote_queue_limit, beefmote_overflow_policy);
+
+    beefmote_idle_timeout = deadbeef->conf_get_int("beefmote.idle_timeout", 0);
+    beefmote_ping_interval = deadbeef->conf_get_int("beefmote.ping_interval", 0);
+    beefmote_keepalive = deadbeef->conf_get_int("beefmote.keepalive", BEEFMOTE_KEEPALIVE_IDLE);
+
+    if (beefmote_idle_timeout < 0) {
+        beefmote_idle_timeout = 0;
+    }
+
+    if (beefmote_ping_interval < 0) {
+        beefmote_ping_interval = 0;
+    }
+
+    if (beefmote_keepalive < 0) {
+        beefmote_keepalive = 0;
+    }
+
+    beefmote_debug_print("connections: idle timeout %ds, ping interval %ds, keepalive %ds\n",
+                         beefmote_idle_timeout, beefmote_ping_interval, beefmote_keepalive);
+
+    beefmote_upcoming_n = deadbeef->conf_get_int("beefmote.upcoming", BEEFMOTE_UPCOMING_DEFAULT);
+
+    if (beefmote_upcoming_n < 0) {
+        beefmote_upcoming_n = 0;
+    }
+
+    if (beefmote_upcoming_n > BEEFMOTE_UPCOMING_MAX) {
+        beefmote_upcoming_n = BEEFMOTE_UPCOMING_MAX;
+    }
+
+    beefmote_rates[BEEFMOTE_BUCKET_CONTROL] = deadbeef->conf_get_int("beefmote.rate_control", BEEFMOTE_RATE_CONTROL);
+    beefmote_rates[BEEFMOTE_BUCKET_BULK] = deadbeef->conf_get_int("beefmote.rate_bulk", BEEFMOTE_RATE_BULK);
+
+    beefmote_debug_print("rate limits: %d commands/s, %d bulk commands/s\n",
+                         beefmote_rates[BEEFMOTE_BUCKET_CONTROL], beefmote_rates[BEEFMOTE_BUCKET_BULK]);
+}
+
+static void beefmote_timer_set(beefmote_timer *timer, uint64_t ms, void (*fire)(beefmote_timer *timer))
+{
+    assert(timer);
+    assert(fire);
+
+    beefmote_timer_cancel(timer);
+
+    // The wheel only moves on when we go through it, so count from the clock.
+    // Round up, so timers never fire early.
+    timer->expires = (beefmote_now_ms() + ms + BEEFMOTE_TIMER_TICK_MS - 1) / BEEFMOTE_TIMER_TICK_MS;
+    timer->fire = fire;
+    timer->armed = true;
+    beefmote_timer_link(timer, false);
+}
+
+static void beefmote_timer_cancel(beefmote_timer *timer)
+{
+    assert(timer);
+
+    if (!timer->armed) {
+        return;
+    }
+
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    }
+    else {
+        beefmote_wheel[timer->level][timer->slot] = timer->next;
+        if (!timer->next) {
+            beefmote_wheel_occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+        }
+    }
+
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->armed = false;
+}
+
+static void beefmote_timer_link(beefmote_timer *timer, bool cascading)
+{
+    assert(timer);
+
+    uint64_t earliest = beefmote_wheel_tick + (cascading ? 0 : 1);
+    if (timer->expires < earliest) {
+        timer->expires = earliest;
+    }
+
+    // Timers further away than the wheel reaches wait in the last level, and
+    // get another turn there when they come up.
+    uint64_t reach = (uint64_t) 1 << (BEEFMOTE_TIMER_SLOT_BITS * BEEFMOTE_TIMER_LEVELS);
+    uint64_t expires = timer->expires;
+    if (expires - beefmote_wheel_tick >= reach) {
+        expires = beefmote_wheel_tick + reach - 1;
+    }
+
+    // A timer goes in the lowest level whose turn doesn't go past it.
+    int level = 0;
+    while (level < BEEFMOTE_TIMER_LEVELS - 1 &&
+           (expires >> (BEEFMOTE_TIMER_SLOT_BITS * (level + 1))) !=
+           (beefmote_wheel_tick >> (BEEFMOTE_TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    int slot = (expires >> (BEEFMOTE_TIMER_SLOT_BITS * level)) & (BEEFMOTE_TIMER_SLOTS - 1);
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = beefmote_wheel[level][slot];
+    if (timer->next) {
+        timer->next->prev = timer;
+    }
+    beefmote_wheel[level][slot] = timer;
+    beefmote_wheel_occupied[level] |= (uint64_t) 1 << slot;
+}
+
+static int beefmote_timers_run(int limit)
+{
+    uint64_t now = beefmote_now_ms();
+    uint64_t now_tick = now / BEEFMOTE_TIMER_TICK_MS;
+    bool fired = false;
+
+    while (beefmote_wheel_tick < now_tick) {
+        beefmote_wheel_tick++;
+
+        // When a level completes a turn, the timers of the next slot of the
+        // level above come down to where they belong now.
+        for (int level = 1; level < BEEFMOTE_TIMER_LEVELS; level++) {
+            int shift = BEEFMOTE_TIMER_SLOT_BITS * level;
+            if (beefmote_wheel_tick & (((uint64_t) 1 << shift) - 1)) {
+                break;
+            }
+
+            int slot = (beefmote_wheel_tick >> shift) & (BEEFMOTE_TIMER_SLOTS - 1);
+            beefmote_timer *timer = beefmote_wheel[level][slot];
+            beefmote_wheel[level][slot] = NULL;
+            beefmote_wheel_occupied[level] &= ~((uint64_t) 1 << slot);
+
+            while (timer) {
+                beefmote_timer *next = timer->next;
+                beefmote_timer_link(timer, true);
+                timer = next;
+            }
+        }
+
+        // Everything in the current slot of level 0 is due. Timers rearmed
+        // by their callback go in a later slot, so this comes to an end.
+        int slot = beefmote_wheel_tick & (BEEFMOTE_TIMER_SLOTS - 1);
+        beefmote_timer *timer;
+
+        while ((timer = beefmote_wheel[0][slot])) {
+            if (timer->expires > beefmote_wheel_tick) {
+                // Too far away for the wheel when it was armed; another turn.
+                beefmote_timer_cancel(timer);
+                timer->armed = true;
+                beefmote_timer_link(timer, false);
+                continue;
+            }
+
+            beefmote_timer_cancel(timer);
+            timer->fire(timer);
+            fired = true;
+        }
+    }
+
+    if (fired) {
+        return 0;
+    }
+
+    // Sleep until the next occupied slot of level 0 comes up, or until level
+    // 0 completes its turn, whichever comes first.
+    int current = beefmote_wheel_tick & (BEEFMOTE_TIMER_SLOTS - 1);
+    uint64_t ticks = BEEFMOTE_TIMER_SLOTS - current;
+    uint64_t occupied = beefmote_wheel_occupied[0] >> current;
+
+    if (occupied) {
+        ticks = __builtin_ctzll(occupied);
+    }
+
+    uint64_t wake = (beefmote_wheel_tick + ticks) * BEEFMOTE_TIMER_TICK_MS;
+    if (wake <= now) {
+        return 0;
+    }
+
+    return wake - now < (uint64_t) limit ? (int) (wake - now) : limit;
+}
+
+static void beefmote_command_new(int comm_id, const char *comm_name, const char *comm_help,
+                                 void (*execute)(int client_socket, void* data))
+{
+    assert(comm_id >= 0 && comm_id < BEEFMOTE_COMMANDS_N);
+    assert(comm_name);
+    assert(comm_help);
+
+    strcpy(beefmote_commands[comm_id].name, comm_name);
+    beefmote_commands[comm_id].name_len = strlen(comm_name);
+    strcpy(beefmote_commands[comm_id].help, comm_help);
+    beefmote_commands[comm_id].priority = BEEFMOTE_PRIORITY_NORMAL;
+    beefmote_commands[comm_id].execute = execute;
+}
+
+static void beefmote_initialize_commands()
+{
+    beefmote_command_new(BEEFMOTE_HELP, "h", "prints this message.", beefmote_command_help);
+
+    beefmote_command_new(BEEFMOTE_PLAYLISTS, "pl",
+                         "usage: pl [idx]. If passed with no arguments, prints all playlists (" \
+                         "the current playlist is marked with (*)). " \
+                         "If passed with an index number, sets the current playlist to the " \
+                         "playlist with index idx.",
+		    	 beefmote_command_playlists);
+
+    beefmote_command_new(BEEFMOTE_TRACKLIST, "tl", "prints all the tracks in the current playlist.",
+                         beefmote_command_tracklist);
+
+    beefmote_command_new(BEEFMOTE_TRACKLIST_ADDRESS, "tla",
+                         "like tl, but prepends each track by its memory address.",
+                         beefmote_command_tracklist_address);
+
+    beefmote_command_new(BEEFMOTE_TRACKCURR, "tc", "prints the current track.", beefmote_command_trackcurr);
+
+    beefmote_command_new(BEEFMOTE_PLAY, "pp", "plays current track.", beefmote_command_play);
+
+    beefmote_command_new(BEEFMOTE_PLAY_SEARCH, "ps", "usage: ps idx. " \
+                         "Plays a track by its index in the search list.",
+                         beefmote_command_play_search);
+
+    beefmote_command_new(BEEFMOTE_PLAY_ADDRESS, "pa", "usage: pa memaddr. " \
+                         "Plays a track by memory address; memaddr must be written in " \
+                         "hex notation.", beefmote_command_play_address);
+
+    beefmote_command_new(BEEFMOTE_PLAY_URI, "pu", "usage: pu path[<tab>path...]. Plays the first of the tracks " \
+                         "with these file paths found, looking in the current playlist first and then in the " \
+                         "others. Prints \"[BEEFMOTE_PLAY_URI] Not found: path\" for every path tried and not " \
+                         "found.", beefmote_command_play_uri);
+
+    beefmote_command_new(BEEFMOTE_PLAY_RESUME, "p",
+                         "Usage: p [idx]. If passed with no arguments, pauses/resumes playback. " \
+                         "If passed with an index, plays the track at index idx in the current " \
+                         "playlist.", beefmote_command_play_resume);
+
+    beefmote_command_new(BEEFMOTE_RANDOM, "r", "plays random track.", beefmote_command_random);
+
+    beefmote_command_new(BEEFMOTE_STOP_AFTER_CURRENT, "sac", "stops playback after current track.",
+                         beefmote_command_stop_after_current);
+
+    beefmote_command_new(BEEFMOTE_STOP, "s", "stops playback.", beefmote_command_stop);
+
+    beefmote_command_new(BEEFMOTE_PREVIOUS, "pv", "plays previous track.", beefmote_command_previous);
+
+    beefmote_command_new(BEEFMOTE_NEXT, "nt", "plays next track.", beefmote_command_next);
+
+    beefmote_command_new(BEEFMOTE_VOLUME_UP, "vu", "usage: vu [step]. If no argument is passed, " \
+                         "increases volume by a default step of 5. If a number is passed, increases volume " \
+                         "by that amount. Prints the resulting volume as \"[BEEFMOTE_VOLUME] dB\".",
+                         beefmote_command_volume_up);
+
+    beefmote_command_new(BEEFMOTE_VOLUME_DOWN, "vd", "usage: vd [step]. If no argument is passed, " \
+                         "decreases volume by a default step of 5. If a number is passed, decreases volume " \
+                         "by that amount. Prints the resulting volume as \"[BEEFMOTE_VOLUME] dB\".",
+                         beefmote_command_volume_down);
+
+    beefmote_command_new(BEEFMOTE_SEEK_FORWARD, "sf", "seeks forward 5% of the track. Prints the resulting " \
+                         "position as \"[BEEFMOTE_POSITION] seconds\".", beefmote_command_seek_forward);
+
+    beefmote_command_new(BEEFMOTE_SEEK_BACKWARD, "sb", "seeks backward 5% of the track. Prints the resulting " \
+                         "position as \"[BEEFMOTE_POSITION] seconds\".", beefmote_command_seek_backward);
+
+    beefmote_command_new(BEEFMOTE_VOLUME_SET, "vs", "usage: vs dB. Sets the volume, in dB from the minimum to " \
+                         "0. Prints the resulting volume as \"[BEEFMOTE_VOLUME] dB\".", beefmote_command_volume_set);
+
+    beefmote_command_new(BEEFMOTE_SEEK_TO, "st", "usage: st seconds. Seeks to that many seconds into the " \
+                         "playing track. Prints the resulting position as \"[BEEFMOTE_POSITION] seconds\", or " \
+                         "\"[BEEFMOTE_POSITION] Not seekable\".", beefmote_command_seek_to);
+
+    beefmote_command_new(BEEFMOTE_SEARCH, "/", "usage: / str. Searches a string in the current " \
+            "playlist and returns a list of matching tracks. The matched tracks can be played by using their index " \
+            "number with the ps command.", beefmote_command_search);
+
+    beefmote_command_new(BEEFMOTE_SEARCH_ALL, "//", "usage: // str. Searches a string in all playlists at once, " \
+                         "and returns a list of matching tracks like / does, with the index of the playlist " \
+                         "each of them is in: \"(idx)<tab>playlist<tab>track\". ps plays them in their own " \
+                         "playlist, switching to it.", beefmote_command_search_all);
+
+    beefmote_command_new(BEEFMOTE_NOTIFY_PLAYLIST_CHANGED, "ntfy-plchanged",
+                         "usage: ntfy-plchanged true/false. Sets whether to notify when the current playlist changes. " \
+                         "Default: false.", beefmote_command_notify_playlist_changed);
+
+    beefmote_command_new(BEEFMOTE_NOTIFY_PLAYLIST_SWITCHED, "ntfy-plswitched",
+                         "usage: ntfy-plswitched true/false. Sets whether to notify when the playlist switches. " \
+                         "Default: false.", beefmote_command_notify_playlist_switched);
+
+    beefmote_command_new(BEEFMOTE_NOTIFY_NOW_PLAYING, "ntfy-nowplaying",
+                         "usage: ntfy-nowplaying true/false. Sets whether to notify when a new track " \
+                         "starts to play. Default: false.",
+                         beefmote_command_notify_now_playing);
+
+    beefmote_command_new(BEEFMOTE_NOTIFY_QUEUE, "ntfy-queue",
+                         "usage: ntfy-queue true/false. Sets whether to notify when the playback queue changes, " \
+                         "as \"[BEEFMOTE_QUEUE_ADDED] (pos) track\", \"[BEEFMOTE_QUEUE_REMOVED] pos\", " \
+                         "\"[BEEFMOTE_QUEUE_MOVED] from to\" and [BEEFMOTE_QUEUE_CLEARED], to be applied in order " \
+                         "to the queue as printed by ql. [BEEFMOTE_QUEUE_RESYNC] means some were lost, and the " \
+                         "queue must be printed again. Default: false.", beefmote_command_notify_queue);
+
+    beefmote_command_new(BEEFMOTE_NOTIFY_UPCOMING, "ntfy-upcoming",
+                         "usage: ntfy-upcoming true/false. Sets whether to send, when a new track starts to " \
+                         "play, \"[BEEFMOTE_UPCOMING_BEGIN] n queue|playlist\", the track as a " \
+                         "[BEEFMOTE_NOW_PLAYING] line, the n tracks that play next as \"[BEEFMOTE_UPCOMING_TRACK] " \
+                         "(idx) track\" lines and [BEEFMOTE_UPCOMING_END]. The tracks are taken from the playback " \
+                         "queue, or if it's empty, in playlist order. n is set in the plugin settings. " \
+                         "Default: false.", beefmote_command_notify_upcoming);
+
+    beefmote_command_new(BEEFMOTE_NOTIFY_TAGGED, "ntfy-tagged",
+                         "usage: ntfy-tagged true/false. Sets whether notifications (and pings) are framed as " \
+                         "\"@* line\". Use it along with tagged requests, \"@tag command\" (tags are up to 16 " \
+                         "letters, digits, '-', '_' or '.'), whose every reply line is prefixed with \"@tag \" and " \
+                         "whose reply ends with \"@tag [BEEFMOTE_DONE]\", or \"@tag [BEEFMOTE_CANCELLED]\" if " \
+                         "it was aborted before it ran. Tagged requests may be answered out of order: they don't " \
+                         "wait for tracklists and searches being sent. Default: false.",
+                         beefmote_command_notify_tagged);
+
+    beefmote_command_new(BEEFMOTE_ADD_PLAYBACKQUEUE_ADDRESS, "apa", "usage: apa memaddr. Adds a track by " \
+                         "memory address to the playback queue.", beefmote_command_add_playbackqueue_address);
+
+    beefmote_command_new(BEEFMOTE_ADD_PLAYBACKQUEUE, "ap", "usage: ap idx. Adds a track to the " \
+                         "playback queue.", beefmote_command_add_playbackqueue);
+
+    beefmote_command_new(BEEFMOTE_ADD_SEARCH_PLAYBACKQUEUE, "aps", "usage: aps idx. Adds a searched track to the " \
+                         "playback queue.", beefmote_command_add_search_playbackqueue);
+
+    beefmote_command_new(BEEFMOTE_ADD_PLAYBACKQUEUE_URI, "apu", "usage: apu path[<tab>path...]. Adds the tracks " \
+                         "with these file paths to the playback queue, in order, looking in the current playlist " \
+                         "first and then in the others. Prints \"[BEEFMOTE_ADD_PLAYBACKQUEUE_URI] Not found: " \
+                         "path\" for every path not found, then \"[BEEFMOTE_ADD_PLAYBACKQUEUE_URI] Added n of m\".",
+                         beefmote_command_add_playbackqueue_uri);
+
+    beefmote_command_new(BEEFMOTE_IMPORT, "import", "usage: import path[<tab>path...]. Adds files and folders " \
+                         "(with everything in them) to the current playlist in the background. Prints " \
+                         "\"[BEEFMOTE_IMPORT_BEGIN] n\" for n paths, then \"[BEEFMOTE_IMPORT_PROGRESS] scanned " \
+                         "added errors\" up to 4 times a second while it goes on, then \"[BEEFMOTE_IMPORT_END] " \
+                         "scanned added errors completed|cancelled\": files tried, tracks added, and files that " \
+                         "couldn't be added plus folders that couldn't be read. In folders, only the tracks " \
+                         "DeaDBeeF reports are counted as scanned, not every file on disk. Only one import " \
+                         "runs at a time.",
+                         beefmote_command_import);
+
+    beefmote_command_new(BEEFMOTE_IMPORT_CANCEL, "import-cancel", "cancels the import going on, keeping the " \
+                         "tracks it already added.", beefmote_command_import_cancel);
+
+    beefmote_command_new(BEEFMOTE_ABORT, "abort", "aborts the tracklist or search results being sent, " \
+                         "along with any queued tl, tla and / commands.", beefmote_command_abort);
+
+    beefmote_command_new(BEEFMOTE_SYNC, "sync", "usage: sync [root]. Prints the sync hashes root of the current " \
+                         "playlist as \"[BEEFMOTE_SYNC_ROOT] root levels chunks tracks\", or " \
+                         "[BEEFMOTE_SYNC_UNCHANGED] if it's the same as root. Tracks are hashed in chunks of 64, " \
+                         "and chunk hashes (level 0) in nodes of 16 up to the root (level levels - 1).",
+                         beefmote_command_sync);
+
+    beefmote_command_new(BEEFMOTE_SYNC_NODES, "syncn", "usage: syncn level node. Prints the hashes of the " \
+                         "children of a node of the current playlist's sync hashes as " \
+                         "\"[BEEFMOTE_SYNC_NODES] level first hash...\".", beefmote_command_sync_nodes);
+
+    beefmote_command_new(BEEFMOTE_SYNC_CHUNKS, "syncc", "usage: syncc chunk... Prints up to 16 chunks of the " \
+                         "current playlist, each as \"[BEEFMOTE_SYNC_CHUNK] chunk first n hash\" followed by its " \
+                         "tracks like tla does, and then \"[BEEFMOTE_SYNC_END] root\".",
+                         beefmote_command_sync_chunks);
+
+    beefmote_command_new(BEEFMOTE_SESSION, "session", "prints the token of this connection's session as " \
+                         "\"[BEEFMOTE_SESSION] token\". The session keeps the notification settings, and " \
+                         "can be picked up again with resume for 10 minutes after the connection is lost.",
+                         beefmote_command_session);
+
+    beefmote_command_new(BEEFMOTE_RESUME, "resume", "usage: resume token. Picks up a session. Prints its " \
+                         "settings as \"[BEEFMOTE_RESUMED] token setting=value...\", then the notifications " \
+                         "missed while away, then \"[BEEFMOTE_RESUME_END] n complete|partial\"; partial means " \
+                         "some were too old to replay. Prints [BEEFMOTE_RESUME_FAILED] for unknown or expired " \
+                         "tokens. Sent as the first line of a connection, it skips the welcome message.",
+                         beefmote_command_resume);
+
+    beefmote_command_new(BEEFMOTE_ARTISTS, "ar", "usage: ar [first]. Prints up to 100 of the current playlist's " \
+                         "artists, sorted by name and starting with the first-th, as " \
+                         "\"[BEEFMOTE_ARTISTS_BEGIN] total first n\", then \"[BEEFMOTE_ARTIST] id albums tracks " \
+                         "name\" for each of them, then [BEEFMOTE_ARTISTS_END].", beefmote_command_artists);
+
+    beefmote_command_new(BEEFMOTE_ALBUMS, "al", "usage: al artist. Prints the albums of an artist (by id, see ar) " \
+                         "as \"[BEEFMOTE_ALBUMS_BEGIN] artist n\", then \"[BEEFMOTE_ALBUM] id tracks duration " \
+                         "name\" for each of them, then [BEEFMOTE_ALBUMS_END].", beefmote_command_albums);
+
+    beefmote_command_new(BEEFMOTE_ALBUM_TRACKS, "at", "usage: at album. Prints the tracks of an album (by id, see " \
+                         "al) as \"[BEEFMOTE_ALBUM_TRACKS_BEGIN] album n\", then each of them like tla does, " \
+                         "then [BEEFMOTE_ALBUM_TRACKS_END].", beefmote_command_album_tracks);
+
+    beefmote_command_new(BEEFMOTE_QUEUE_LIST, "ql", "prints the playback queue as \"[BEEFMOTE_QUEUE_BEGIN] n\", " \
+                         "then \"[BEEFMOTE_QUEUE_TRACK] (pos) track\" for each track (with its memory address), " \
+                         "then [BEEFMOTE_QUEUE_END].", beefmote_command_queue_list);
+
+    beefmote_command_new(BEEFMOTE_QUEUE_REMOVE, "qr", "usage: qr pos|memaddr. Removes a track from the playback " \
+                         "queue, by position or by memory address (in hex notation, e.g. 0x7f0a2c001234).",
+                         beefmote_command_queue_remove);
+
+    beefmote_command_new(BEEFMOTE_QUEUE_MOVE, "qm", "usage: qm from to. Moves the track at position from of the " \
+                         "playback queue to position to.", beefmote_command_queue_move);
+
+    beefmote_command_new(BEEFMOTE_QUEUE_CLEAR, "qc", "clears the playback queue.", beefmote_command_queue_clear);
+
+    beefmote_command_new(BEEFMOTE_PONG, "pong", "answers a [BEEFMOTE_PING]. Does nothing else; anything a client " \
+                         "sends keeps its connection alive.", beefmote_command_pong);
+
+    beefmote_command_new(BEEFMOTE_EXIT, "exit", "terminates Deadbeef.", beefmote_command_exit);
+
+    // Transport control must never wait behind anything.
+    const int control_commands[] = {
+        BEEFMOTE_PLAY, BEEFMOTE_PLAY_RESUME, BEEFMOTE_RANDOM, BEEFMOTE_STOP, BEEFMOTE_STOP_AFTER_CURRENT,
+        BEEFMOTE_PREVIOUS, BEEFMOTE_NEXT, BEEFMOTE_VOLUME_UP, BEEFMOTE_VOLUME_DOWN, BEEFMOTE_SEEK_FORWARD,
+        BEEFMOTE_SEEK_BACKWARD, BEEFMOTE_VOLUME_SET, BEEFMOTE_SEEK_TO, BEEFMOTE_IMPORT_CANCEL, BEEFMOTE_ABORT,
+        BEEFMOTE_PONG,
+    };
+
+    for (int i = 0; i < (int) (sizeof(control_commands) / sizeof(control_commands[0])); i++) {
+        beefmote_commands[control_commands[i]].priority = BEEFMOTE_PRIORITY_CONTROL;
+    }
+
+    const int bulk_commands[] = {
+        BEEFMOTE_TRACKLIST, BEEFMOTE_TRACKLIST_ADDRESS, BEEFMOTE_SEARCH, BEEFMOTE_SEARCH_ALL, BEEFMOTE_SYNC,
+        BEEFMOTE_SYNC_NODES, BEEFMOTE_SYNC_CHUNKS,
+    };
+
+    for (int i = 0; i < (int) (sizeof(bulk_commands) / sizeof(bulk_commands[0])); i++) {
+        beefmote_commands[bulk_commands[i]].priority = BEEFMOTE_PRIORITY_BULK;
+    }
+}
+
+static void beefmote_process_command(int client_socket, char *command)
+{
+    assert(client_socket > 0);
+    assert(command);
+    assert(beefmote_commands);
+
+    char* ptr = command;
+    char* arg = NULL;
+
+    // Remove trailing whitespace from command and detect argument.
+    while (*ptr++) {
+        if (!arg && *(ptr + 1) != 0 && isspace(*ptr) && !isspace(*(ptr + 1))) {
+            arg = ptr + 1;
+            *ptr = 0;
+            break;
+        }
+        else if (isspace(*ptr)) {
+            *ptr = 0;
+            break;
+        }
+    }
+
+    if (arg) {
+        // Remove trailing \r\n from argument.
+        char* arg_ptr = arg;
+
+        while (*arg_ptr++) {
+            if (*arg_ptr == '\r' || *arg_ptr == '\n') {
+                *arg_ptr = 0;
+            }
+        }
+    }
+
+    // At this point, we are guaranteed that:
+    // 1) "command" is a string which contains no whitespace (and thus
+    // can potentially match a Beefmote's command name).
+    // 2) arg is whatever comes after "command", minus trailing \r\n. This
+    // *includes* whatever whitespace was there, so beefmote_command_* functions
+    // must do any necessary cleanup themselves.
+
+    int comm_id = beefmote_command_lookup(command);
+
+    if (comm_id != -1) {
+        beefmote_commands[comm_id].execute(client_socket, arg);
+        return;
+    }
+
+    client_print_string(client_socket, "\nPlease type a valid command\n\n");
+}
+
+static int beefmote_command_lookup(const char *line)
+{
+    assert(line);
+
+    int comm_len = 0;
+
+    while (line[comm_len] && !isspace(line[comm_len])) {
+        comm_len++;
+    }
+
+    for (int i = 0; i < BEEFMOTE_COMMANDS_N; i++) {
+        if (comm_len != beefmote_commands[i].name_len) {
+            continue;
+        }
+
+        if (strncmp(beefmote_commands[i].name, line, beefmote_commands[i].name_len) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int beefmote_message(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2)
+{
+    assert(deadbeef);
+
+    switch (id) {
+    case DB_EV_SONGCHANGED:
+        beefmote_currtrack = ((ddb_event_trackchange_t*) ctx)->to;
+
+        // Events are recorded for resuming clients even if nobody is subscribed to them right now.
+        if (beefmote_currtrack) {
+            int idx = deadbeef->pl_get_idx_of(beefmote_currtrack);
+
+            char str[BEEFMOTE_STR_MAXLENGTH];
+            int len = sprintf(str, "[BEEFMOTE_NOW_PLAYING] (%d) ", idx);
+            len += beefmote_format_track(str + len, sizeof(str) - len - 1, beefmote_currtrack, true);
+            strcpy(str + len, "\n");
+
+            beefmote_notify_clients(BEEFMOTE_NOTIFICATION_NOW_PLAYING, str);
+
+            // The upcoming tracks are worked out once, whoever wants them.
+            char *upcoming = beefmote_format_upcoming(beefmote_currtrack);
+
+            if (upcoming) {
+                beefmote_notify_clients(BEEFMOTE_NOTIFICATION_UPCOMING, upcoming);
+                free(upcoming);
+            }
+        }
+
+        // Playing a queued track takes it off the queue.
+        beefmote_queue_sync();
+        beefmote_status_update();
+        break;
+
+    case DB_EV_SONGSTARTED:
+    case DB_EV_SONGFINISHED:
+    case DB_EV_PAUSED:
+    case DB_EV_SEEKED:
+    case DB_EV_VOLUMECHANGED:
+        beefmote_status_update();
+        break;
+
+    /* Deadbeef is basically useless if you want to get a by-track
+     * changelog, meaning you CAN'T get a list of, e.g. added or
+     * deleted tracks to/from a playlist. Such is life. When a song
+     * is deleted, the case is DB_EV_PLAYLISTCHANGED, and p1 is
+     * DDB_PLAYLIST_CHANGE_CONTENT. That's all the info you get,
+     * meaning a client will have to get the ENTIRE tracklist
+     * AGAIN for just the one deleted track if it wants to keep in
+     * sync with the Deadbeef playlist. *sigh* */
+    case DB_EV_PLAYLISTCHANGED:
+        if (p1 == DDB_PLAYLIST_CHANGE_CONTENT) {
+            __atomic_add_fetch(&beefmote_playlist_generation, 1, __ATOMIC_RELEASE);
+
+            // An import notifies clients once it's finished (see beefmote_import_thread).
+            if (!__atomic_load_n(&beefmote_import.running, __ATOMIC_ACQUIRE)) {
+                beefmote_notify_clients(BEEFMOTE_NOTIFICATION_PLAYLIST_CHANGED, "[BEEFMOTE_PLAYLIST_CHANGED]\n");
+            }
+            beefmote_status_update();
+        }
+        else if (p1 == DDB_PLAYLIST_CHANGE_PLAYQUEUE) {
+            beefmote_queue_sync();
+        }
+        break;
+
+    case DB_EV_TRACKINFOCHANGED:
+        __atomic_add_fetch(&beefmote_metadata_generation, 1, __ATOMIC_RELEASE);
+
+        // Search mirrors and sync hashes only go through the tracks that
+        // changed again, if they can keep up. When we aren't told which one it
+        // was, the ring is skipped ahead, as if it had overflowed.
+        if (beefmote_tid) {
+            deadbeef->mutex_lock(beefmote_clients_mutex);
+
+            if (ctx && ((ddb_event_track_t*) ctx)->track) {
+                beefmote_changed_tracks[beefmote_changed_seq++ % BEEFMOTE_CHANGED_TRACKS_MAX] =
+                    ((ddb_event_track_t*) ctx)->track;
+            }
+            else {
+                beefmote_changed_seq += BEEFMOTE_CHANGED_TRACKS_MAX + 1;
+            }
+
+            deadbeef->mutex_unlock(beefmote_clients_mutex);
+        }
+
+        beefmote_status_update();
+        break;
+
+    case DB_EV_PLAYLISTSWITCHED:
+        beefmote_notify_clients(BEEFMOTE_NOTIFICATION_PLAYLIST_SWITCHED, "[BEEFMOTE_PLAYLIST_SWITCHED]\n");
+        beefmote_status_update();
+        break;
+    }
+
+    return 0;
+}
+
+static void beefmote_notify_clients(int notification, const char *str)
+{
+    // Events can arrive before we've started, or while we're stopping.
+    if (!beefmote_tid) {
+        return;
+    }
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    uint64_t seq = ++beefmote_event_seq;
+    beefmote_event *event = &beefmote_events[seq % BEEFMOTE_REPLAY_MAX];
+
+    free(event->str);
+    event->seq = seq;
+    event->notification = notification;
+    event->str = strdup(str);
+
+    for (beefmote_client *client = beefmote_clients; client; client = client->next) {
+        beefmote_session *session = client->session;
+
+        if (session) {
+            session->seq = seq;
+
+            if (session->notify[notification]) {
+                beefmote_client_notify(client, notification, str);
+            }
+        }
+    }
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    beefmote_wakeup_thread();
+}
+
+static void beefmote_status_open()
+{
+    if (!deadbeef->conf_get_int("beefmote.status_page", 0)) {
+        return;
+    }
+
+    snprintf(beefmote_status_name, sizeof(beefmote_status_name), BEEFMOTE_STATUS_NAME_FORMAT, (unsigned) getuid());
+
+    int fd = shm_open(beefmote_status_name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd == -1 || ftruncate(fd, sizeof(beefmote_status)) == -1) {
+        beefmote_debug_print("error: couldn't create status page %s, errno = %d\n", beefmote_status_name, errno);
+
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    beefmote_status *page = mmap(NULL, sizeof(beefmote_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (page == MAP_FAILED) {
+        beefmote_debug_print("error: couldn't map status page %s, errno = %d\n", beefmote_status_name, errno);
+        shm_unlink(beefmote_status_name);
+        return;
+    }
+
+    // A page left behind by a crash may still be mapped by readers, so even
+    // setting it up goes through the seqlock. Deadbeef may already be telling
+    // us about changes from its own thread, and updating the page from there.
+    deadbeef->mutex_lock(beefmote_status_mutex);
+
+    uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED) | 1;
+
+    __atomic_store_n(&page->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    page->magic = BEEFMOTE_STATUS_MAGIC;
+    page->version = BEEFMOTE_STATUS_VERSION;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELEASE);
+
+    beefmote_status_page = page;
+    deadbeef->mutex_unlock(beefmote_status_mutex);
+    beefmote_status_update();
+
+    beefmote_debug_print("publishing status page %s\n", beefmote_status_name);
+}
+
+static void beefmote_status_close()
+{
+    deadbeef->mutex_lock(beefmote_status_mutex);
+
+    if (beefmote_status_page) {
+        munmap(beefmote_status_page, sizeof(beefmote_status));
+        shm_unlink(beefmote_status_name);
+        beefmote_status_page = NULL;
+    }
+
+    deadbeef->mutex_unlock(beefmote_status_mutex);
+}
+
+static void beefmote_status_update()
+{
+    // Events can arrive before we've started, or after we've stopped.
+    if (!beefmote_status_mutex) {
+        return;
+    }
+
+    deadbeef->mutex_lock(beefmote_status_mutex);
+
+    beefmote_status *page = beefmote_status_page;
+
+    if (!page) {
+        deadbeef->mutex_unlock(beefmote_status_mutex);
+        return;
+    }
+
+    // Everything is gathered beforehand, so that the page is only being
+    // written (and readers only have to retry) for as little as possible.
+    beefmote_status status;
+    memset(&status, 0, sizeof(status));
+
+    DB_output_t *output = deadbeef->get_output();
+    DB_playItem_t *track = beefmote_currtrack;
+
+    status.state = output ? output->state() : BEEFMOTE_STATUS_STOPPED;
+    status.playlist_generation = __atomic_load_n(&beefmote_playlist_generation, __ATOMIC_ACQUIRE);
+    status.playlist = deadbeef->plt_get_curr_idx();
+    status.track = track ? deadbeef->pl_get_idx_of(track) : -1;
+    status.position = track ? deadbeef->streamer_get_playpos() : 0;
+    status.position_ms = beefmote_now_ms();
+    status.duration = track ? deadbeef->pl_get_item_duration(track) : 0;
+    status.volume = deadbeef->volume_get_db();
+
+    if (track) {
+        const char *keys[] = { "artist", "album", "title", "track" };
+        char *fields[] = { status.artist, status.album, status.title, status.tracknumber };
+
+        deadbeef->pl_lock();
+
+        for (int i = 0; i < (int) (sizeof(keys) / sizeof(keys[0])); i++) {
+            const char *value = deadbeef->pl_find_meta(track, keys[i]);
+            snprintf(fields[i], BEEFMOTE_STATUS_FIELD_LENGTH, "%s", value ? value : "");
+        }
+
+        deadbeef->pl_unlock();
+    }
+
+    size_t offset = offsetof(beefmote_status, state);
+    uint32_t seq = page->seq;
+
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*) page + offset, (char*) &status + offset, sizeof(status) - offset);
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+
+    deadbeef->mutex_unlock(beefmote_status_mutex);
+}
+
+static char *beefmote_format_upcoming(DB_playItem_t *track)
+{
+    assert(track);
+
+    DB_playItem_t *upcoming[BEEFMOTE_UPCOMING_MAX];
+    int upcoming_n = 0;
+
+    // What plays next is what's queued, if anything; Deadbeef has already
+    // taken the current track off the queue.
+    int queue_n = deadbeef->playqueue_get_count();
+    bool from_queue = queue_n > 0;
+
+    if (from_queue) {
+        while (upcoming_n < beefmote_upcoming_n && upcoming_n < queue_n) {
+            upcoming[upcoming_n] = deadbeef->playqueue_get_item(upcoming_n);
+
+            if (!upcoming[upcoming_n]) {
+                break;
+            }
+
+            upcoming_n++;
+        }
+    }
+    else {
+        DB_playItem_t *next = deadbeef->pl_get_next(track, PL_MAIN);
+
+        while (next && upcoming_n < beefmote_upcoming_n) {
+            upcoming[upcoming_n++] = next;
+            next = deadbeef->pl_get_next(next, PL_MAIN);
+        }
+
+        if (next) {
+            deadbeef->pl_item_unref(next);
+        }
+    }
+
+    // Every line fits in BEEFMOTE_STR_MAXLENGTH, newline included.
+    char *str = malloc((upcoming_n + 3) * BEEFMOTE_STR_MAXLENGTH);
+    int len = 0;
+
+    if (str) {
+        len += sprintf(str + len, "[BEEFMOTE_UPCOMING_BEGIN] %d %s\n", upcoming_n, from_queue ? "queue" : "playlist");
+
+        int line = sprintf(str + len, "[BEEFMOTE_NOW_PLAYING] (%d) ", deadbeef->pl_get_idx_of(track));
+        line += beefmote_format_track(str + len + line, BEEFMOTE_STR_MAXLENGTH - line - 1, track, true);
+        len += line;
+    }
+
+    for (int i = 0; i < upcoming_n; i++) {
+        if (str) {
+            int line = sprintf(str + len, "[BEEFMOTE_UPCOMING_TRACK] (%d) ", deadbeef->pl_get_idx_of(upcoming[i]));
+            line += beefmote_format_track(str + len + line, BEEFMOTE_STR_MAXLENGTH - line - 1, upcoming[i], true);
+            len += line;
+        }
+
+        deadbeef->pl_item_unref(upcoming[i]);
+    }
+
+    if (str) {
+        strcpy(str + len, "[BEEFMOTE_UPCOMING_END]\n");
+    }
+
+    return str;
+}
+
+static void beefmote_queue_sync()
+{
+    // Events can arrive before we've started, or after we've stopped.
+    if (!beefmote_queue_mutex) {
+        return;
+    }
+
+    deadbeef->mutex_lock(beefmote_queue_mutex);
+
+    DB_playItem_t *queue[BEEFMOTE_QUEUE_MAX];
+    int queue_n = deadbeef->playqueue_get_count();
+    char str[BEEFMOTE_STR_MAXLENGTH];
+
+    if (queue_n > BEEFMOTE_QUEUE_MAX) {
+        queue_n = BEEFMOTE_QUEUE_MAX;
+    }
+
+    for (int i = 0; i < queue_n; i++) {
+        queue[i] = deadbeef->playqueue_get_item(i);
+
+        if (!queue[i]) {
+            queue_n = i;
+            break;
+        }
+    }
+
+    if (queue_n == 0 && beefmote_queue_n > 1) {
+        beefmote_queue_free();
+        beefmote_notify_clients(BEEFMOTE_NOTIFICATION_QUEUE, "[BEEFMOTE_QUEUE_CLEARED]\n");
+    }
+
+    // Deadbeef doesn't tell what changed, so we find it out. A track can be
+    // queued more than once: of each track, we keep as many of the first
+    // times it was queued as there are now, and remove the rest. We go
+    // backwards so the positions we send are still right when they're applied
+    // in order.
+    for (int i = beefmote_queue_n - 1; i >= 0; i--) {
+        int before_n = 0;
+        int now_n = 0;
+
+        for (int j = 0; j <= i; j++) {
+            before_n += beefmote_queue[j] == beefmote_queue[i];
+        }
+
+        for (int j = 0; j < queue_n; j++) {
+            now_n += queue[j] == beefmote_queue[i];
+        }
+
+        if (before_n <= now_n) {
+            continue;
+        }
+
+        deadbeef->pl_item_unref(beefmote_queue[i]);
+        memmove(beefmote_queue + i, beefmote_queue + i + 1, (beefmote_queue_n - i - 1) * sizeof(DB_playItem_t *));
+        beefmote_queue_n--;
+
+        sprintf(str, "[BEEFMOTE_QUEUE_REMOVED] %d\n", i);
+        beefmote_notify_clients(BEEFMOTE_NOTIFICATION_QUEUE, str);
+    }
+
+    // Now every track we have is still in the queue; put them in their place
+    // and add the new ones.
+    for (int i = 0; i < queue_n; i++) {
+        if (i < beefmote_queue_n && beefmote_queue[i] == queue[i]) {
+            deadbeef->pl_item_unref(queue[i]);
+            continue;
+        }
+
+        int from = -1;
+
+        for (int j = i + 1; j < beefmote_queue_n && from == -1; j++) {
+            if (beefmote_queue[j] == queue[i]) {
+                from = j;
+            }
+        }
+
+        if (from != -1) {
+            memmove(beefmote_queue + i + 1, beefmote_queue + i, (from - i) * sizeof(DB_playItem_t *));
+            beefmote_queue[i] = queue[i];
+            deadbeef->pl_item_unref(queue[i]);
+            sprintf(str, "[BEEFMOTE_QUEUE_MOVED] %d %d\n", from, i);
+        }
+        else {
+            memmove(beefmote_queue + i + 1, beefmote_queue + i, (beefmote_queue_n - i) * sizeof(DB_playItem_t *));
+            beefmote_queue[i] = queue[i];   // keeps the reference playqueue_get_item took
+            beefmote_queue_n++;
+
+            int len = sprintf(str, "[BEEFMOTE_QUEUE_ADDED] (%d) ", i);
+            beefmote_format_track(str + len, sizeof(str) - len, queue[i], true);
+        }
+
+        beefmote_notify_clients(BEEFMOTE_NOTIFICATION_QUEUE, str);
+    }
+
+    assert(beefmote_queue_n == queue_n);
+
+    deadbeef->mutex_unlock(beefmote_queue_mutex);
+}
+
+static void beefmote_queue_free()
+{
+    for (int i = 0; i < beefmote_queue_n; i++) {
+        deadbeef->pl_item_unref(beefmote_queue[i]);
+    }
+
+    beefmote_queue_n = 0;
+}
+
+static beefmote_session *beefmote_client_session(beefmote_client *client)
+{
+    assert(client);
+
+    if (client->session) {
+        return client->session;
+    }
+
+    uint8_t random[BEEFMOTE_SESSION_TOKEN_LENGTH / 2];
+
+    if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+        beefmote_debug_print("error: couldn't get random bytes for a session token\n");
+        return NULL;
+    }
+
+    beefmote_session *session = calloc(1, sizeof(beefmote_session));
+    if (!session) {
+        return NULL;
+    }
+
+    for (int i = 0; i < (int) sizeof(random); i++) {
+        sprintf(session->token + 2 * i, "%02x", random[i]);
+    }
+
+    session->client = client;
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    session->seq = beefmote_event_seq;
+    session->next = beefmote_sessions;
+    beefmote_sessions = session;
+    beefmote_sessions_n++;
+    client->session = session;
+    beefmote_sessions_expire();
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    return session;
+}
+
+static void beefmote_session_detach(beefmote_client *client)
+{
+    assert(client);
+
+    beefmote_session *session = client->session;
+
+    if (!session) {
+        return;
+    }
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+
+    client->session = NULL;
+    session->client = NULL;
+    session->detached_at = beefmote_now_ms();
+
+    if (!session->token_issued) {
+        beefmote_session_free(session);
+    }
+
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+}
+
+static beefmote_session *beefmote_session_find(const char *token)
+{
+    assert(token);
+
+    for (beefmote_session *session = beefmote_sessions; session; session = session->next) {
+        if (session->token_issued && !strcmp(session->token, token)) {
+            return session;
+        }
+    }
+
+    return NULL;
+}
+
+static void beefmote_session_free(beefmote_session *session)
+{
+    assert(session);
+    assert(!session->client);
+
+    for (beefmote_session **link = &beefmote_sessions; *link; link = &(*link)->next) {
+        if (*link == session) {
+            *link = session->next;
+            beefmote_sessions_n--;
+            break;
+        }
+    }
+
+    free(session);
+}
+
+static void beefmote_sessions_expire()
+{
+    uint64_t now = beefmote_now_ms();
+    beefmote_session *next;
+
+    for (beefmote_session *session = beefmote_sessions; session; session = next) {
+        next = session->next;
+
+        if (!session->client && now - session->detached_at > BEEFMOTE_SESSION_TTL_MS) {
+            beefmote_session_free(session);
+        }
+    }
+
+    // There are more sessions than clients, so there's always a detached one.
+    while (beefmote_sessions_n > BEEFMOTE_SESSIONS_MAX) {
+        beefmote_session *oldest = NULL;
+
+        for (beefmote_session *session = beefmote_sessions; session; session = session->next) {
+            if (!session->client && (!oldest || session->detached_at < oldest->detached_at)) {
+                oldest = session;
+            }
+        }
+
+        if (!oldest) {
+            break;
+        }
+
+        beefmote_session_free(oldest);
+    }
+}
+
+static void beefmote_sessions_free()
+{
+    while (beefmote_sessions) {
+        beefmote_session *session = beefmote_sessions;
+        beefmote_sessions = session->next;
+        free(session);
+    }
+
+    beefmote_sessions_n = 0;
+
+    for (int i = 0; i < BEEFMOTE_REPLAY_MAX; i++) {
+        free(beefmote_events[i].str);
+        beefmote_events[i].str = NULL;
+    }
+}
+
+static void beefmote_command_help(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(beefmote_commands[BEEFMOTE_HELP].name);
+
+    char help[BEEFMOTE_STR_MAXLENGTH * 2];
+
+    client_print_newline(client_socket);
+
+    for (int i = 0; i < BEEFMOTE_COMMANDS_N; i++) {
+        strcpy(help, beefmote_commands[i].name);
+        strcat(help, "\n\t");
+        strcat(help, beefmote_commands[i].help);
+        strcat(help, "\n");
+        client_print_string(client_socket, help);
+    }
+
+    client_print_newline(client_socket);
+}
+
+static void beefmote_command_playlists(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    int pl_n = deadbeef->plt_get_count();
+
+    if (pl_n <= 0) {
+        client_print_string(client_socket, "\nNo playlists\n\n");
+        return;
+    }
+
+    if (data) {
+        int idx = strtol((char*) data, NULL, 10);
+
+        if (idx < 0 || idx >= pl_n) {
+            client_print_string(client_socket, "\nPlaylist index out of bounds\n\n");
+            return;
+        }
+
+        deadbeef->plt_set_curr_idx(idx);
+        return;
+    }
+
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+
+    char str[BEEFMOTE_STR_MAXLENGTH];
+
+    for (int i = 0; i < pl_n; i++) {
+        ddb_playlist_t *pl = deadbeef->plt_get_for_idx(i);
+        char pl_name[BEEFMOTE_STR_MAXLENGTH];
         deadbeef->plt_get_title(pl, pl_name, sizeof(pl_name));
         sprintf(str, "\nPlaylist %d: %s", i, pl_name);
         client_print_string(client_socket, str);
         if (pl_curr == pl) {
             client_print_string(client_socket, " (*)");
         }
-        client_print_newline(client_socket);
+        client_print_newline(client_socket);
+        deadbeef->plt_unref(pl);
+    }
+
+    if (pl_curr) {
+        deadbeef->plt_unref(pl_curr);
+    }
+
+    client_print_newline(client_socket);
+}
+
+static void beefmote_command_tracklist(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    if (pl_curr) {
+        client_print_playlist(client_socket, pl_curr, false);
+        deadbeef->plt_unref(pl_curr);
+    }
+}
+
+static void beefmote_command_tracklist_address(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    if (pl_curr) {
+        client_print_playlist(client_socket, pl_curr, true);
+        deadbeef->plt_unref(pl_curr);
+    }
+}
+
+static void beefmote_command_trackcurr(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (beefmote_currtrack) {
+        client_print_newline(client_socket);
+        client_print_track(client_socket, beefmote_currtrack, false);
+        client_print_newline(client_socket);
+    }
+    else {
+        client_print_string(client_socket, "\nNo current track\n\n");
+    }
+}
+
+static void beefmote_command_play(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    deadbeef->sendmessage(DB_EV_PLAY_CURRENT, 0, 0, 0);
+}
+
+static void beefmote_command_play_search(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_PLAY_SEARCH].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    int track_index = strtol((char*) data, NULL, 10);
+    if (track_index < 0) {
+        client_print_string(client_socket, "\nInvalid search index\n\n");
+        return;
+    }
+
+    DB_playItem_t *track = beefmote_client_search_result(client_socket, track_index);
+    if (track) {
+        client_print_string(client_socket, "\nPlaying ");
+        client_print_track(client_socket, track, false);
+        client_print_newline(client_socket);
+        beefmote_play_track(track);
+        deadbeef->pl_item_unref(track);
+    }
+    else {
+        client_print_string(client_socket, "\nInvalid search index\n\n");
+    }
+}
+
+static void beefmote_command_play_address(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if(!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_PLAY_ADDRESS].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    long addr = strtol((char*) data, NULL, 16);
+
+    DB_playItem_t *track = (DB_playItem_t*) addr;
+    int idx = deadbeef->pl_get_idx_of(track); // get MAIN playlist track index
+
+    if(idx == -1) {
+        client_print_string(client_socket, "\nInvalid track memory address\n\n");
+        return;
+    }
+
+    deadbeef->sendmessage(DB_EV_PLAY_NUM, 0, idx, 0);
+}
+
+static void beefmote_command_play_uri(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_PLAY_URI].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    char str[BEEFMOTE_BUFSIZE + BEEFMOTE_NAME_MAXLENGTH];
+
+    // Paths are separated by tabs, since they can have spaces in them.
+    for (char *uri = data; uri; ) {
+        char *tab = strchr(uri, '\t');
+
+        if (tab) {
+            *tab = 0;
+        }
+
+        int pl_idx;
+        DB_playItem_t *track = beefmote_uri_find(uri, &pl_idx);
+
+        if (track) {
+            if (pl_idx != deadbeef->plt_get_curr_idx()) {
+                deadbeef->plt_set_curr_idx(pl_idx);
+            }
+
+            deadbeef->sendmessage(DB_EV_PLAY_NUM, 0, deadbeef->pl_get_idx_of(track), 0);
+            deadbeef->pl_item_unref(track);
+            return;
+        }
+
+        snprintf(str, sizeof(str), "[BEEFMOTE_PLAY_URI] Not found: %s\n", uri);
+        client_print_string(client_socket, str);
+
+        uri = tab ? tab + 1 : NULL;
+    }
+}
+
+static void beefmote_command_random(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+    
+    deadbeef->sendmessage(DB_EV_PLAY_RANDOM, 0, 0, 0);
+}
+
+static void beefmote_command_play_resume(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    if (data) {
+        int idx = strtol((char*) data, NULL, 10);
+        deadbeef->sendmessage(DB_EV_PLAY_NUM, 0, idx, 0);
+        return;
+    }
+
+    int state = deadbeef->get_output()->state();
+
+    if (state == OUTPUT_STATE_PLAYING) {
+        deadbeef->sendmessage (DB_EV_PAUSE, 0, 0, 0);
+    }
+    else {
+        deadbeef->sendmessage (DB_EV_PLAY_CURRENT, 0, 0, 0);
+    }
+}
+
+static void beefmote_command_stop(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+}
+
+static void beefmote_command_stop_after_current(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    int value = deadbeef->conf_get_int("playlist.stop_after_current", 0);
+    value = 1 - value;
+    deadbeef->conf_set_int("playlist.stop_after_current", value);
+    deadbeef->sendmessage(DB_EV_CONFIGCHANGED, 0, 0, 0);
+}
+
+static void beefmote_command_previous(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    deadbeef->sendmessage(DB_EV_PREV, 0, 0, 0);
+}
+
+static void beefmote_command_next(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    deadbeef->sendmessage(DB_EV_NEXT, 0, 0, 0);
+}
+
+static void beefmote_command_volume_up(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    int step;
+    if (data) {
+        step = strtol(data, NULL, 10);
+    }
+    else {
+        step = BEEFMOTE_VOLUME_STEP;
+    }
+
+    beefmote_print_volume(client_socket, beefmote_adjust(&beefmote_adjusters[BEEFMOTE_ADJUSTER_VOLUME], step, true));
+}
+
+static void beefmote_command_volume_down(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    int step;
+    if (data) {
+        step = strtol(data, NULL, 10);
+    }
+    else {
+        step = BEEFMOTE_VOLUME_STEP;
+    }
+
+    beefmote_print_volume(client_socket, beefmote_adjust(&beefmote_adjusters[BEEFMOTE_ADJUSTER_VOLUME], -step, true));
+}
+
+static void beefmote_command_seek_forward(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    beefmote_seek(client_socket, BEEFMOTE_SEEK_STEP, true);
+}
+
+static void beefmote_command_seek_backward(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    beefmote_seek(client_socket, -BEEFMOTE_SEEK_STEP, true);
+}
+
+static void beefmote_command_volume_set(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    float volume;
+
+    if (!data || !beefmote_parse_float(data, &volume)) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_VOLUME_SET].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    beefmote_print_volume(client_socket, beefmote_adjust(&beefmote_adjusters[BEEFMOTE_ADJUSTER_VOLUME], volume, false));
+}
+
+static void beefmote_command_seek_to(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    float position;
+
+    if (!data || !beefmote_parse_float(data, &position)) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_SEEK_TO].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    beefmote_seek(client_socket, position, false);
+}
+
+static void beefmote_command_search(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_SEARCH].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    char *arg = (char*) data;
+
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    if (!pl_curr) {
+        return;
+    }
+
+    beefmote_client *client = beefmote_client_get(client_socket);
+    DB_playItem_t **results;
+    int results_n = client ? beefmote_search(pl_curr, arg, &results, &client->search) : -1;
+
+    client_print_newline(client_socket);
+
+    // Results are streamed like tracklists are.
+    if (results_n != -1) {
+        beefmote_client_set_results(client, results, results_n);
+        beefmote_client_start_stream(client, pl_curr, PL_SEARCH, false);
+    }
+    else {
+        client_print_string(client_socket, "(nothing was found)\n\n");
+    }
+
+    deadbeef->plt_unref(pl_curr);
+}
+
+static void beefmote_command_search_all(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_SEARCH_ALL].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
+        return;
+    }
+
+    // The stream needs a playlist, even though results come from all of them.
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    if (!pl_curr) {
+        return;
+    }
+
+    if (!beefmote_search_all(client, (char*) data, pl_curr)) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, "Out of memory\n\n");
+    }
+
+    deadbeef->plt_unref(pl_curr);
+}
+
+static void beefmote_set_boolean(int client_socket, bool *some_bool, char *some_bool_name,
+                                 char *help, void *true_false)
+{
+    assert(client_socket > 0 && some_bool && some_bool_name && help);
+
+    if(!true_false) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    char *str = true_false;
+
+    // Notification settings are read by Deadbeef's thread.
+    if (strcmp(str, "true") == 0) {
+        deadbeef->mutex_lock(beefmote_clients_mutex);
+        *some_bool = true;
+        deadbeef->mutex_unlock(beefmote_clients_mutex);
+        beefmote_debug_print("%s notification set to true\n", some_bool_name);
+    }
+    else if (strcmp(str, "false") == 0) {
+        deadbeef->mutex_lock(beefmote_clients_mutex);
+        *some_bool = false;
+        deadbeef->mutex_unlock(beefmote_clients_mutex);
+        beefmote_debug_print("%s notification set to false\n", some_bool_name);
+    }
+    else {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, help);
+        client_print_newline(client_socket);
+        return;
+    } 
+}
+
+static void beefmote_command_notify_playlist_changed(int client_socket, void *data)
+{
+    beefmote_client *client = beefmote_client_get(client_socket);
+    beefmote_session *session = client ? beefmote_client_session(client) : NULL;
+    if (!session) {
+        return;
+    }
+
+    beefmote_set_boolean(client_socket, &session->notify[BEEFMOTE_NOTIFICATION_PLAYLIST_CHANGED], "Playlist changed",
+            beefmote_commands[BEEFMOTE_NOTIFY_PLAYLIST_CHANGED].help, data);
+}
+
+static void beefmote_command_notify_playlist_switched(int client_socket, void *data)
+{
+    beefmote_client *client = beefmote_client_get(client_socket);
+    beefmote_session *session = client ? beefmote_client_session(client) : NULL;
+    if (!session) {
+        return;
+    }
+
+    beefmote_set_boolean(client_socket, &session->notify[BEEFMOTE_NOTIFICATION_PLAYLIST_SWITCHED], "Playlist switched",
+            beefmote_commands[BEEFMOTE_NOTIFY_PLAYLIST_SWITCHED].help, data);
+}
+
+static void beefmote_command_notify_now_playing(int client_socket, void *data)
+{
+    beefmote_client *client = beefmote_client_get(client_socket);
+    beefmote_session *session = client ? beefmote_client_session(client) : NULL;
+    if (!session) {
+        return;
+    }
+
+    beefmote_set_boolean(client_socket, &session->notify[BEEFMOTE_NOTIFICATION_NOW_PLAYING], "Now playing",
+            beefmote_commands[BEEFMOTE_NOTIFY_NOW_PLAYING].help, data);
+}
+
+static void beefmote_command_notify_queue(int client_socket, void *data)
+{
+    beefmote_client *client = beefmote_client_get(client_socket);
+    beefmote_session *session = client ? beefmote_client_session(client) : NULL;
+    if (!session) {
+        return;
+    }
+
+    beefmote_set_boolean(client_socket, &session->notify[BEEFMOTE_NOTIFICATION_QUEUE], "Queue changed",
+            beefmote_commands[BEEFMOTE_NOTIFY_QUEUE].help, data);
+}
+
+static void beefmote_command_notify_upcoming(int client_socket, void *data)
+{
+    beefmote_client *client = beefmote_client_get(client_socket);
+    beefmote_session *session = client ? beefmote_client_session(client) : NULL;
+    if (!session) {
+        return;
+    }
+
+    beefmote_set_boolean(client_socket, &session->notify[BEEFMOTE_NOTIFICATION_UPCOMING], "Upcoming tracks",
+            beefmote_commands[BEEFMOTE_NOTIFY_UPCOMING].help, data);
+}
+
+static void beefmote_command_notify_tagged(int client_socket, void *data)
+{
+    beefmote_client *client = beefmote_client_get(client_socket);
+    beefmote_session *session = client ? beefmote_client_session(client) : NULL;
+    if (!session) {
+        return;
+    }
+
+    beefmote_set_boolean(client_socket, &session->tagged, "Tagged",
+            beefmote_commands[BEEFMOTE_NOTIFY_TAGGED].help, data);
+}
+
+static bool beefmote_play_track(DB_playItem_t *track)
+{
+    assert(track);
+
+    ddb_playlist_t *playlist = deadbeef->pl_get_playlist(track);
+    if (!playlist) {
+        return false;
+    }
+
+    int idx = deadbeef->plt_get_item_idx(playlist, track, PL_MAIN);
+    int plt_idx = -1;
+    int plt_n = deadbeef->plt_get_count();
+
+    for (int i = 0; i < plt_n && plt_idx == -1; i++) {
+        ddb_playlist_t *pl = deadbeef->plt_get_for_idx(i);
+
+        if (pl) {
+            plt_idx = pl == playlist ? i : -1;
+            deadbeef->plt_unref(pl);
+        }
     }
 
-    client_print_newline(client_socket);
+    deadbeef->plt_unref(playlist);
+
+    if (idx == -1 || plt_idx == -1) {
+        return false;
+    }
+
+    if (plt_idx != deadbeef->plt_get_curr_idx()) {
+        deadbeef->plt_set_curr_idx(plt_idx);
+    }
+
+    deadbeef->sendmessage(DB_EV_PLAY_NUM, 0, idx, 0);
+
+    return true;
 }
 
-static void beefmote_command_tracklist(int client_socket, void *data)
+static int playlist_add_to_playbackqueue(int playlist, int index)
 {
-    assert(client_socket > 0);
     assert(deadbeef);
+    assert(playlist == PL_MAIN || playlist == PL_SEARCH);
+
+    if (index < 0) {
+        return -1;
+    }
 
     ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
-    if (pl_curr) {
-        client_print_playlist(client_socket, pl_curr, false);
-        deadbeef->plt_unref(pl_curr);
+    if (!pl_curr) {
+        return 0;
+    }
+
+    DB_playItem_t *track = deadbeef->plt_get_item_for_idx(pl_curr, index, playlist);
+    if (track) {
+        deadbeef->playqueue_push(track);
+        deadbeef->pl_item_unref(track);
+        return 1;
+    }
+    else {
+        return -1;
     }
 }
 
-static void beefmote_command_tracklist_address(int client_socket, void *data)
+static void beefmote_command_add_playbackqueue(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ADD_PLAYBACKQUEUE].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    int track_index = strtol((char*) data, NULL, 10);
+
+    if (playlist_add_to_playbackqueue(PL_MAIN, track_index) == -1) {
+        client_print_string(client_socket, "[BEEFMOTE_ADD_PLAYBACKQUEUE] Invalid search index\n");
+        return;
+    }
+}
+
+static void beefmote_command_add_playbackqueue_address(int client_socket, void *data)
 {
     assert(client_socket > 0);
     assert(deadbeef);
 
-    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
-    if (pl_curr) {
-        client_print_playlist(client_socket, pl_curr, true);
-        deadbeef->plt_unref(pl_curr);
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ADD_PLAYBACKQUEUE_ADDRESS].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    long addr = strtol((char*) data, NULL, 16);
+    DB_playItem_t *track = (DB_playItem_t*) addr;
+    int idx = deadbeef->pl_get_idx_of(track); // get MAIN playlist track index
+
+    if(idx == -1 || playlist_add_to_playbackqueue(PL_MAIN, idx) == -1) {
+        client_print_string(client_socket, "[BEEFMOTE_ADD_PLAYBACKQUEUE_ADDRESS] Invalid track memory address\n");
+        return;
     }
 }
 
-static void beefmote_command_trackcurr(int client_socket, void *data)
+static void beefmote_command_add_search_playbackqueue(int client_socket, void *data)
 {
     assert(client_socket > 0);
 
-    if (beefmote_currtrack) {
+    if (!data) {
         client_print_newline(client_socket);
-        client_print_track(client_socket, beefmote_currtrack, false);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ADD_SEARCH_PLAYBACKQUEUE].help);
         client_print_newline(client_socket);
+        return;
     }
-    else {
-        client_print_string(client_socket, "\nNo current track\n\n");
+
+    int track_index = strtol((char*) data, NULL, 10);
+    DB_playItem_t *track = beefmote_client_search_result(client_socket, track_index);
+
+    if (!track) {
+        client_print_string(client_socket, "[BEEFMOTE_ADD_SEARCH_PLAYBACKQUEUE] Invalid search index\n");
+        return;
     }
+
+    deadbeef->playqueue_push(track);
+    deadbeef->pl_item_unref(track);
 }
 
-static void beefmote_command_play(int client_socket, void *data)
+static void beefmote_command_add_playbackqueue_uri(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ADD_PLAYBACKQUEUE_URI].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    char str[BEEFMOTE_BUFSIZE + BEEFMOTE_NAME_MAXLENGTH];
+    int added_n = 0;
+    int uris_n = 0;
+
+    for (char *uri = data; uri; uris_n++) {
+        char *tab = strchr(uri, '\t');
+
+        if (tab) {
+            *tab = 0;
+        }
+
+        int pl_idx;
+        DB_playItem_t *track = beefmote_uri_find(uri, &pl_idx);
+
+        if (track && deadbeef->playqueue_push(track) != -1) {
+            added_n++;
+        }
+        else {
+            snprintf(str, sizeof(str), "[BEEFMOTE_ADD_PLAYBACKQUEUE_URI] Not found: %s\n", uri);
+            client_print_string(client_socket, str);
+        }
+
+        if (track) {
+            deadbeef->pl_item_unref(track);
+        }
+
+        uri = tab ? tab + 1 : NULL;
+    }
+
+    sprintf(str, "[BEEFMOTE_ADD_PLAYBACKQUEUE_URI] Added %d of %d\n", added_n, uris_n);
+    client_print_string(client_socket, str);
+}
+
+static void beefmote_command_import(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!data) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_IMPORT].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
+        return;
+    }
+
+    if (beefmote_import.tid) {
+        client_print_string(client_socket, "[BEEFMOTE_IMPORT_BEGIN] Another import is going on\n");
+        return;
+    }
+
+    ddb_playlist_t *playlist = deadbeef->plt_get_curr();
+    if (!playlist) {
+        client_print_string(client_socket, "[BEEFMOTE_IMPORT_BEGIN] No current playlist\n");
+        return;
+    }
+
+    char *paths = strdup(data);
+    if (!paths) {
+        deadbeef->plt_unref(playlist);
+        client_print_string(client_socket, "[BEEFMOTE_IMPORT_BEGIN] Out of memory\n");
+        return;
+    }
+
+    int paths_n = 1;
+
+    for (char *tab = strchr(paths, '\t'); tab; tab = strchr(tab + 1, '\t')) {
+        paths_n++;
+    }
+
+    beefmote_import = (beefmote_import_job) {
+        .playlist = playlist,
+        .paths = paths,
+        .paths_n = paths_n,
+        .client = client,
+        .running = true,
+    };
+    strcpy(beefmote_import.tag, client->tag);
+
+    beefmote_import.tid = deadbeef->thread_start(beefmote_import_thread, &beefmote_import);
+
+    if (!beefmote_import.tid) {
+        deadbeef->plt_unref(playlist);
+        free(paths);
+        beefmote_import.running = false;
+        client_print_string(client_socket, "[BEEFMOTE_IMPORT_BEGIN] Couldn't start the import\n");
+        return;
+    }
+
+    char str[BEEFMOTE_STR_MAXLENGTH];
+    sprintf(str, "[BEEFMOTE_IMPORT_BEGIN] %d\n", paths_n);
+    client_print_string(client_socket, str);
+
+    client->reply_deferred = true;
+    beefmote_timer_set(&beefmote_import.timer, BEEFMOTE_IMPORT_PROGRESS_MS, beefmote_import_progress);
+}
+
+static void beefmote_command_import_cancel(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    if (!beefmote_import.tid) {
+        client_print_string(client_socket, "[BEEFMOTE_IMPORT_CANCEL] No import going on\n");
+        return;
+    }
+
+    // The import thread stops at the next track, and the progress timer reports the end.
+    __atomic_store_n(&beefmote_import.cancel, true, __ATOMIC_RELAXED);
+}
+
+static void beefmote_command_abort(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
+        return;
+    }
+
+    // Drop every queued bulk command, keeping everything else in order.
+    // Tagged requests still get the end of their reply.
+    int pending_n = client->pending_n;
+    client->pending_n = 0;
+
+    for (int i = 0; i < pending_n; i++) {
+        char *command = client->pending[(client->pending_first + i) % BEEFMOTE_PENDING_MAX];
+        char tag[BEEFMOTE_TAG_MAXLENGTH + 1];
+        char *request = beefmote_request_tag(command, tag);
+
+        if (beefmote_bulk_family(beefmote_command_lookup(request)) != -1) {
+            if (tag[0]) {
+                char str[BEEFMOTE_TAG_MAXLENGTH + 32];
+                int len = beefmote_tag_prefix(str, tag);
+                strcpy(str + len, "[BEEFMOTE_CANCELLED]\n");
+
+                beefmote_client_commit_line(client);
+                deadbeef->mutex_lock(beefmote_clients_mutex);
+                beefmote_client_enqueue(client, str, strlen(str), false);
+                deadbeef->mutex_unlock(beefmote_clients_mutex);
+            }
+
+            free(command);
+            continue;
+        }
+
+        client->pending[(client->pending_first + client->pending_n) % BEEFMOTE_PENDING_MAX] = command;
+        client->pending_n++;
+    }
+
+    beefmote_client_abort_stream(client);
+}
+
+static void beefmote_command_sync(int client_socket, void *data)
 {
     assert(client_socket > 0);
     assert(deadbeef);
 
-    deadbeef->sendmessage(DB_EV_PLAY_CURRENT, 0, 0, 0);
+    beefmote_sync_request(client_socket, BEEFMOTE_SYNC, data);
 }
 
-static void beefmote_command_play_search(int client_socket, void *data)
+static void beefmote_command_sync_nodes(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    int level, node;
+
+    if (!data || sscanf((char*) data, "%d %d", &level, &node) != 2) {
+        client_print_newline(client_socket);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_SYNC_NODES].help);
+        client_print_newline(client_socket);
+        return;
+    }
+
+    beefmote_sync_request(client_socket, BEEFMOTE_SYNC_NODES, data);
+}
+
+static void beefmote_command_sync_chunks(int client_socket, void *data)
 {
     assert(client_socket > 0);
+    assert(deadbeef);
 
     if (!data) {
         client_print_newline(client_socket);
-        client_print_string(client_socket, beefmote_commands[BEEFMOTE_PLAY_SEARCH].help);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_SYNC_CHUNKS].help);
         client_print_newline(client_socket);
         return;
     }
 
-    int track_index = strtol((char*) data, NULL, 10);
-    if (track_index < 0) {
-        client_print_string(client_socket, "\nInvalid search index\n\n");
+    beefmote_sync_request(client_socket, BEEFMOTE_SYNC_CHUNKS, data);
+}
+
+static void beefmote_sync_request(int client_socket, int comm_id, const char *args)
+{
+    assert(client_socket > 0);
+
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
         return;
     }
 
@@ -896,330 +9534,508 @@ static void beefmote_command_play_search(int client_socket, void *data)
         return;
     }
 
-    DB_playItem_t *track = deadbeef->plt_get_item_for_idx(pl_curr, track_index, PL_SEARCH);
-    if (track) {
-        client_print_string(client_socket, "\nPlaying ");
-        client_print_track(client_socket, track, false);
-        client_print_newline(client_socket);
-        int idx = deadbeef->pl_get_idx_of(track); // we gotta use the track index in the MAIN playlist
-        deadbeef->sendmessage(DB_EV_PLAY_NUM, 0, idx, 0);
-        deadbeef->pl_item_unref(track);
+    beefmote_batch *building;
+    beefmote_sync_tree *tree = beefmote_sync_tree_get(pl_curr, &building);
+
+    deadbeef->plt_unref(pl_curr);
+
+    // The reply waits for the hashes to be brought up to date (see beefmote_sync_done).
+    if (building) {
+        client->sync_args = strdup(args ? args : "");
+
+        if (client->sync_args) {
+            client->sync_comm_id = comm_id;
+            strcpy(client->sync_tag, client->tag);
+            client->awaiting = building;
+            client->reply_deferred = true;
+            return;
+        }
     }
-    else {
-        client_print_string(client_socket, "\nInvalid search index\n\n");
+
+    beefmote_sync_reply(client, tree, comm_id, args);
+}
+
+static void beefmote_sync_reply(beefmote_client *client, beefmote_sync_tree *tree, int comm_id,
+                                const char *args)
+{
+    assert(client);
+
+    char str[BEEFMOTE_STR_MAXLENGTH];
+
+    switch (comm_id) {
+    case BEEFMOTE_SYNC:
+        if (!tree) {
+            client_print_string(client->socket, "[BEEFMOTE_SYNC_ROOT] Out of memory\n");
+        }
+        else if (args && strtoull(args, NULL, 16) == tree->root) {
+            sprintf(str, "[BEEFMOTE_SYNC_UNCHANGED] %016llx\n", (unsigned long long) tree->root);
+            client_print_string(client->socket, str);
+        }
+        else {
+            sprintf(str, "[BEEFMOTE_SYNC_ROOT] %016llx %d %d %d\n", (unsigned long long) tree->root, tree->levels_n,
+                    tree->levels_n > 0 ? tree->level_n[0] : 0, tree->tracks_n);
+            client_print_string(client->socket, str);
+        }
+        break;
+
+    case BEEFMOTE_SYNC_NODES: {
+        int level = 0, node = 0;
+
+        if (!tree) {
+            client_print_string(client->socket, "[BEEFMOTE_SYNC_NODES] Out of memory\n");
+            break;
+        }
+
+        // Level 0 nodes are chunks, which have tracks instead of children (see syncc).
+        if (sscanf(args, "%d %d", &level, &node) != 2 || level < 1 || level >= tree->levels_n || node < 0 ||
+            node >= tree->level_n[level]) {
+            client_print_string(client->socket, "[BEEFMOTE_SYNC_NODES] Invalid node\n");
+            break;
+        }
+
+        int first = node * BEEFMOTE_SYNC_FANOUT;
+        int below_n = tree->level_n[level - 1];
+        int len = sprintf(str, "[BEEFMOTE_SYNC_NODES] %d %d", level - 1, first);
+
+        for (int i = first; i < below_n && i < first + BEEFMOTE_SYNC_FANOUT; i++) {
+            len += sprintf(str + len, " %016llx", (unsigned long long) tree->level[level - 1][i]);
+        }
+
+        strcpy(str + len, "\n");
+        client_print_string(client->socket, str);
+        break;
+    }
+
+    case BEEFMOTE_SYNC_CHUNKS: {
+        const char *ptr = args;
+
+        if (!tree) {
+            client_print_string(client->socket, "[BEEFMOTE_SYNC_CHUNK] Out of memory\n");
+            break;
+        }
+
+        // The lines sent are the ones hashed, so they always match the hashes.
+        for (int chunks_n = 0; chunks_n < BEEFMOTE_SYNC_CHUNKS_MAX; chunks_n++) {
+            char *end;
+            long chunk = strtol(ptr, &end, 10);
+
+            if (end == ptr) {
+                break;
+            }
+
+            ptr = end;
+
+            if (tree->levels_n == 0 || chunk < 0 || chunk >= tree->level_n[0]) {
+                sprintf(str, "[BEEFMOTE_SYNC_CHUNK] Invalid chunk %ld\n", chunk);
+                client_print_string(client->socket, str);
+                continue;
+            }
+
+            int first = chunk * BEEFMOTE_SYNC_CHUNK;
+            int n = tree->tracks_n - first < BEEFMOTE_SYNC_CHUNK ? tree->tracks_n - first : BEEFMOTE_SYNC_CHUNK;
+
+            sprintf(str, "[BEEFMOTE_SYNC_CHUNK] %ld %d %d %016llx\n", chunk, first, n,
+                    (unsigned long long) tree->level[0][chunk]);
+            client_print_string(client->socket, str);
+            client_print_string(client->socket, tree->lines[chunk]);
+        }
+
+        sprintf(str, "[BEEFMOTE_SYNC_END] %016llx\n", (unsigned long long) tree->root);
+        client_print_string(client->socket, str);
+        break;
+    }
+    }
+}
+
+static void beefmote_command_session(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
+        return;
+    }
+
+    beefmote_session *session = beefmote_client_session(client);
+    if (!session) {
+        client_print_string(client_socket, "[BEEFMOTE_SESSION] Out of memory\n");
+        return;
     }
+
+    deadbeef->mutex_lock(beefmote_clients_mutex);
+    session->token_issued = true;
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
+
+    char str[BEEFMOTE_STR_MAXLENGTH];
+    sprintf(str, "[BEEFMOTE_SESSION] %s\n", session->token);
+    client_print_string(client_socket, str);
 }
 
-static void beefmote_command_play_address(int client_socket, void *data)
+static void beefmote_command_resume(int client_socket, void *data)
 {
     assert(client_socket > 0);
 
-    if(!data) {
+    beefmote_client *client = beefmote_client_get(client_socket);
+    if (!client) {
+        return;
+    }
+
+    char token[BEEFMOTE_SESSION_TOKEN_LENGTH + 1];
+
+    if (!data || sscanf((char*) data, "%32s", token) != 1) {
         client_print_newline(client_socket);
-        client_print_string(client_socket, beefmote_commands[BEEFMOTE_PLAY_ADDRESS].help);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_RESUME].help);
         client_print_newline(client_socket);
         return;
     }
 
-    long addr = strtol((char*) data, NULL, 16);
+    // Everything is sent while holding the lock, so no new event can sneak in
+    // between the replayed ones.
+    deadbeef->mutex_lock(beefmote_clients_mutex);
 
-    DB_playItem_t *track = (DB_playItem_t*) addr;
-    int idx = deadbeef->pl_get_idx_of(track); // get MAIN playlist track index
+    beefmote_sessions_expire();
+    beefmote_session *session = beefmote_session_find(token);
 
-    if(idx == -1) {
-        client_print_string(client_socket, "\nInvalid track memory address\n\n");
+    if (!session) {
+        deadbeef->mutex_unlock(beefmote_clients_mutex);
+        client_print_string(client_socket, "[BEEFMOTE_RESUME_FAILED]\n");
         return;
     }
 
-    deadbeef->sendmessage(DB_EV_PLAY_NUM, 0, idx, 0);
-}
-
-static void beefmote_command_random(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
-    
-    deadbeef->sendmessage(DB_EV_PLAY_RANDOM, 0, 0, 0);
-}
+    // The connection the session was on might not have noticed it's dead yet.
+    if (session->client && session->client != client) {
+        beefmote_debug_print("client %s takes over the session of client %s\n", client->name,
+                             session->client->name);
+        session->client->session = NULL;
+        session->client->closing = true;
+    }
 
-static void beefmote_command_play_resume(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
+    if (client->session && client->session != session) {
+        beefmote_session *own = client->session;
+        own->client = NULL;
+        own->detached_at = beefmote_now_ms();
 
-    if (data) {
-        int idx = strtol((char*) data, NULL, 10);
-        deadbeef->sendmessage(DB_EV_PLAY_NUM, 0, idx, 0);
-        return;
+        if (!own->token_issued) {
+            beefmote_session_free(own);
+        }
     }
 
-    int state = deadbeef->get_output()->state();
+    session->client = client;
+    client->session = session;
 
-    if (state == OUTPUT_STATE_PLAYING) {
-        deadbeef->sendmessage (DB_EV_PAUSE, 0, 0, 0);
-    }
-    else {
-        deadbeef->sendmessage (DB_EV_PLAY_CURRENT, 0, 0, 0);
+    char str[BEEFMOTE_STR_MAXLENGTH];
+    const int settings[BEEFMOTE_NOTIFICATIONS_N + 1] = {
+        BEEFMOTE_NOTIFY_PLAYLIST_CHANGED, BEEFMOTE_NOTIFY_PLAYLIST_SWITCHED, BEEFMOTE_NOTIFY_NOW_PLAYING,
+        BEEFMOTE_NOTIFY_QUEUE, BEEFMOTE_NOTIFY_UPCOMING, BEEFMOTE_NOTIFY_TAGGED,
+    };
+    int len = beefmote_tag_prefix(str, client->tag);
+    len += sprintf(str + len, "[BEEFMOTE_RESUMED] %s", session->token);
+
+    for (int i = 0; i <= BEEFMOTE_NOTIFICATIONS_N; i++) {
+        bool value = i < BEEFMOTE_NOTIFICATIONS_N ? session->notify[i] : session->tagged;
+        len += sprintf(str + len, " %s=%s", beefmote_commands[settings[i]].name, value ? "true" : "false");
     }
-}
-
-static void beefmote_command_stop(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
 
-    deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
-}
+    strcpy(str + len, "\n");
+    beefmote_client_enqueue(client, str, strlen(str), false);
 
-static void beefmote_command_stop_after_current(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
+    // Replay what the client missed, if it's still in the ring.
+    uint64_t oldest = beefmote_event_seq >= BEEFMOTE_REPLAY_MAX ? beefmote_event_seq - BEEFMOTE_REPLAY_MAX + 1 : 1;
+    uint64_t first = session->seq + 1;
+    bool complete = first >= oldest;
+    int replayed_n = 0;
 
-    int value = deadbeef->conf_get_int("playlist.stop_after_current", 0);
-    value = 1 - value;
-    deadbeef->conf_set_int("playlist.stop_after_current", value);
-    deadbeef->sendmessage(DB_EV_CONFIGCHANGED, 0, 0, 0);
-}
+    for (uint64_t seq = complete ? first : oldest; seq <= beefmote_event_seq; seq++) {
+        beefmote_event *event = &beefmote_events[seq % BEEFMOTE_REPLAY_MAX];
 
-static void beefmote_command_previous(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
+        if (event->str && session->notify[event->notification]) {
+            beefmote_client_enqueue_notification(client, event->str);
+            replayed_n++;
+        }
+    }
 
-    deadbeef->sendmessage(DB_EV_PREV, 0, 0, 0);
-}
+    session->seq = beefmote_event_seq;
 
-static void beefmote_command_next(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
+    len = beefmote_tag_prefix(str, client->tag);
+    sprintf(str + len, "[BEEFMOTE_RESUME_END] %d %s\n", replayed_n, complete ? "complete" : "partial");
+    beefmote_client_enqueue(client, str, strlen(str), false);
 
-    deadbeef->sendmessage(DB_EV_NEXT, 0, 0, 0);
+    deadbeef->mutex_unlock(beefmote_clients_mutex);
 }
 
-static void beefmote_command_volume_up(int client_socket, void *data)
+static void beefmote_command_artists(int client_socket, void *data)
 {
     assert(client_socket > 0);
     assert(deadbeef);
 
-    int step;
-    if (data) {
-        step = strtol(data, NULL, 10);
-    }
-    else {
-        step = BEEFMOTE_VOLUME_STEP;
+    int first = data ? strtol((char*) data, NULL, 10) : 0;
+
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    if (!pl_curr) {
+        return;
     }
-    deadbeef->volume_set_db(deadbeef->volume_get_db() + step);
-}
 
-static void beefmote_command_volume_down(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
+    beefmote_search_mirror *mirror = beefmote_search_mirror_get(pl_curr);
+    deadbeef->plt_unref(pl_curr);
 
-    int step;
-    if (data) {
-        step = strtol(data, NULL, 10);
+    if (!mirror || !beefmote_browse_sort(&mirror->browse)) {
+        client_print_string(client_socket, "[BEEFMOTE_ARTISTS_BEGIN] Out of memory\n");
+        return;
     }
-    else {
-        step = BEEFMOTE_VOLUME_STEP;
+
+    beefmote_browse *browse = &mirror->browse;
+    char str[BEEFMOTE_STR_MAXLENGTH];
+
+    if (first < 0 || first > browse->sorted_n) {
+        first = browse->sorted_n;
     }
-    deadbeef->volume_set_db(deadbeef->volume_get_db() - step);
-}
 
-static void beefmote_command_seek_forward(int client_socket, void *data)
-{
-    assert(client_socket > 0);
-    assert(deadbeef);
+    int n = browse->sorted_n - first < BEEFMOTE_BROWSE_PAGE ? browse->sorted_n - first : BEEFMOTE_BROWSE_PAGE;
+
+    sprintf(str, "[BEEFMOTE_ARTISTS_BEGIN] %d %d %d\n", browse->sorted_n, first, n);
+    client_print_string(client_socket, str);
+
+    for (int i = first; i < first + n; i++) {
+        beefmote_artist *artist = &browse->artists[browse->sorted[i]];
+
+        snprintf(str, sizeof(str), "[BEEFMOTE_ARTIST] %d %d %d %s\n", browse->sorted[i], artist->albums_n,
+                 artist->tracks_n, artist->name);
+        client_print_string(client_socket, str);
+    }
 
-    deadbeef->playback_set_pos(deadbeef->playback_get_pos() + BEEFMOTE_SEEK_STEP);
+    client_print_string(client_socket, "[BEEFMOTE_ARTISTS_END]\n");
 }
 
-static void beefmote_command_seek_backward(int client_socket, void *data)
+// Sort order of album ids, for qsort_r.
+static int beefmote_compare_albums(const void *a, const void *b, void *albums)
 {
-    assert(client_socket > 0);
-    assert(deadbeef);
-
-    deadbeef->playback_set_pos(deadbeef->playback_get_pos() - BEEFMOTE_SEEK_STEP);
+    return strcmp(((beefmote_album*) albums)[*(const int*) a].key, ((beefmote_album*) albums)[*(const int*) b].key);
 }
 
-static void beefmote_command_search(int client_socket, void *data)
+static void beefmote_command_albums(int client_socket, void *data)
 {
     assert(client_socket > 0);
+    assert(deadbeef);
 
     if (!data) {
         client_print_newline(client_socket);
-        client_print_string(client_socket, beefmote_commands[BEEFMOTE_SEARCH].help);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ALBUMS].help);
         client_print_newline(client_socket);
         return;
     }
 
-    char *arg = (char*) data;
+    int artist = strtol((char*) data, NULL, 10);
 
     ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
     if (!pl_curr) {
         return;
     }
 
-    deadbeef->plt_search_process(pl_curr, arg);
+    beefmote_search_mirror *mirror = beefmote_search_mirror_get(pl_curr);
+    deadbeef->plt_unref(pl_curr);
 
-    DB_playItem_t *track;
-    int i = 0;
-    bool once = false;
+    if (!mirror) {
+        client_print_string(client_socket, "[BEEFMOTE_ALBUMS_BEGIN] Out of memory\n");
+        return;
+    }
 
-    client_print_newline(client_socket);
+    beefmote_browse *browse = &mirror->browse;
 
-    while (track = deadbeef->plt_get_item_for_idx(pl_curr, i++, PL_SEARCH)) {
-        once = true;
-        char idx[20];
-        sprintf(idx, "(%d)\t", i - 1);
-        client_print_string(client_socket, idx);
-        client_print_track(client_socket, track, false);
-        deadbeef->pl_item_unref(track);
+    if (artist < 0 || artist >= browse->artists_n || browse->artists[artist].tracks_n == 0) {
+        client_print_string(client_socket, "[BEEFMOTE_ALBUMS_BEGIN] Invalid artist\n");
+        return;
     }
 
-    if (once) {
-        client_print_newline(client_socket);
+    // Sorting them where they are, so their positions have to be updated.
+    int *albums = browse->artists[artist].albums;
+    int albums_n = browse->artists[artist].albums_n;
+    char str[BEEFMOTE_STR_MAXLENGTH];
+
+    qsort_r(albums, albums_n, sizeof(int), beefmote_compare_albums, browse->albums);
+
+    for (int i = 0; i < albums_n; i++) {
+        browse->albums[albums[i]].artist_pos = i;
     }
-    else {
-        client_print_string(client_socket, "(nothing was found)\n\n");
+
+    sprintf(str, "[BEEFMOTE_ALBUMS_BEGIN] %d %d\n", artist, albums_n);
+    client_print_string(client_socket, str);
+
+    for (int i = 0; i < albums_n; i++) {
+        beefmote_album *album = &browse->albums[albums[i]];
+        char duration[100];
+
+        deadbeef->pl_format_time(album->duration, duration, sizeof(duration));
+        snprintf(str, sizeof(str), "[BEEFMOTE_ALBUM] %d %d %s %s\n", albums[i], album->tracks_n, duration,
+                 album->name);
+        client_print_string(client_socket, str);
     }
 
-    deadbeef->plt_unref(pl_curr);
+    client_print_string(client_socket, "[BEEFMOTE_ALBUMS_END]\n");
 }
 
-static void beefmote_set_boolean(int client_socket, bool *some_bool, char *some_bool_name,
-                                 char *help, void *true_false)
+// Ascending order of ints, for qsort.
+static int beefmote_compare_ints(const void *a, const void *b)
 {
-    assert(client_socket > 0 && some_bool && some_bool_name && help);
+    return (*(const int*) a > *(const int*) b) - (*(const int*) a < *(const int*) b);
+}
 
-    if(!true_false) {
+static void beefmote_command_album_tracks(int client_socket, void *data)
+{
+    assert(client_socket > 0);
+    assert(deadbeef);
+
+    if (!data) {
         client_print_newline(client_socket);
-        client_print_string(client_socket, help);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ALBUM_TRACKS].help);
         client_print_newline(client_socket);
         return;
     }
 
-    char *str = true_false;
+    int album = strtol((char*) data, NULL, 10);
 
-    if (strcmp(str, "true") == 0) {
-        *some_bool = true;
-        beefmote_debug_print("%s notification set to true\n", some_bool_name);
+    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
+    if (!pl_curr) {
+        return;
     }
-    else if (strcmp(str, "false") == 0) {
-        *some_bool = false;
-        beefmote_debug_print("%s notification set to false\n", some_bool_name);
+
+    beefmote_search_mirror *mirror = beefmote_search_mirror_get(pl_curr);
+    deadbeef->plt_unref(pl_curr);
+
+    if (!mirror) {
+        client_print_string(client_socket, "[BEEFMOTE_ALBUM_TRACKS_BEGIN] Out of memory\n");
+        return;
     }
-    else {
-        client_print_newline(client_socket);
-        client_print_string(client_socket, help);
-        client_print_newline(client_socket);
+
+    if (album < 0 || album >= mirror->browse.albums_n || mirror->browse.albums[album].tracks_n == 0) {
+        client_print_string(client_socket, "[BEEFMOTE_ALBUM_TRACKS_BEGIN] Invalid album\n");
         return;
-    } 
-}
+    }
 
-static void beefmote_command_notify_playlist_changed(int client_socket, void *data)
-{
-    beefmote_set_boolean(client_socket, &beefmote_notify_playlist_changed, "Playlist changed",
-            beefmote_commands[BEEFMOTE_NOTIFY_PLAYLIST_CHANGED].help, data);
-}
+    // Tracks are listed in playlist order. They're sorted where they are, so
+    // their positions have to be updated.
+    int *tracks = mirror->browse.albums[album].tracks;
+    int tracks_n = mirror->browse.albums[album].tracks_n;
+    char str[BEEFMOTE_STR_MAXLENGTH];
 
-static void beefmote_command_notify_playlist_switched(int client_socket, void *data)
-{
-    beefmote_set_boolean(client_socket, &beefmote_notify_playlist_switched, "Playlist switched",
-            beefmote_commands[BEEFMOTE_NOTIFY_PLAYLIST_SWITCHED].help, data);
-}
+    qsort(tracks, tracks_n, sizeof(int), beefmote_compare_ints);
 
-static void beefmote_command_notify_now_playing(int client_socket, void *data)
-{
-    beefmote_set_boolean(client_socket, &beefmote_notify_now_playing, "Now playing",
-            beefmote_commands[BEEFMOTE_NOTIFY_NOW_PLAYING].help, data);
+    sprintf(str, "[BEEFMOTE_ALBUM_TRACKS_BEGIN] %d %d\n", album, tracks_n);
+    client_print_string(client_socket, str);
+
+    for (int i = 0; i < tracks_n; i++) {
+        mirror->album_pos[tracks[i]] = i;
+
+        int len = sprintf(str, "[BEEFMOTE_TRACKLIST_TRACK] (%d) ", tracks[i]);
+        beefmote_format_track(str + len, sizeof(str) - len, mirror->tracks[tracks[i]], true);
+        client_print_string(client_socket, str);
+    }
+
+    client_print_string(client_socket, "[BEEFMOTE_ALBUM_TRACKS_END]\n");
 }
 
-static int playlist_add_to_playbackqueue(int playlist, int index)
+static void beefmote_command_queue_list(int client_socket, void *data)
 {
+    assert(client_socket > 0);
     assert(deadbeef);
-    assert(playlist == PL_MAIN || playlist == PL_SEARCH);
 
-    if (index < 0) {
-        return -1;
-    }
+    // We print our copy, so that queue notifications sent after this apply to it.
+    beefmote_queue_sync();
 
-    ddb_playlist_t *pl_curr = deadbeef->plt_get_curr();
-    if (!pl_curr) {
-        return 0;
-    }
+    deadbeef->mutex_lock(beefmote_queue_mutex);
 
-    DB_playItem_t *track = deadbeef->plt_get_item_for_idx(pl_curr, index, playlist);
-    if (track) {
-        deadbeef->playqueue_push(track);
-        deadbeef->pl_item_unref(track);
-        return 1;
-    }
-    else {
-        return -1;
+    char str[BEEFMOTE_STR_MAXLENGTH];
+
+    sprintf(str, "[BEEFMOTE_QUEUE_BEGIN] %d\n", beefmote_queue_n);
+    client_print_string(client_socket, str);
+
+    for (int i = 0; i < beefmote_queue_n; i++) {
+        int len = sprintf(str, "[BEEFMOTE_QUEUE_TRACK] (%d) ", i);
+        beefmote_format_track(str + len, sizeof(str) - len, beefmote_queue[i], true);
+        client_print_string(client_socket, str);
     }
+
+    client_print_string(client_socket, "[BEEFMOTE_QUEUE_END]\n");
+
+    deadbeef->mutex_unlock(beefmote_queue_mutex);
 }
 
-static void beefmote_command_add_playbackqueue(int client_socket, void *data)
+static void beefmote_command_queue_remove(int client_socket, void *data)
 {
     assert(client_socket > 0);
+    assert(deadbeef);
 
     if (!data) {
         client_print_newline(client_socket);
-        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ADD_PLAYBACKQUEUE].help);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_QUEUE_REMOVE].help);
         client_print_newline(client_socket);
         return;
     }
 
-    int track_index = strtol((char*) data, NULL, 10);
+    char *arg = (char*) data;
+    int pos;
 
-    if (playlist_add_to_playbackqueue(PL_MAIN, track_index) == -1) {
-        client_print_string(client_socket, "[BEEFMOTE_ADD_PLAYBACKQUEUE] Invalid search index\n");
+    if (!strncmp(arg, "0x", 2)) {
+        DB_playItem_t *track = (DB_playItem_t*) (uintptr_t) strtoull(arg, NULL, 16);
+        pos = deadbeef->playqueue_test(track);     // only compares addresses, so any address will do
+    }
+    else {
+        pos = strtol(arg, NULL, 10);
+    }
+
+    if (pos < 0 || pos >= deadbeef->playqueue_get_count() || deadbeef->playqueue_remove_nth(pos) == -1) {
+        client_print_string(client_socket, "[BEEFMOTE_QUEUE_REMOVE] Invalid position or address\n");
         return;
     }
+
+    beefmote_queue_sync();
 }
 
-static void beefmote_command_add_playbackqueue_address(int client_socket, void *data)
+static void beefmote_command_queue_move(int client_socket, void *data)
 {
     assert(client_socket > 0);
     assert(deadbeef);
 
-    if (!data) {
+    int from, to;
+
+    if (!data || sscanf((char*) data, "%d %d", &from, &to) != 2) {
         client_print_newline(client_socket);
-        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ADD_PLAYBACKQUEUE_ADDRESS].help);
+        client_print_string(client_socket, beefmote_commands[BEEFMOTE_QUEUE_MOVE].help);
         client_print_newline(client_socket);
         return;
     }
 
-    long addr = strtol((char*) data, NULL, 16);
-    DB_playItem_t *track = (DB_playItem_t*) addr;
-    int idx = deadbeef->pl_get_idx_of(track); // get MAIN playlist track index
+    int queue_n = deadbeef->playqueue_get_count();
 
-    if(idx == -1 || playlist_add_to_playbackqueue(PL_MAIN, idx) == -1) {
-        client_print_string(client_socket, "[BEEFMOTE_ADD_PLAYBACKQUEUE_ADDRESS] Invalid track memory address\n");
+    if (from < 0 || from >= queue_n || to < 0 || to >= queue_n) {
+        client_print_string(client_socket, "[BEEFMOTE_QUEUE_MOVE] Invalid position\n");
         return;
     }
+
+    DB_playItem_t *track = deadbeef->playqueue_get_item(from);
+    if (!track) {
+        client_print_string(client_socket, "[BEEFMOTE_QUEUE_MOVE] Invalid position\n");
+        return;
+    }
+
+    deadbeef->playqueue_remove_nth(from);
+    deadbeef->playqueue_insert_at(to, track);
+    deadbeef->pl_item_unref(track);
+
+    beefmote_queue_sync();
 }
 
-static void beefmote_command_add_search_playbackqueue(int client_socket, void *data)
+static void beefmote_command_queue_clear(int client_socket, void *data)
 {
     assert(client_socket > 0);
+    assert(deadbeef);
 
-    if (!data) {
-        client_print_newline(client_socket);
-        client_print_string(client_socket, beefmote_commands[BEEFMOTE_ADD_SEARCH_PLAYBACKQUEUE].help);
-        client_print_newline(client_socket);
-        return;
-    }
-
-    int track_index = strtol((char*) data, NULL, 10);
+    deadbeef->playqueue_clear();
+    beefmote_queue_sync();
+}
 
-    if (playlist_add_to_playbackqueue(PL_SEARCH, track_index) == -1) {
-        client_print_string(client_socket, "[BEEFMOTE_ADD_SEARCH_PLAYBACKQUEUE] Invalid search index\n");
-        return;
-    }
+static void beefmote_command_pong(int client_socket, void *data)
+{
+    // Hearing from the client was the point; beefmote_client_read took note.
 }
 
 static void beefmote_command_exit(int client_socket, void *data)
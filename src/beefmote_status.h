@@ -0,0 +1,117 @@
+/*  
+    Copyright (C) 2019 Laureano G. Vaioli <laureano3400@gmail.com>
+   
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Beefmote's status page.
+//
+// Beefmote can publish the player's state in a POSIX shared memory object, so
+// that local programs (status bars, desktop widgets...) can show it without
+// talking to the server at all. The object is named after the user running
+// DeaDBeeF: BEEFMOTE_STATUS_NAME_FORMAT formatted with its uid, e.g.
+// "/beefmote-status-1000". It exists while Beefmote runs, if the status page
+// is turned on in the plugin settings.
+//
+// Beefmote updates the page whenever DeaDBeeF tells it something changed,
+// under a seqlock: seq is odd while an update is going on, and goes up by two
+// with every update. Readers map the object read-only and copy the page with
+// beefmote_status_read, which retries a while until it gets a consistent copy.
+// This header only needs a C99 compiler with GCC's atomic builtins.
+
+#ifndef BEEFMOTE_STATUS_H
+#define BEEFMOTE_STATUS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define BEEFMOTE_STATUS_NAME_FORMAT "/beefmote-status-%u"
+#define BEEFMOTE_STATUS_MAGIC 0x46454542u   // "BEEF"
+#define BEEFMOTE_STATUS_VERSION 1
+#define BEEFMOTE_STATUS_FIELD_LENGTH 256
+#define BEEFMOTE_STATUS_READ_TRIES 100000  // before beefmote_status_read gives up
+
+// Same values as DeaDBeeF's OUTPUT_STATE_*.
+enum BEEFMOTE_STATUS_STATES {
+    BEEFMOTE_STATUS_STOPPED,
+    BEEFMOTE_STATUS_PLAYING,
+    BEEFMOTE_STATUS_PAUSED,
+};
+
+typedef struct beefmote_status {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;                   // odd while the page is being updated
+    uint32_t state;                 // see BEEFMOTE_STATUS_STATES
+    uint64_t position_ms;           // CLOCK_MONOTONIC time position was taken at, in ms
+    uint32_t playlist_generation;   // goes up whenever the content of a playlist changes
+    int32_t playlist;               // index of the current playlist, -1 if none
+    int32_t track;                  // index of the playing track in the current playlist, -1 if none
+    float position;                 // in seconds, see beefmote_status_position
+    float duration;                 // in seconds, 0 if unknown
+    float volume;                   // in dB
+    char artist[BEEFMOTE_STATUS_FIELD_LENGTH];      // empty if there's no playing track
+    char album[BEEFMOTE_STATUS_FIELD_LENGTH];
+    char title[BEEFMOTE_STATUS_FIELD_LENGTH];
+    char tracknumber[BEEFMOTE_STATUS_FIELD_LENGTH];
+} beefmote_status;
+
+// Copies a consistent snapshot of a mapped status page to status. Returns 0,
+// or -1 if the page isn't in the layout this header describes, or if it stayed
+// in the middle of an update for too long (say, DeaDBeeF died while writing
+// it); it's fine to try again later.
+static inline int beefmote_status_read(const beefmote_status *page, beefmote_status *status)
+{
+    int tries = 0;
+
+    for (;;) {
+        if (tries++ == BEEFMOTE_STATUS_READ_TRIES) {
+            return -1;
+        }
+
+        uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1) {
+            continue;
+        }
+
+        memcpy(status, (const void*) page, sizeof(*status));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    return status->magic == BEEFMOTE_STATUS_MAGIC && status->version == BEEFMOTE_STATUS_VERSION ? 0 : -1;
+}
+
+// Returns the playback position of a status snapshot at now_ms (CLOCK_MONOTONIC
+// time, in ms). The page isn't updated as the track plays, so readers work it out.
+static inline float beefmote_status_position(const beefmote_status *status, uint64_t now_ms)
+{
+    float position = status->position;
+
+    if (status->state == BEEFMOTE_STATUS_PLAYING && now_ms > status->position_ms) {
+        position += (now_ms - status->position_ms) / 1000.0f;
+    }
+
+    if (status->duration > 0 && position > status->duration) {
+        position = status->duration;
+    }
+
+    return position;
+}
+
+#endif